@@ -0,0 +1,902 @@
+/* bench.c --- Mesures de performance pour stralloc.  */
+#define _GNU_SOURCE
+#include "stralloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/* Générateur xorshift, pour que chaque exécution fasse la même suite
+   d'allocations.  */
+static size_t rng_next (uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+static size_t rng (void)
+{
+  return rng_next (&rng_state);
+}
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Taille d'une chaîne: surtout des petites, parfois une grosse.  */
+static size_t random_size (void)
+{
+  if (rng () % 64 == 0)
+    return 1 + rng () % 65536;
+  return 1 + rng () % 2000;
+}
+
+/* Garde LIVE chaînes vivantes et en remplace une au hasard à chaque étape.
+   Le plus grand bloc libre montre si l'espace libéré reste utilisable
+   sans `str_compact`.  */
+static void bench_fragmentation (void)
+{
+  enum { LIVE = 4096, STEPS = 1000000, REPORT = 100000 };
+  static String *strs[LIVE];
+  for (int i = 0; i < LIVE; i++)
+    strs[i] = str_alloc (random_size ());
+  for (long step = 1; step <= STEPS; step++)
+    {
+      size_t i = rng () % LIVE;
+      str_free (strs[i]);
+      strs[i] = str_alloc (random_size ());
+      if (step % REPORT == 0)
+        printf ("fragmentation step=%ld live=%zu free=%zu largestfree=%zu"
+                " used=%zu\n", step, str_livesize (), str_freesize (),
+                str_largestfree (), str_usedsize ());
+    }
+  for (int i = 0; i < LIVE; i++)
+    str_free (strs[i]);
+}
+
+/* Mémoire par chaîne et temps d'allocation pour de petites tailles.
+   Chaque taille est mesurée dans un processus à part, pour partir
+   d'une bibliothèque vide.  */
+static void bench_small (void)
+{
+  enum { N = 200000 };
+  static const size_t sizes[] = { 1, 8, 16, 24, 32, 64 };
+  static String *strs[N];
+  for (int k = 0; k < sizeof sizes / sizeof *sizes; k++)
+    {
+      if (fork () != 0)
+        {
+          wait (NULL);
+          continue;
+        }
+      double start = now ();
+      for (int i = 0; i < N; i++)
+        {
+          strs[i] = str_alloc (sizes[k]);
+          *str_data (strs[i]) = i;
+        }
+      double seconds = now () - start;
+      printf ("small size=%zu bytes_per_string=%.1f alloc_ns=%.1f\n",
+              sizes[k], (double) str_usedsize () / N, seconds / N * 1e9);
+      fflush (stdout);
+      exit (0);
+    }
+}
+
+/* Temps par chaîne pour allouer puis libérer des lots de chaînes, une à
+   une et avec `str_alloc_batch`/`str_free_batch`.  */
+static void bench_batch (void)
+{
+  enum { N = 1000, ROUNDS = 1000 };
+  static size_t sizes[N];
+  static String *strs[N];
+  for (int i = 0; i < N; i++)
+    sizes[i] = 1 + rng () % 200;
+  for (int batch = 0; batch <= 1; batch++)
+    {
+      double start = now ();
+      for (int round = 0; round < ROUNDS; round++)
+        if (batch)
+          {
+            str_alloc_batch (sizes, N, strs);
+            str_free_batch (strs, N);
+          }
+        else
+          {
+            for (int i = 0; i < N; i++)
+              strs[i] = str_alloc (sizes[i]);
+            for (int i = 0; i < N; i++)
+              str_free (strs[i]);
+          }
+      double seconds = now () - start;
+      printf ("batch mode=%s alloc_free_ns=%.1f\n",
+              batch ? "batch" : "single", seconds / N / ROUNDS * 1e9);
+    }
+}
+
+/* Défauts de page et temps d'allocation selon la politique de pages,
+   chacune dans un processus à part puisque `str_config` doit précéder la
+   première allocation.  */
+static void bench_policies (void)
+{
+  enum { N = 200000 };
+  static String *strs[N];
+  static const struct
+  {
+    const char *name;
+    StrConfig config;
+  } policies[] = {
+    { "default", { 0 } },
+    { "populate", { .populate = true } },
+    { "base64k", { .base_page_size = 64 << 10 } },
+    { "cap2m", { .base_page_size = 64 << 10, .max_page_size = 2 << 20 } },
+    { "thp", { .huge_page_size = 2 << 20 } },
+    { "hugetlb", { .huge_page_size = 2 << 20, .hugetlb = true } },
+    { "reserve", { .reserve = (size_t) 1 << 32 } },
+    { "reserve_populate", { .reserve = (size_t) 1 << 32,
+                            .populate = true } },
+  };
+  for (int k = 0; k < sizeof policies / sizeof *policies; k++)
+    {
+      if (fork () != 0)
+        {
+          wait (NULL);
+          continue;
+        }
+      str_config (&policies[k].config);
+      struct rusage before, after;
+      getrusage (RUSAGE_SELF, &before);
+      double start = now ();
+      for (int i = 0; i < N; i++)
+        {
+          strs[i] = str_alloc (random_size ());
+          *str_data (strs[i]) = i;
+        }
+      double seconds = now () - start;
+      getrusage (RUSAGE_SELF, &after);
+      printf ("policy name=%s alloc_ns=%.1f minor_faults=%ld"
+              " major_faults=%ld used=%zu\n", policies[k].name,
+              seconds / N * 1e9, after.ru_minflt - before.ru_minflt,
+              after.ru_majflt - before.ru_majflt, str_usedsize ());
+      fflush (stdout);
+      exit (0);
+    }
+}
+
+/* Les chaînes d'une requête, libérées une à une ou toutes ensemble par
+   la remise à zéro de leur arène.  */
+static void bench_arena (void)
+{
+  enum { N = 10000, ROUNDS = 200 };
+  static String *strs[N];
+  StrArena *arena = str_arena_create ();
+  for (int reset = 0; reset <= 1; reset++)
+    {
+      double alloc_seconds = 0, free_seconds = 0;
+      for (int round = 0; round < ROUNDS; round++)
+        {
+          double start = now ();
+          for (int i = 0; i < N; i++)
+            strs[i] = str_arena_alloc (arena, 1 + i % 200);
+          double middle = now ();
+          if (reset)
+            str_arena_reset (arena);
+          else
+            for (int i = 0; i < N; i++)
+              str_free (strs[i]);
+          alloc_seconds += middle - start;
+          free_seconds += now () - middle;
+        }
+      printf ("arena mode=%s strings=%d alloc_ns=%.1f teardown_us=%.1f\n",
+              reset ? "reset" : "free", N, alloc_seconds / N / ROUNDS * 1e9,
+              free_seconds / ROUNDS * 1e6);
+    }
+  str_arena_destroy (arena);
+}
+
+/* Pause de `str_compact_parallel` selon le nombre de threads, sur le même
+   tas à moitié libéré reconstruit chaque fois dans une arène neuve.  */
+static void bench_compact_parallel (long max_threads)
+{
+  enum { N = 65536 };
+  static String *strs[N];
+  double serial = 0;
+  for (long threads = 1; threads <= max_threads; threads *= 2)
+    {
+      StrArena *arena = str_arena_create ();
+      size_t bytes = 0;
+      for (int i = 0; i < N; i++)
+        {
+          strs[i] = str_arena_alloc (arena, 1024 + rng () % 6144);
+          memset (str_data (strs[i]), 'x', str_size (strs[i]));
+        }
+      for (int i = 0; i < N; i++)
+        if (i % 2 == 0)
+          str_free (strs[i]);
+        else
+          bytes += str_size (strs[i]);
+      double start = now ();
+      str_arena_compact_parallel (arena, threads);
+      double seconds = now () - start;
+      if (threads == 1)
+        serial = seconds;
+      printf ("compact_parallel threads=%ld bytes=%zu pause_ms=%.2f"
+              " speedup=%.2f\n", threads, bytes, seconds * 1e3,
+              serial / seconds);
+      str_arena_destroy (arena);
+    }
+}
+
+/* Des clés répétées, comme des noms d'hôtes: débit de `str_intern` et
+   mémoire économisée par rapport à une copie par clé.  */
+static void bench_intern (void)
+{
+  enum { N = 1000000, KEYS = 5000 };
+  static String *strs[N];
+  char key[64];
+  size_t live = str_livesize ();
+  size_t copied = 0;
+  double start = now ();
+  for (int i = 0; i < N; i++)
+    {
+      int len = sprintf (key, "host-%zu.example.com", rng () % KEYS);
+      strs[i] = str_intern (key, len);
+      copied += len;
+    }
+  double seconds = now () - start;
+  size_t interned = str_livesize () - live;
+  printf ("intern strings=%d mops=%.2f live=%zu copies=%zu saved=%zu\n",
+          N, N / seconds / 1e6, interned, copied, copied - interned);
+  for (int i = 0; i < N; i++)
+    str_free (strs[i]);
+}
+
+/* Les opérations vectorisées à chaque niveau, comparées à la libc sur
+   les mêmes bytes: débit en Go/s pour une égalité, une recherche de byte
+   absent, une recherche de motif absent et un hachage.  */
+static volatile size_t simd_sink;
+
+static void bench_simd (void)
+{
+  static const size_t sizes[] = { 16, 64, 256, 4096, 65536 };
+  static const char *const levels[] = { "scalar", "sse42", "avx2" };
+  String *needle = str_alloc (8);
+  memcpy (str_data (needle), "needle!!", 8);
+  for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    {
+      size_t size = sizes[i];
+      size_t rounds = (64 << 20) / size;
+      String *a = str_alloc (size);
+      String *b = str_alloc (size);
+      for (size_t j = 0; j < size; j++)
+        str_data (a)[j] = str_data (b)[j] = 'a' + j % 23;
+      const char *x = str_cdata (a), *y = str_cdata (b);
+      double start = now ();
+      for (size_t r = 0; r < rounds; r++)
+        simd_sink += memcmp (x, y, size) == 0;
+      double equal = now () - start;
+      start = now ();
+      for (size_t r = 0; r < rounds; r++)
+        simd_sink += memchr (x, '#', size) == NULL;
+      double find_byte = now () - start;
+      start = now ();
+      for (size_t r = 0; r < rounds; r++)
+        simd_sink += memmem (x, size, "needle!!", 8) == NULL;
+      double find = now () - start;
+      double bytes = (double) size * rounds / 1e9;
+      printf ("simd level=libc size=%zu equal_gbps=%.2f find_byte_gbps=%.2f"
+              " find_gbps=%.2f\n", size, bytes / equal, bytes / find_byte,
+              bytes / find);
+      for (int level = STR_SIMD_SCALAR; level <= STR_SIMD_AVX2; level++)
+        {
+          if (str_simd_set (level) != level)
+            continue;
+          start = now ();
+          for (size_t r = 0; r < rounds; r++)
+            simd_sink += str_equal (a, b);
+          equal = now () - start;
+          start = now ();
+          for (size_t r = 0; r < rounds; r++)
+            simd_sink += str_find_byte (a, '#');
+          find_byte = now () - start;
+          start = now ();
+          for (size_t r = 0; r < rounds; r++)
+            simd_sink += str_find (a, needle);
+          find = now () - start;
+          start = now ();
+          for (size_t r = 0; r < rounds; r++)
+            simd_sink += str_hash (a);
+          double hash = now () - start;
+          printf ("simd level=%s size=%zu equal_gbps=%.2f"
+                  " find_byte_gbps=%.2f find_gbps=%.2f hash_gbps=%.2f\n",
+                  levels[level], size, bytes / equal, bytes / find_byte,
+                  bytes / find, bytes / hash);
+        }
+      str_free (a);
+      str_free (b);
+    }
+  str_simd_set (STR_SIMD_AVX2);
+  str_free (needle);
+}
+
+/* Suite de charges réalistes, chacune mesurée avec stralloc et avec
+   malloc, dans un processus à part pour que le pic de RSS soit le sien.
+   Chaque ligne donne le débit, les percentiles de latence par opération,
+   le pic de RSS et le surcoût: la mémoire résidente ajoutée par la charge
+   rapportée aux bytes des chaînes vivantes à la fin.  */
+
+/* Les opérations des chaînes d'une bibliothèque.  */
+typedef struct Backend
+{
+  const char *name;
+  void *(*alloc) (size_t size);
+  void (*release) (void *s);
+  char *(*data) (void *s);
+  void *(*concat) (void *s1, void *s2);
+} Backend;
+
+static void *stralloc_alloc (size_t size)
+{
+  return str_alloc (size);
+}
+
+static void stralloc_release (void *s)
+{
+  str_free (s);
+}
+
+static char *stralloc_data (void *s)
+{
+  return str_data (s);
+}
+
+static void *stralloc_concat (void *s1, void *s2)
+{
+  return str_concat (s1, s2);
+}
+
+/* La chaîne la plus simple avec malloc: sa taille, puis son contenu.  */
+typedef struct MString
+{
+  size_t size;
+  char data[];
+} MString;
+
+static void *malloc_alloc (size_t size)
+{
+  MString *s = malloc (sizeof (MString) + size);
+  s->size = size;
+  return s;
+}
+
+static void malloc_release (void *s)
+{
+  free (s);
+}
+
+static char *malloc_data (void *s)
+{
+  return ((MString *) s)->data;
+}
+
+static void *malloc_concat (void *s1, void *s2)
+{
+  MString *a = s1, *b = s2;
+  MString *s = malloc_alloc (a->size + b->size);
+  memcpy (s->data, a->data, a->size);
+  memcpy (s->data + a->size, b->data, b->size);
+  return s;
+}
+
+static const Backend backends[] = {
+  { "stralloc", stralloc_alloc, stralloc_release, stralloc_data,
+    stralloc_concat },
+  { "malloc", malloc_alloc, malloc_release, malloc_data, malloc_concat },
+};
+
+/* Latences des opérations, en nanosecondes.  */
+enum { MAX_SAMPLES = 1 << 21 };
+static float samples[MAX_SAMPLES];
+static size_t nsamples;
+
+static void sample (double seconds)
+{
+  if (nsamples < MAX_SAMPLES)
+    samples[nsamples++] = seconds * 1e9;
+}
+
+static int compare_floats (const void *a, const void *b)
+{
+  float x = *(const float *) a, y = *(const float *) b;
+  return (x > y) - (x < y);
+}
+
+static double percentile (double p)
+{
+  if (nsamples == 0)
+    return 0;
+  return samples[(size_t) (p * (nsamples - 1))];
+}
+
+/* Mémoire résidente actuelle du processus.  */
+static size_t resident_size (void)
+{
+  size_t pages = 0, resident = 0;
+  FILE *f = fopen ("/proc/self/statm", "r");
+  if (f != NULL)
+    {
+      if (fscanf (f, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+      fclose (f);
+    }
+  return resident * sysconf (_SC_PAGESIZE);
+}
+
+static size_t suite_rss;
+
+/* Écrit la ligne d'une charge.  `live` est la somme des tailles des
+   chaînes encore vivantes, à libérer après l'appel.  */
+static void report (const char *workload, const Backend *backend,
+                    double seconds, size_t live)
+{
+  size_t added = resident_size () - suite_rss;
+  size_t ops = nsamples;
+  qsort (samples, nsamples, sizeof *samples, compare_floats);
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("suite workload=%s backend=%s ops=%zu mops=%.3f p50_ns=%.0f"
+          " p99_ns=%.0f p999_ns=%.0f peak_rss_kb=%ld live=%zu"
+          " overhead=%.3f\n", workload, backend->name, ops,
+          ops / seconds / 1e6, percentile (0.5), percentile (0.99),
+          percentile (0.999), usage.ru_maxrss, live,
+          live != 0 ? (double) added / live : 0);
+}
+
+/* Remplace au hasard une chaîne parmi `live_count`, de taille entre
+   `min` et `max`, en écrivant tout son contenu.  */
+static void churn (const char *workload, const Backend *backend,
+                   int live_count, long ops, size_t min, size_t max)
+{
+  void **strs = malloc (live_count * sizeof *strs);
+  size_t *sizes = malloc (live_count * sizeof *sizes);
+  size_t live = 0;
+  for (int i = 0; i < live_count; i++)
+    {
+      sizes[i] = min + rng () % (max - min + 1);
+      strs[i] = backend->alloc (sizes[i]);
+      memset (backend->data (strs[i]), i, sizes[i]);
+      live += sizes[i];
+    }
+  double start = now ();
+  for (long op = 0; op < ops; op++)
+    {
+      size_t i = rng () % live_count;
+      size_t size = min + rng () % (max - min + 1);
+      double op_start = now ();
+      backend->release (strs[i]);
+      strs[i] = backend->alloc (size);
+      sample (now () - op_start);
+      memset (backend->data (strs[i]), op, size);
+      live += size - sizes[i];
+      sizes[i] = size;
+    }
+  report (workload, backend, now () - start, live);
+  for (int i = 0; i < live_count; i++)
+    backend->release (strs[i]);
+  free (sizes);
+  free (strs);
+}
+
+static void suite_churn_small (const Backend *backend)
+{
+  churn ("churn_small", backend, 100000, 1000000, 1, 64);
+}
+
+static void suite_churn_large (const Backend *backend)
+{
+  churn ("churn_large", backend, 32, 2000, 64 << 10, 4 << 20);
+}
+
+/* Des chaînes construites morceau par morceau, comme une réponse: chaque
+   concaténation remplace la chaîne précédente.  */
+static void suite_concat (const Backend *backend)
+{
+  enum { CHAINS = 2000, PIECES = 64, KEPT = 256 };
+  static void *kept[KEPT];
+  static size_t kept_sizes[KEPT];
+  void *pieces[PIECES];
+  size_t piece_sizes[PIECES];
+  size_t live = 0;
+  for (int i = 0; i < PIECES; i++)
+    {
+      piece_sizes[i] = 1 + rng () % 100;
+      pieces[i] = backend->alloc (piece_sizes[i]);
+      memset (backend->data (pieces[i]), 'a' + i % 26, piece_sizes[i]);
+      live += piece_sizes[i];
+    }
+  double start = now ();
+  for (int chain = 0; chain < CHAINS; chain++)
+    {
+      void *s = backend->alloc (0);
+      size_t size = 0;
+      for (int i = 0; i < PIECES; i++)
+        {
+          size_t piece = rng () % PIECES;
+          double op_start = now ();
+          void *t = backend->concat (s, pieces[piece]);
+          backend->release (s);
+          sample (now () - op_start);
+          s = t;
+          size += piece_sizes[piece];
+        }
+      /* Les dernières chaînes restent vivantes, comme un cache.  */
+      int k = chain % KEPT;
+      if (kept[k] != NULL)
+        backend->release (kept[k]);
+      live += size - kept_sizes[k];
+      kept[k] = s;
+      kept_sizes[k] = size;
+    }
+  report ("concat_chain", backend, now () - start, live);
+  for (int i = 0; i < KEPT; i++)
+    backend->release (kept[i]);
+  for (int i = 0; i < PIECES; i++)
+    backend->release (pieces[i]);
+}
+
+/* Tire un rang entre 0 et n-1 selon une loi de Zipf, dont `cdf` est la
+   fonction de répartition.  */
+static size_t zipf (const double *cdf, size_t n)
+{
+  double u = (rng () >> 11) * 0x1.0p-53;
+  size_t low = 0, high = n - 1;
+  while (low < high)
+    {
+      size_t middle = (low + high) / 2;
+      if (cdf[middle] < u)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+  return low;
+}
+
+static double *zipf_cdf (size_t n, double exponent)
+{
+  double *cdf = malloc (n * sizeof *cdf);
+  double sum = 0;
+  for (size_t i = 0; i < n; i++)
+    cdf[i] = sum += 1 / pow (i + 1, exponent);
+  for (size_t i = 0; i < n; i++)
+    cdf[i] /= sum;
+  return cdf;
+}
+
+/* Tailles et durées de vie selon des lois de Zipf: surtout des petites
+   chaînes, quelques très grosses, et les cases de rang faible sont
+   remplacées bien plus souvent que les autres, si bien que des chaînes
+   très éphémères côtoient des chaînes qui vivent tout le long.  Avec
+   stralloc, la même charge mesure ensuite la pause de chaque sorte de
+   compaction.  */
+static void suite_zipf (const Backend *backend)
+{
+  enum { LIVE = 50000, OPS = 1000000, SIZE_RANKS = 4096 };
+  double *size_cdf = zipf_cdf (SIZE_RANKS, 1.2);
+  double *slot_cdf = zipf_cdf (LIVE, 1.0);
+  void **strs = malloc (LIVE * sizeof *strs);
+  size_t *sizes = malloc (LIVE * sizeof *sizes);
+  size_t live = 0;
+  for (int i = 0; i < LIVE; i++)
+    {
+      sizes[i] = 8 * (1 + zipf (size_cdf, SIZE_RANKS));
+      strs[i] = backend->alloc (sizes[i]);
+      memset (backend->data (strs[i]), i, sizes[i]);
+      live += sizes[i];
+    }
+  double start = now ();
+  for (long op = 0; op < OPS; op++)
+    {
+      size_t i = zipf (slot_cdf, LIVE);
+      size_t size = 8 * (1 + zipf (size_cdf, SIZE_RANKS));
+      double op_start = now ();
+      backend->release (strs[i]);
+      strs[i] = backend->alloc (size);
+      sample (now () - op_start);
+      memset (backend->data (strs[i]), op, size);
+      live += size - sizes[i];
+      sizes[i] = size;
+    }
+  report ("zipf_mix", backend, now () - start, live);
+
+  if (backend == &backends[0])
+    {
+      /* Chaque compaction après un nouveau mélange.  */
+      static const char *const kinds[] = { "partial", "in_place", "full" };
+      for (int k = 0; k < 3; k++)
+        {
+          for (long op = 0; op < OPS / 10; op++)
+            {
+              size_t i = zipf (slot_cdf, LIVE);
+              str_free (strs[i]);
+              strs[i] = str_alloc (sizes[i]);
+            }
+          size_t free_before = str_freesize ();
+          double compact_start = now ();
+          if (k == 0)
+            str_compact_partial ((size_t) -1);
+          else if (k == 1)
+            str_compact_in_place ();
+          else
+            str_compact ();
+          double seconds = now () - compact_start;
+          printf ("suite_compact kind=%s live=%zu pause_us=%.1f"
+                  " free_before=%zu free_after=%zu\n", kinds[k],
+                  str_livesize (), seconds * 1e6, free_before,
+                  str_freesize ());
+        }
+    }
+  for (int i = 0; i < LIVE; i++)
+    backend->release (strs[i]);
+  free (sizes);
+  free (strs);
+  free (slot_cdf);
+  free (size_cdf);
+}
+
+/* Coût des fonctions de taille avec beaucoup de chaînes vivantes, et de
+   mallinfo2, ce qui s'en rapproche le plus avec malloc.  */
+static void suite_queries (void)
+{
+  enum { LIVE = 100000, CALLS = 100000 };
+  static String *strs[LIVE];
+  for (int i = 0; i < LIVE; i++)
+    strs[i] = str_alloc (1 + rng () % 1000);
+  for (int i = 0; i < LIVE; i += 3)
+    str_free (strs[i]);
+  static const char *const names[] = { "str_livesize", "str_freesize",
+                                       "str_largestfree", "str_stats",
+                                       "mallinfo2" };
+  volatile size_t sink = 0;
+  for (int k = 0; k < 5; k++)
+    {
+      int calls = k >= 2 ? CALLS / 100 : CALLS;
+      double start = now ();
+      for (int i = 0; i < calls; i++)
+        switch (k)
+          {
+          case 0: sink += str_livesize (); break;
+          case 1: sink += str_freesize (); break;
+          case 2: sink += str_largestfree (); break;
+          case 3: sink += str_stats ().strings; break;
+          default: sink += mallinfo2 ().uordblks; break;
+          }
+      printf ("suite_query name=%s calls=%d ns=%.1f\n", names[k], calls,
+              (now () - start) / calls * 1e9);
+    }
+  for (int i = 1; i < LIVE; i++)
+    if (i % 3 != 0)
+      str_free (strs[i]);
+}
+
+/* Un thread qui libère les trois quarts de ses chaînes puis en alloue et
+   libère d'autres de tailles variées, sans puis avec la compaction en
+   arrière-plan: débit, latences des opérations et mémoire utilisée à la
+   fin.  */
+static void bench_compact_background (void)
+{
+  enum { LIVE = 20000, OPS = 2000000 };
+  static String *strs[LIVE], *dropped[3 * LIVE];
+  for (int background = 0; background <= 1; background++)
+    {
+      if (background)
+        str_compact_background_start (1);
+      for (int i = 0; i < LIVE; i++)
+        {
+          strs[i] = str_alloc (random_size ());
+          for (int j = 0; j < 3; j++)
+            dropped[3 * i + j] = str_alloc (random_size ());
+        }
+      for (int i = 0; i < 3 * LIVE; i++)
+        str_free (dropped[i]);
+      nsamples = 0;
+      double start = now ();
+      for (int i = 0; i < OPS; i++)
+        {
+          size_t victim = rng () % LIVE;
+          double op_start = now ();
+          str_free (strs[victim]);
+          strs[victim] = str_alloc (random_size ());
+          str_data (strs[victim])[0] = 'x';
+          sample (now () - op_start);
+        }
+      double seconds = now () - start;
+      size_t used = str_usedsize ();
+      str_compact_background_stop ();
+      qsort (samples, nsamples, sizeof *samples, compare_floats);
+      printf ("compact_background background=%d mops=%.2f p50_ns=%.0f"
+              " p99_ns=%.0f p999_ns=%.0f max_ns=%.0f used=%zu\n",
+              background, OPS / seconds / 1e6, percentile (0.5),
+              percentile (0.99), percentile (0.999), percentile (1), used);
+      for (int i = 0; i < LIVE; i++)
+        str_free (strs[i]);
+    }
+}
+
+/* Un tas dont les trois quarts des chaînes viennent d'être libérées:
+   mémoire résidente rendue par `str_release_free_memory` et sa durée,
+   puis les mêmes mesures pour `str_compact`, qui copie tout.  */
+static void bench_release (void)
+{
+  enum { LIVE = 20000 };
+  static String *strs[4 * LIVE];
+  for (int i = 0; i < 4 * LIVE; i++)
+    {
+      strs[i] = str_alloc (random_size ());
+      memset (str_data (strs[i]), 'x', str_size (strs[i]));
+    }
+  for (int i = 0; i < 4 * LIVE; i++)
+    if (i % 4 != 0)
+      str_free (strs[i]);
+  size_t rss = resident_size ();
+  double start = now ();
+  size_t released = str_release_free_memory ();
+  double seconds = now () - start;
+  size_t rss_released = resident_size ();
+  start = now ();
+  str_compact ();
+  double compact_seconds = now () - start;
+  printf ("release released=%zu pause_ms=%.2f rss_before=%zu"
+          " rss_after=%zu compact_pause_ms=%.2f rss_compacted=%zu\n",
+          released, seconds * 1e3, rss, rss_released, compact_seconds * 1e3,
+          resident_size ());
+  for (int i = 0; i < 4 * LIVE; i += 4)
+    str_free (strs[i]);
+}
+
+static void bench_suite (void)
+{
+  static void (*const workloads[]) (const Backend *) = {
+    suite_churn_small, suite_churn_large, suite_concat, suite_zipf,
+  };
+  /* Sans quoi les processus fils répètent ce qui attend d'être écrit.  */
+  fflush (stdout);
+  for (int w = 0; w < sizeof workloads / sizeof *workloads; w++)
+    for (int b = 0; b < sizeof backends / sizeof *backends; b++)
+      {
+        if (fork () != 0)
+          {
+            wait (NULL);
+            continue;
+          }
+        /* Les latences ne comptent pas dans la mémoire de l'allocateur:
+           leurs pages sont résidentes avant la mesure de départ.  */
+        memset (samples, 0, sizeof samples);
+        suite_rss = resident_size ();
+        workloads[w] (&backends[b]);
+        fflush (stdout);
+        exit (0);
+      }
+  if (fork () != 0)
+    {
+      wait (NULL);
+      return;
+    }
+  suite_queries ();
+  fflush (stdout);
+  exit (0);
+}
+
+/* Chaque thread remplace au hasard ses chaînes, puis libère celles du
+   thread suivant.  Sans le mode multi-thread, tous les appels passent par
+   un seul verrou global, comme le faisait le client.  */
+enum { MAX_THREADS = 32, THREAD_LIVE = 1024, THREAD_OPS = 500000 };
+static String *thread_strs[MAX_THREADS][THREAD_LIVE];
+static pthread_barrier_t barrier;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool use_global_lock;
+static long nthreads;
+
+static void lock (void)
+{
+  if (use_global_lock)
+    pthread_mutex_lock (&global_lock);
+}
+
+static void unlock (void)
+{
+  if (use_global_lock)
+    pthread_mutex_unlock (&global_lock);
+}
+
+static void *churn_thread (void *arg)
+{
+  long id = (long) arg;
+  uint64_t state = 88172645463325252ULL + id;
+  String **strs = thread_strs[id];
+  for (int i = 0; i < THREAD_LIVE; i++)
+    {
+      lock ();
+      strs[i] = str_alloc (1 + rng_next (&state) % 200);
+      unlock ();
+    }
+  for (long op = 0; op < THREAD_OPS; op++)
+    {
+      size_t i = rng_next (&state) % THREAD_LIVE;
+      lock ();
+      str_free (strs[i]);
+      strs[i] = str_alloc (1 + rng_next (&state) % 200);
+      unlock ();
+    }
+  pthread_barrier_wait (&barrier);
+  String **other = thread_strs[(id + 1) % nthreads];
+  for (int i = 0; i < THREAD_LIVE; i++)
+    {
+      lock ();
+      str_free (other[i]);
+      unlock ();
+    }
+  return NULL;
+}
+
+static void bench_threads (const char *mode, long max_threads)
+{
+  for (nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+    {
+      pthread_t threads[MAX_THREADS];
+      pthread_barrier_init (&barrier, NULL, nthreads);
+      double start = now ();
+      for (long i = 0; i < nthreads; i++)
+        pthread_create (&threads[i], NULL, churn_thread, (void *) i);
+      for (long i = 0; i < nthreads; i++)
+        pthread_join (threads[i], NULL);
+      double seconds = now () - start;
+      pthread_barrier_destroy (&barrier);
+      long ops = nthreads * (2 * THREAD_OPS + 2 * THREAD_LIVE);
+      printf ("threads mode=%s threads=%ld ops=%ld seconds=%.3f"
+              " mops=%.2f\n", mode, nthreads, ops, seconds,
+              ops / seconds / 1e6);
+    }
+}
+
+int main (int argc, char **argv)
+{
+  /* Le nombre de threads maximal peut être donné en argument.  */
+  long max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (argc > 1)
+    max_threads = atol (argv[1]);
+  if (max_threads > MAX_THREADS)
+    max_threads = MAX_THREADS;
+
+  bench_small ();
+  bench_policies ();
+  bench_batch ();
+  bench_intern ();
+  bench_arena ();
+  bench_simd ();
+  bench_compact_parallel (max_threads);
+  bench_compact_background ();
+  bench_release ();
+  bench_fragmentation ();
+  bench_suite ();
+
+  use_global_lock = true;
+  bench_threads ("mutex", max_threads);
+  use_global_lock = false;
+  str_threads_enable ();
+  bench_threads ("arena", max_threads);
+  return 0;
+}
@@ -0,0 +1,345 @@
+/* replay.c --- Rejoue une trace enregistrée par `str_trace_start`.  */
+#include "stralloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* La trace, lue d'un coup, et la position du prochain byte.  */
+static unsigned char *trace;
+static size_t trace_size;
+static size_t pos;
+static size_t last_id;
+
+static size_t get (void)
+{
+  size_t value = 0;
+  for (int shift = 0; pos < trace_size; shift += 7)
+    {
+      unsigned char byte = trace[pos++];
+      value |= (size_t) (byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+  return value;
+}
+
+static size_t get_id (void)
+{
+  size_t zigzag = get ();
+  last_id += (zigzag >> 1) ^ -(zigzag & 1);
+  return last_id;
+}
+
+/* Les chaînes rejouées, par identifiant d'origine: adressage ouvert avec
+   sondage linéaire, sans pierres tombales.  Une chaîne internée est
+   renvoyée plusieurs fois sous le même identifiant, et n'est retirée
+   qu'à sa dernière libération.  */
+typedef struct Slot
+{
+  size_t id;
+  String *str;
+  size_t references;
+} Slot;
+static Slot *slots;
+static size_t capacity;
+static size_t count;
+
+static size_t slot_of (size_t id)
+{
+  size_t slot = (id * 0x9e3779b97f4a7c15ULL) >> 20;
+  slot &= capacity - 1;
+  while (slots[slot].str != NULL && slots[slot].id != id)
+    slot = (slot + 1) & (capacity - 1);
+  return slot;
+}
+
+static void put (size_t id, String *str)
+{
+  if ((count + 1) * 2 > capacity)
+    {
+      Slot *old = slots;
+      size_t old_capacity = capacity;
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      slots = calloc (capacity, sizeof *slots);
+      for (size_t i = 0; i < old_capacity; i++)
+        if (old[i].str != NULL)
+          slots[slot_of (old[i].id)] = old[i];
+      free (old);
+    }
+  size_t slot = slot_of (id);
+  if (slots[slot].str == NULL)
+    {
+      count++;
+      slots[slot].references = 0;
+    }
+  slots[slot].id = id;
+  slots[slot].str = str;
+  slots[slot].references++;
+}
+
+static String *lookup (size_t id)
+{
+  if (capacity == 0)
+    return NULL;
+  return slots[slot_of (id)].str;
+}
+
+/* Enlève une référence à `id`, et `id` lui-même à la dernière, en
+   ramenant les suivants de sa séquence qui ne sont pas à leur place.  */
+static void take (size_t id)
+{
+  size_t slot = slot_of (id);
+  if (slots[slot].str == NULL || --slots[slot].references != 0)
+    return;
+  count--;
+  size_t next = slot;
+  for (;;)
+    {
+      slots[slot].str = NULL;
+      for (;;)
+        {
+          next = (next + 1) & (capacity - 1);
+          if (slots[next].str == NULL)
+            return;
+          size_t home = ((slots[next].id * 0x9e3779b97f4a7c15ULL) >> 20)
+                        & (capacity - 1);
+          /* Reste en place si sa place est entre `slot` et `next`.  */
+          if (((next - home) & (capacity - 1))
+              >= ((next - slot) & (capacity - 1)))
+            break;
+        }
+      slots[slot] = slots[next];
+      slot = next;
+    }
+}
+
+/* Un contenu qui ne dépend que du hachage enregistré, pour que les
+   contenus égaux à l'origine le soient encore.  */
+static char *content_of (size_t hash, size_t size)
+{
+  static char *buffer;
+  static size_t buffer_size;
+  if (size > buffer_size)
+    {
+      buffer_size = size;
+      buffer = realloc (buffer, size);
+    }
+  for (size_t i = 0; i < size; i++)
+    buffer[i] = hash >> (8 * (i % 4));
+  return buffer;
+}
+
+static void usage (const char *name)
+{
+  fprintf (stderr, "Usage: %s [-b base_page_size] [-m max_page_size]"
+           " [-h huge_page_size] [-r reserve] [-p] [-l large_threshold]"
+           " [-c compact_threshold] [-i interval] [-R]"
+           " [-H csv|json] trace\n", name);
+  exit (2);
+}
+
+static void report_memory (size_t record, double seconds)
+{
+  StrStats stats = str_stats ();
+  printf ("replay_memory record=%zu seconds=%.3f live=%zu free=%zu"
+          " used=%zu largestfree=%zu strings=%zu pages=%zu\n", record,
+          seconds, stats.livesize, stats.freesize, stats.usedsize,
+          stats.largestfree, stats.strings, stats.pages);
+}
+
+int main (int argc, char **argv)
+{
+  StrConfig config = { 0 };
+  size_t interval = 100000;
+  bool ropes = false;
+  /* La carte du tas à écrire à la fin, -1 pour aucune.  */
+  int map_format = -1;
+  int opt;
+  while ((opt = getopt (argc, argv, "b:m:h:r:pl:c:i:RH:")) != -1)
+    switch (opt)
+      {
+      case 'b': config.base_page_size = strtoull (optarg, NULL, 0); break;
+      case 'm': config.max_page_size = strtoull (optarg, NULL, 0); break;
+      case 'h': config.huge_page_size = strtoull (optarg, NULL, 0); break;
+      case 'r': config.reserve = strtoull (optarg, NULL, 0); break;
+      case 'p': config.populate = true; break;
+      case 'l': str_large_threshold (strtoull (optarg, NULL, 0)); break;
+      case 'c': str_compact_threshold (atof (optarg)); break;
+      case 'i': interval = strtoull (optarg, NULL, 0); break;
+      case 'R': ropes = true; break;
+      case 'H':
+        if (strcmp (optarg, "csv") == 0)
+          map_format = STR_MAP_CSV;
+        else if (strcmp (optarg, "json") == 0)
+          map_format = STR_MAP_JSON;
+        else
+          usage (argv[0]);
+        break;
+      default: usage (argv[0]);
+      }
+  if (optind + 1 != argc)
+    usage (argv[0]);
+  str_config (&config);
+  str_ropes_enable (ropes);
+
+  FILE *f = fopen (argv[optind], "rb");
+  if (f == NULL)
+    {
+      perror (argv[optind]);
+      return 1;
+    }
+  fseek (f, 0, SEEK_END);
+  trace_size = ftell (f);
+  fseek (f, 0, SEEK_SET);
+  trace = malloc (trace_size);
+  if (fread (trace, 1, trace_size, f) != trace_size || trace_size < 8
+      || memcmp (trace, STR_TRACE_MAGIC, 8) != 0)
+    {
+      fprintf (stderr, "%s: not a stralloc trace\n", argv[optind]);
+      return 1;
+    }
+  fclose (f);
+  pos = 8;
+
+  size_t records = 0, unknown = 0;
+  uint64_t traced_ns = 0;
+  size_t peak_used = 0;
+  double compact_seconds = 0;
+  double start = now ();
+  while (pos < trace_size)
+    {
+      int op = trace[pos++];
+      traced_ns += get ();
+      String *s = NULL;
+      size_t id, size;
+      switch (op)
+        {
+        case STR_TRACE_ALLOC:
+          id = get_id ();
+          put (id, str_alloc (get ()));
+          break;
+        case STR_TRACE_FREE:
+          id = get_id ();
+          s = lookup (id);
+          if (s == NULL)
+            {
+              unknown++;
+              break;
+            }
+          str_free (s);
+          take (id);
+          break;
+        case STR_TRACE_CONCAT:
+          {
+            id = get_id ();
+            String *s1 = lookup (get_id ());
+            String *s2 = lookup (get_id ());
+            if (s1 == NULL || s2 == NULL)
+              {
+                unknown++;
+                break;
+              }
+            put (id, str_concat (s1, s2));
+            break;
+          }
+        case STR_TRACE_COMPACT:
+          {
+            static const char *const kinds[] = { "full", "in_place",
+                                                 "partial" };
+            size_t kind = get ();
+            size_t budget = kind == STR_TRACE_COMPACT_PARTIAL ? get () : 0;
+            StrStats before = str_stats ();
+            double compact_start = now ();
+            size_t moved = 0;
+            if (kind == STR_TRACE_COMPACT_FULL)
+              str_compact ();
+            else if (kind == STR_TRACE_COMPACT_IN_PLACE)
+              str_compact_in_place ();
+            else
+              moved = str_compact_partial (budget);
+            double pause = now () - compact_start;
+            compact_seconds += pause;
+            StrStats after = str_stats ();
+            printf ("replay_compact record=%zu kind=%s pause_us=%.1f"
+                    " moved=%zu free_before=%zu free_after=%zu"
+                    " used_before=%zu used_after=%zu largestfree_before=%zu"
+                    " largestfree_after=%zu\n", records,
+                    kind < 3 ? kinds[kind] : "unknown", pause * 1e6, moved,
+                    before.freesize, after.freesize, before.usedsize,
+                    after.usedsize, before.largestfree, after.largestfree);
+            break;
+          }
+        case STR_TRACE_RESIZE:
+          s = lookup (get_id ());
+          size = get ();
+          if (s == NULL)
+            unknown++;
+          else
+            str_resize (s, size);
+          break;
+        case STR_TRACE_DUP:
+          id = get_id ();
+          s = lookup (get_id ());
+          if (s == NULL)
+            unknown++;
+          else
+            put (id, str_dup (s));
+          break;
+        case STR_TRACE_SUBSTR:
+          {
+            id = get_id ();
+            s = lookup (get_id ());
+            size_t offset = get ();
+            size = get ();
+            if (s == NULL)
+              unknown++;
+            else
+              put (id, str_substr (s, offset, size));
+            break;
+          }
+        case STR_TRACE_INTERN:
+          {
+            id = get_id ();
+            size = get ();
+            size_t hash = get ();
+            put (id, str_intern (content_of (hash, size), size));
+            break;
+          }
+        default:
+          fprintf (stderr, "%s: unknown operation %d at byte %zu\n",
+                   argv[optind], op, pos - 1);
+          return 1;
+        }
+      records++;
+      size_t used = str_usedsize ();
+      if (used > peak_used)
+        peak_used = used;
+      if (interval != 0 && records % interval == 0)
+        report_memory (records, now () - start);
+    }
+  double seconds = now () - start;
+  report_memory (records, seconds);
+
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("replay records=%zu seconds=%.3f mops=%.3f traced_seconds=%.3f"
+          " compact_seconds=%.3f peak_used=%zu peak_rss_kb=%ld"
+          " unknown=%zu\n", records, seconds, records / seconds / 1e6,
+          traced_ns / 1e9, compact_seconds, peak_used, usage.ru_maxrss,
+          unknown);
+  if (map_format != -1)
+    str_heap_map (stdout, map_format);
+  return 0;
+}
@@ -4,11 +4,18 @@
  * Christian Lungescu 20079725
  */
 
+// For mremap.
+#define _GNU_SOURCE
 #include "stralloc.h"
 #include <string.h>
+#include <stdint.h>
 #include<sys/mman.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
 // Idk if we're allowed to modify makefile, so instead of adding -lm, I'll
 // implement my own math functions.
 // #include <math.h>
@@ -28,681 +35,4875 @@
  * - The second block will be used to store the data.
  *
  * The first block will be fixed size blocks. The first word (8 bytes)
- * will be used to store the number of cells.
- * The next bits are booleans to indicate if the block is used or not.
- * You can then offset to the first available cell
- * and use it, flipping the bit to 1.
+ * will be used to store the number of cells, the second one the index of
+ * the page in its header, and the third one a hint for the search.
+ * Then come the summary words, one bit per word of flags that still has a
+ * free cell, and the flags, booleans to indicate if the block is used or
+ * not. You can then find a word with a free cell with a bit scan on the
+ * summary, a free cell with a bit scan on that word, offset to it
+ * and use it, flipping the bit to 1. The header keeps one more bit per
+ * page that still has a free cell, so full pages are never looked at.
+ * A string of at most 24 bytes is kept in its String cell itself, in the
+ * words that would otherwise point to its data area, so it never touches
+ * the second block.
  *
- * The second block will be variable size blocks. The first word will
- * be used to store the pointer to the head of the
- * linked list of free areas. After being pointed, the first word will
- * be the metadata of the cell, indicating the size
- * in bytes. The next word will be the pointer to the next cell. If null,
- * there are no more cells. If trying to add,
- * this will require the creation of a new block of memory
- * and copying the old one over, then freeing the old one.
+ * str_dup and str_substr make views: a view has no data area, it keeps
+ * an offset in the data area of a block, a String that only views point
+ * to. The block counts its views, and is freed with the last one. Since
+ * a view has no pointer to the data itself, the block is moved only once
+ * by a compaction and its views follow. A view gets a data area of its
+ * own only when it is written to, taking the one of its block if it was
+ * the last view.
+ *
+ * str_intern keeps one String per content in an open addressing table
+ * of the arena, indexed by the hash of the content, which the String
+ * keeps too. Interning a content again only adds a reference, and the
+ * string leaves the table with its last reference. The table points to
+ * String cells, which never move, so compactions leave it alone.
+ *
+ * In rope mode, str_concat only makes a String that references its two
+ * operands, and the content is copied once, the first time str_data needs
+ * it or at the next str_compact. The operands count the ropes that use
+ * them, so freeing one only takes it away for real once its ropes are
+ * flattened or freed.
+ *
+ * The second block will be variable size blocks. The first word stores the
+ * size of the page in bytes, the second the bytes of its used areas, the
+ * third whether it is being evacuated, the fourth is a bitmap of the size
+ * classes ("bins") that currently have free areas, and the next words are
+ * the heads of one linked list of free areas per bin. Bin k holds the free
+ * areas of [2^(k+5), 2^(k+6)) bytes. Finding a fitting area is then a bit
+ * scan on the bitmap instead of a walk of every free area of the page.
+ *
+ * Every area, used or not, starts with a header word: its size in bytes,
+ * with the low bits used as flags (used, previous area used). A used area
+ * has the pointer to its String after the header, so a page can be
+ * emptied without looking at any other page, then the data. A free area
+ * has the pointers to the next and previous areas of its bin after the
+ * header, and its size again in its last word (the footer). With these
+ * boundary tags, a freed area finds both its physical neighbours in
+ * constant time and merges with the ones that are free. The last word of
+ * the page is a used header of size 0, so that the last area never tries
+ * to merge past the end of the page.
+ *
+ * A string bigger than the large threshold gets a mapping of its own
+ * instead, sized to whole system pages, which holds a single used area
+ * with the AREA_LARGE flag. Freeing it is a munmap, and growing it is a
+ * mremap, which moves the pages instead of copying the data. The area
+ * comes after two words that link the mappings of an arena together, so
+ * that resetting or destroying the arena finds them all.
  *
  * These two blocks will have their own 'headers' to have multiple pages of
  * varying size, ex: 4096 bytes, 8192 bytes, 16384 bytes, etc. The header will
  * be 4096 bytes long, so it can store up to more than 2^512 bytes, in theory.
+ * str_config can change the size of the first page, stop the doubling at
+ * a cap, and have the pages taken from address space reserved up front.
+ *
+ * In persistent mode, the reserved address space is a file mapped with
+ * MAP_SHARED, always at the address it was created at, so that every
+ * pointer of the pages is still right when the file is mapped again. Its
+ * first page keeps what is needed to find them back: the arena, the
+ * state of the reserved space and the roots.
+ *
+ * The two headers make an arena. Without threads, there is only the main
+ * arena. In threaded mode, each thread gets an arena of its own, so that
+ * allocating and freeing its strings needs no lock at all. A String page
+ * knows the arena it belongs to: a string freed by another thread is
+ * pushed on the lock-free stack of remote frees of that arena, and the
+ * owner frees it for real the next time it allocates. Only the mmap and
+ * munmap of pages, and handing out arenas, take the shared lock.
  */
 
 #define advance_word_size_t(ptr, n) ((ptr) = (size_t *)((size_t *)(ptr) + (n)))
 
+// Number of page pointers at the beginning of a header. Doubling pages
+// never get past the first few dozens, the others are for the pages that
+// stop growing at the cap of str_config. With the words after them, they
+// fit in the system page of the header.
+#define HANDLER_PAGES 448
+// Word offsets after the page pointers of handler_handler_string: the
+// bitmap of pages with a free cell, one bit per page, and the index of
+// the last page used.
+#define STRING_NONFULL HANDLER_PAGES
+#define STRING_LAST_PAGE (HANDLER_PAGES + HANDLER_PAGES / 64)
+// Number of powers of two a size can be, for the stacks of the reserved
+// space and the bins of the heap map.
+#define SIZE_CLASSES 64
+
+// Word offsets of the metadata at the beginning of a String page.
+#define STRING_CELLS 0
+#define STRING_INDEX 1
+#define STRING_ARENA 2
+#define STRING_HINT 3
+#define STRING_SUMMARY 4
+
+// Word offsets of the metadata at the beginning of a data page.
+#define DATA_PAGE_SIZE 0
+#define DATA_LIVE 1
+#define DATA_EVACUATING 2
+#define DATA_BITMAP 3
+#define DATA_BINS 4
+
+// Smallest area handed out or kept in a free list: 4 words, so that there
+// is always space for the header, the two links and the footer.
+// Bin 0 starts at this size.
+#define MIN_AREA (4 * sizeof(size_t))
+#define MIN_AREA_LOG2 5
+
+// Flags in the low bits of an area header, sizes are multiples of 8.
+#define AREA_USED ((size_t) 1)
+#define AREA_PREV_USED ((size_t) 2)
+// The area is the whole mapping of a large string, not part of a page.
+#define AREA_LARGE ((size_t) 4)
+#define AREA_FLAGS ((size_t) 7)
+// Words before the data of a used area: the header and the owner.
+#define AREA_DATA 2
+// Words before the area of a large string: the next and previous
+// mappings of the arena.
+#define LARGE_LINKS 2
+
+// Largest area str_alloc_batch carves for several strings at once, in
+// system pages. A bigger one would skip the free areas of the small pages.
+#define BATCH_RUN_PAGES 16
+
+// The instrumentation, only compiled with -DSTR_INSTRUMENT. Without it the
+// macros are empty and nothing is counted or timed.
+#ifdef STR_INSTRUMENT
+StrInstrument instrument;
+#define COUNT(counter, n) \
+    __atomic_fetch_add(&instrument.counter, (n), __ATOMIC_RELAXED)
+#define TIME_START(start) uint64_t start = trace_time()
+#define TIME_END(op, start) record_latency(op, trace_time() - start)
+#else
+#define COUNT(counter, n) ((void) 0)
+#define TIME_START(start) ((void) 0)
+#define TIME_END(op, start) ((void) 0)
+#endif
+
 
 struct String {
-    size_t size;
-    size_t allocated;
-    char *data;
-    size_t *handler_data;
+    union {
+        size_t size;
+        // Once freed by another thread, until its owner takes it back.
+        String *next_remote;
+    };
+    // The handle str_alloc gave, plus one for each rope it is an operand
+    // of. The string is only freed once there are none left. The count
+    // saturates at REFERENCES_MAX, see add_reference.
+    uint32_t references;
+    // Hash of the content of an interned string, never 0, and 0 for the
+    // others.
+    uint32_t hash;
+    union {
+        struct {
+            size_t allocated;
+            char *data;
+            size_t *handler_data;
+        };
+        // The strings of at most STRING_INLINE bytes are stored right
+        // here, without any data area.
+        char inline_data[3 * sizeof(size_t)];
+        // A rope has no data area until it is flattened, so its data is
+        // NULL, and it keeps its two operands instead.
+        struct {
+            String *left;
+            char *rope_data;
+            String *right;
+        };
+        // A view shares the data area of a block, a String that no handle
+        // points to, from an offset, so it has no handler_data.
+        struct {
+            size_t offset;
+            String *base;
+            size_t *view_handler_data;
+        };
+    };
     size_t *handler_string;
 };
 
-/*
- * handler_handler_string is the pointer to the block of memory pointers
- * that is used to store the String struct.
- * The first size_t is the number of cells in
- * the block. The next floor(number_of_blocks/64) is the of words
- * used to store the flags for the open cells.
- * 1 signifies used, 0 signifies free. After that is where the first cell is
- * they are all aligned to 8 bytes. 64-bit only :)
- */
-void *handler_handler_string = NULL;
-/*
- * handler_handler_data is the pointer to the block of memory pointers
- * that is used to store the data.
- * It is a more or less free for all area of memory.
- * The first size_t is the pointer to the head
- * of the linked list of free areas.
- * The word it points to is the beginning of the metadata of the cell.
- * The first word contains the pointer to the next area. The next word
- * is the size of the area. If null, there are no more cells available.
- */
-void *handler_handler_data = NULL;
-
-/// Returns the index in the word of the first available cell.
-/// \param word: The word to search in.
-/// \return The index of the first available cell, -1 if none.
-size_t first_free_cell(size_t word) {
-    for (size_t i = 0; i < sizeof(size_t) * 8; i++) {
-        size_t mut_word = word;
-        // Goes from left to right, by checking with AND mask.
-        // Ex: 11011111 & 00100000 => index of the shift
-        if ((mut_word & ((size_t) 1 << (sizeof(size_t) * 8 - i - 1))) ? false
-                                                                      : true) {
-            return i;
-        }
-    }
+#define STRING_INLINE (3 * sizeof(size_t))
 
-    return -1;
-}
+// A reference count that reached this stays there, and its string is
+// never freed, rather than wrapping around to a string freed while still
+// in use.
+#define REFERENCES_MAX UINT32_MAX
 
-/// Ceiling function, rounds to the next highest integer.
-/// \param d Double to round.
-/// \return d, rounded to the highest size_t integer.
-size_t ceil_size_t(double d) {
-    return (size_t) (size_t) d + (d - (double) (size_t) d > 0);
-}
+typedef struct Arena Arena;
 
-/// Returns the pointer of the first available cell that matches
-/// the requested size in handler_data
-/// \param cell The cell to get the pointer for.
-/// \return Pointer to the first available cell, NULL if none is available.
-char *request_data(String *cell, size_t *handler_data) {
-    // Get the head of the linked list of free areas
-    size_t *head = handler_data;
-    size_t *prev = head;
-    size_t *curr = (size_t *) *head;
-    size_t *next = (size_t *) *curr;
-    // The size of the area in bytes.
-    size_t area_size = *(curr + 1);
-
-    while (curr != NULL) {
-        if (area_size >= cell->allocated) {
-            // Found a cell that matches the size
-            // Allocate the size needed, if the remaining size is
-            // 1 word or less word, then just add it to the string
-            if (area_size - cell->allocated < 16) {
-                cell->allocated = area_size;
-            }
-            if (cell->allocated == area_size) {
-                // Changes linked list so that it is taken out of the list
-                *prev = (size_t) next;
-            } else {
-                // Split the cell into two cells, taking the first one,
-                // pointing prev to the second one,
-                // and pointing the second one to next.
-                // The minimum requested is 2 words so that there is always
-                // space for the free metadata
-                size_t allocated_words = (size_t) (ceil_size_t(
-                        (double) cell->allocated / (double) sizeof(size_t)));
-                if (allocated_words == 1) {
-                    allocated_words++;
-                }
+// A pinned string, and the number of str_pin not undone yet.
+typedef struct Pin {
+    String *str;
+    size_t count;
+} Pin;
 
-                // The location of the second new cell
-                size_t *new_cell = (size_t *) curr + allocated_words;
+struct Arena {
+    /*
+     * handler_handler_string is the pointer to the block of memory pointers
+     * that is used to store the String struct.
+     * The first size_t is the number of cells in
+     * the block, then its index, its arena and the summary hint. The next
+     * ceil(ceil(number_of_blocks/64)/64) words are the summary and the next
+     * ceil(number_of_blocks/64) words are used to store the flags for the open
+     * cells. 1 signifies used, 0 signifies free. After that is where the first
+     * cell is, they are all aligned to 8 bytes. 64-bit only :)
+     */
+    void *handler_handler_string;
+    /*
+     * handler_handler_data is the pointer to the block of memory pointers
+     * that is used to store the data.
+     * It is a more or less free for all area of memory.
+     * Each page starts with its size, the bitmap of non-empty bins and the
+     * heads of the free lists, one per bin.
+     * The word a head points to is the beginning of the metadata of the cell.
+     * The first word contains the pointer to the next area. The next word
+     * is the size of the area. If null, there are no more cells in the bin.
+     */
+    void *handler_handler_data;
+    // Strings freed by other threads, pushed with a compare and swap.
+    String *remote_free;
+    // Set when the thread that owned the arena exited, so the next new
+    // thread takes it over instead of mapping new pages.
+    bool abandoned;
+    Arena *next;
+    // Kept up to date by every allocation, free and compaction, so that
+    // the size functions never walk the pages. A string freed by another
+    // thread leaves the live counters right away, so in threaded mode
+    // they are updated atomically. The others only change in the thread
+    // that owns the arena.
+    size_t live_size;
+    size_t live_strings;
+    // Bytes mapped for the headers and pages, and the number of mappings.
+    size_t used_size;
+    size_t mapped_pages;
+    // Bytes of areas of the data pages, and of the used ones. Every other
+    // area is in a bin, so the difference is the free size.
+    size_t data_capacity;
+    size_t data_used;
+    // The table of interned strings, a power of two of slots, NULL if
+    // nothing was interned yet.
+    String **interned;
+    size_t interned_capacity;
+    size_t interned_count;
+    // The first mapping of a large string, they are linked by their first
+    // two words.
+    size_t *large;
+    // The pinned strings, a power of two of slots, NULL if nothing was
+    // pinned yet. Only read and written with the lock.
+    Pin *pins;
+    size_t pins_capacity;
+    size_t pins_count;
+    // While the background compaction runs, the owner of the arena holds
+    // the lock for each operation, and the compaction thread to move
+    // strings. All zeros is an unlocked mutex. locking and lock_depth are
+    // only written by the owner, between two operations for locking.
+    pthread_mutex_t lock;
+    bool locking;
+    size_t lock_depth;
+    // Bytes of data areas freed since the free memory was last given back
+    // to the system, see str_release_threshold.
+    size_t freed_since_release;
+    // Set for the arenas of str_arena_create, whose strings a trace never
+    // records, since str_arena_alloc is not recorded.
+    bool untraced;
+};
 
-                // Point the new cell to the next cell
-                *new_cell = (size_t) next;
+// The arena used without threads, and the first one of the list of arenas.
+Arena main_arena = {NULL, NULL, NULL, false, NULL};
 
-                // Set the size of the new cell
-                *(new_cell + 1) = area_size - cell->allocated;
+bool threaded = false;
+__thread Arena *thread_arena = NULL;
+// The shared lock, for the mmap and munmap of pages and the list of arenas.
+pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t thread_arena_key;
 
-                // Point the previous cell to the new cell
-                *prev = (size_t) new_cell;
-            }
-            return (char *) curr;
-        }
+// Size of the system pages.
+size_t system_page_size = 0;
 
-        prev = curr;
-        curr = next;
-        if (curr != NULL) {
-            area_size = *(curr + 1);
-            next = (size_t *) *curr;
-        }
+/// Returns the size of the system pages, asking the system only once.
+/// \return The size in bytes.
+size_t os_page_size(void) {
+    if (system_page_size == 0) {
+        system_page_size = sysconf(_SC_PAGESIZE);
     }
-
-    // If all is null, loop finishes and doesn't return what we want,
-    // forced to return null
-    return NULL;
+    return system_page_size;
 }
 
-/// Returns the pointer to the first available cell
-/// in handler_string for the string struct.
-/// \return Pointer to the first String cell
-String *request_string(size_t *handler_string) {
-    // Go through the handler_string and find the first available cell
-    size_t number_of_blocks = *(size_t *) handler_string;
+// The policy set by str_config, all zeros by default.
+StrConfig page_config;
 
-    // Advances to the next word, priming it
-    size_t *inspector = handler_string;
-    advance_word_size_t(inspector, 1);
+// Alignment of the pages that can be huge pages.
+#define HUGE_PAGE_ALIGN ((size_t) 2 << 20)
 
-    size_t word_offset = 0;
-    size_t index = 0;
-    bool found = false;
-    for (size_t i = 0; i < (number_of_blocks / sizeof(size_t) * 8); i++) {
-        index = first_free_cell(*inspector);
-        if (index != -1) {
-            found = true;
-            // Flip the bit to 1 to signify we're taking it with OR mask
-            *inspector |= ((size_t) 1 << (sizeof(size_t) * 8 - index - 1));
-            break;
+// The address space reserved up front, if any, the part of it not handed
+// out yet, and one stack of given back pages per power of two size.
+char *reserved = NULL;
+char *reserved_next = NULL;
+char *reserved_end = NULL;
+void *reserved_free[SIZE_CLASSES];
+
+// What the first page of the file of the persistent mode keeps.
+typedef struct PersistHeader {
+    size_t magic;
+    // Where the file is always mapped, and its size.
+    char *base;
+    size_t size;
+    // The state of the reserved space and of the main arena at the last
+    // checkpoint.
+    char *reserved_next;
+    void *reserved_free[SIZE_CLASSES];
+    StrConfig config;
+    Arena arena;
+    String *roots[STR_ROOTS];
+} PersistHeader;
+
+#define PERSIST_MAGIC ((size_t) 0x3130707274736d6d)
+
+// The file of the persistent mode and its first page, -1 and NULL without
+// it.
+int persist_fd = -1;
+PersistHeader *persist_header = NULL;
+// The roots without the persistent mode.
+String *roots[STR_ROOTS];
+
+/// Maps pages, with the flags of the policy.
+/// \param size Size in bytes of the pages.
+/// \return Pointer to the first page, NULL if the system has none left.
+void *mmap_pages(size_t size) {
+    int flags = MAP_ANONYMOUS | MAP_PRIVATE;
+    if (page_config.populate) {
+        flags |= MAP_POPULATE;
+    }
+    bool huge = page_config.huge_page_size != 0 &&
+                size >= page_config.huge_page_size;
+    if (huge && page_config.hugetlb) {
+        COUNT(mmaps, 1);
+        void *pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           flags | MAP_HUGETLB, -1, 0);
+        // Without huge pages set aside by the system, the normal ones do.
+        if (pages != MAP_FAILED) {
+            return pages;
         }
-        advance_word_size_t(inspector, 1);
-        word_offset++;
     }
-    if (!found) {
+    COUNT(mmaps, 1);
+    void *pages = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (pages == MAP_FAILED) {
         return NULL;
     }
-
-    size_t cell_index = word_offset * sizeof(size_t) * 8 + index;
-    // Advance to the first cell_open metadata,
-    // then advance num_of_cells/64 to get to the first cell, then move
-    // cell_index times sizeof(String) to get to the open cell.
-    size_t *end_of_metadata = handler_string;
-    advance_word_size_t(end_of_metadata, 1);
-    advance_word_size_t(end_of_metadata,
-                        ceil_size_t((double) number_of_blocks /
-                                    ((double) sizeof(size_t) * 8)));
-    String *cell = (String *) end_of_metadata;
-    cell += cell_index;
-    return cell;
+    if (huge && !page_config.hugetlb) {
+        madvise(pages, size, MADV_HUGEPAGE);
+    }
+    return pages;
 }
 
-/// Power function without math.h because we idk if we can change CFLAGS :)
-/// \param base Exponent base
-/// \param exp Exponent
-/// \return The result of base^exp
-size_t power(size_t base, size_t exp) {
-    size_t result = 1;
-    for (size_t i = 0; i < exp; i++) {
-        result *= base;
+/// Takes pages out of the reserved address space, given back ones first.
+/// Only the sizes that are a power of two are taken from there, which is
+/// the case of every page of the headers.
+/// \param size Size in bytes of the pages.
+/// \return Pointer to the first page, NULL if it doesn't come from there.
+void *reserved_pages(size_t size) {
+    if (reserved == NULL || (size & (size - 1)) != 0 ||
+        size < os_page_size()) {
+        return NULL;
     }
-
-    return result;
+    size_t class = __builtin_ctzl(size);
+    void *pages = reserved_free[class];
+    if (pages != NULL) {
+        // The link was the only word written since it was given back.
+        reserved_free[class] = *(void **) pages;
+        *(void **) pages = NULL;
+        COUNT(reserved, 1);
+        return pages;
+    }
+    size_t align = size < HUGE_PAGE_ALIGN ? size : HUGE_PAGE_ALIGN;
+    char *start = (char *) (((size_t) reserved_next + align - 1) &
+                            ~(align - 1));
+    if (start > reserved_end || size > (size_t) (reserved_end - start)) {
+        return NULL;
+    }
+    reserved_next = start + size;
+    COUNT(reserved, 1);
+#ifdef MADV_POPULATE_WRITE
+    if (page_config.populate) {
+        madvise(start, size, MADV_POPULATE_WRITE);
+    }
+#endif
+    if (page_config.huge_page_size != 0 &&
+        size >= page_config.huge_page_size) {
+        madvise(start, size, MADV_HUGEPAGE);
+    }
+    return start;
 }
 
-/// Initializes the handler_string so that the first size_t contains
-/// the amount of cells available to use and the num_cells/(sizeof(size_t)*8)
-/// bits are used for the cell flags.
-/// \param size Size of the handler requested by mmap
-void initialize_handler_string(size_t size, size_t *handler_string) {
-    size_t struct_string_size = sizeof(String);
-    // First size_t is reserved for the amount of cells in the block.
-    // This is the completely maximum, without any flags.
-    size_t max_cells = (size - sizeof(size_t)) / struct_string_size;
-
-    // Now to reserve the flag areas.
-    size_t number_of_flag_words = ceil_size_t((double) max_cells / (double)
-            (sizeof(size_t) * 8));
-
-    // Readjust max_cells, I know there are cases where there might be a word
-    // of flags that will just have 1s, but that is not too much of a problem.
-    // Ex: 65 blocks of Strings => 2 words of flags, but that extra word takes
-    // up the space of the last block, so there's only 64 cells.
-    max_cells = (size - (sizeof(size_t)) * (number_of_flag_words + 1)) /
-                struct_string_size;
-    // Now to set the first size_t to the amount of cells available.
-    *(size_t *) handler_string = max_cells;
-    // Now to set the rest of the bits to 0.
-    size_t *inspector = handler_string;
-    advance_word_size_t(inspector, 1);
-    for (size_t i = 0; i < number_of_flag_words; i++) {
-        *inspector = 0;
-        advance_word_size_t(inspector, 1);
+/// Requests zeroed pages from the system, from the reserved address space
+/// when there is one. In threaded mode this is the only part of an
+/// allocation that takes the shared lock.
+/// \param size Size in bytes of the pages.
+/// \return Pointer to the first page, NULL if there is none left, which in
+/// persistent mode is when the file is full.
+void *map_pages(size_t size) {
+    if (threaded) {
+        pthread_mutex_lock(&page_lock);
+    }
+    void *pages = reserved_pages(size);
+    // In persistent mode, the pages must be in the file.
+    if (pages == NULL && persist_fd == -1) {
+        pages = mmap_pages(size);
     }
-    // Change the last flag so that the non-available cells are set to 1.
-    inspector = (size_t *) handler_string + 1;
-    advance_word_size_t(inspector, number_of_flag_words - 1);
+    if (threaded) {
+        pthread_mutex_unlock(&page_lock);
+    }
+    return pages;
+}
 
-    // Get the max value of size_t, so everything is 1.
-    size_t flags = (size_t) -1;
-    size_t flags_in_last_block = max_cells % 64;
-    for (size_t i = 0; i < flags_in_last_block; i++) {
-        flags -= power(2, i);
+/// Requests zeroed pages from the system, never from the reserved address
+/// space, for the pages that mremap may move.
+/// \param size Size in bytes of the pages.
+/// \return Pointer to the first page, NULL if there is none left.
+void *map_movable_pages(size_t size) {
+    if (threaded) {
+        pthread_mutex_lock(&page_lock);
+    }
+    void *pages = mmap_pages(size);
+    if (threaded) {
+        pthread_mutex_unlock(&page_lock);
     }
-    *inspector = flags;
+    return pages;
 }
 
-/// Initializes the handler_data so that the first size_t contains the
-/// pointer to the the 2nd word, the 2nd word is a pointer to null, and the 3rd
-/// is the size of the block minus the first head.
-/// \param size Size of the block allocated by mmap
-void initialize_handler_data(size_t size, size_t *handler_data) {
-    // The first size_t is reserved for the pointer to the first
-    // available area.
-    size_t *inspector = handler_data;
-    *inspector = (size_t) (inspector + 1);
-    advance_word_size_t(inspector, 1);
-    *inspector = (size_t) NULL;
+/// Gives pages back to the system. The reserved ones keep their address
+/// space, and are handed out again by map_pages.
+/// \param pages Pointer to the first page.
+/// \param size Size in bytes of the pages.
+void unmap_pages(void *pages, size_t size) {
+    if (threaded) {
+        pthread_mutex_lock(&page_lock);
+    }
+    if ((char *) pages >= reserved && (char *) pages < reserved_end) {
+        // Zeroed on the next access, like new pages. The pages of a file
+        // are only zeroed if the file itself is.
+        COUNT(munmaps, 1);
+        madvise(pages, size,
+                persist_fd != -1 ? MADV_REMOVE : MADV_DONTNEED);
+        size_t class = __builtin_ctzl(size);
+        *(void **) pages = reserved_free[class];
+        reserved_free[class] = pages;
+    } else {
+        COUNT(munmaps, 1);
+        munmap(pages, size);
+    }
+    if (threaded) {
+        pthread_mutex_unlock(&page_lock);
+    }
+}
 
-    advance_word_size_t(inspector, 1);
-    size_t available_size = size - sizeof(size_t);
-    *inspector = available_size;
+/// Resizes pages obtained from map_pages, moving them if they can't grow
+/// where they are. The content moves with them without any copy.
+/// \param pages Pointer to the first page.
+/// \param old_size Size in bytes of the pages.
+/// \param new_size Size in bytes they must have.
+/// \return Pointer to the first page, at its new place, NULL if there was
+/// no room for them, they are then left as they were.
+void *remap_pages(void *pages, size_t old_size, size_t new_size) {
+    if (threaded) {
+        pthread_mutex_lock(&page_lock);
+    }
+    COUNT(mremaps, 1);
+    pages = mremap(pages, old_size, new_size, MREMAP_MAYMOVE);
+    if (threaded) {
+        pthread_mutex_unlock(&page_lock);
+    }
+    return pages == MAP_FAILED ? NULL : pages;
 }
 
-/// Allocates a new string of size 'size' and
-/// returns the pointer to the structure.
-/// \param size Size of the memory requested for the string
-/// \return Pointer to the string structure
-String *str_alloc(size_t size) {
-    size_t base_size = sysconf(_SC_PAGESIZE);
-    if (handler_handler_string == NULL) {
-        handler_handler_string = mmap(NULL, base_size,
-                                      PROT_READ | PROT_WRITE,
-                                      MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-        handler_handler_data = mmap(NULL, base_size,
-                                    PROT_READ | PROT_WRITE,
-                                    MAP_ANONYMOUS | MAP_PRIVATE,
-                                    0, 0);
-        // Initialize them both to contain all 0s.
-        // Probably doesn't matter.
-        size_t number_of_blocks = base_size / sizeof(size_t);
-        for (size_t i = 0; i < number_of_blocks; i++) {
-            *(((size_t *) handler_handler_string) + i) = 0;
-            *(((size_t *) handler_handler_data) + i) = 0;
-        }
-
-        // A bit of data at the 0th index at least.
-        *(size_t *) handler_handler_string = (size_t) mmap(NULL, base_size,
-                                                           PROT_READ |
-                                                           PROT_WRITE,
-                                                           MAP_ANONYMOUS |
-                                                           MAP_PRIVATE, 0, 0);
-        *(size_t *) handler_handler_data = (size_t) mmap(NULL, base_size,
-                                                         PROT_READ |
-                                                         PROT_WRITE,
-                                                         MAP_ANONYMOUS |
-                                                         MAP_PRIVATE,
-                                                         0, 0);
-
-        initialize_handler_string(base_size,
-                                  (size_t *) *(size_t *)
-                                          handler_handler_string);
-        initialize_handler_data(base_size,
-                                (size_t *) *(size_t *) handler_handler_data);
+/// Saves the state of the main arena and of the reserved space in the
+/// first page of the file, and writes every page to it.
+void str_checkpoint(void) {
+    if (persist_fd == -1) {
+        return;
     }
+    persist_header->reserved_next = reserved_next;
+    memcpy(persist_header->reserved_free, reserved_free,
+           sizeof(reserved_free));
+    persist_header->config = page_config;
+    persist_header->arena = main_arena;
+    msync(persist_header->base, persist_header->size, MS_SYNC);
+}
 
-    String *cell;
-    size_t handler_string_index = 0;
-    do {
-        size_t *handler_string =
-                (size_t *) handler_handler_string + handler_string_index;
-        if (*handler_string == 0) {
-            // The block has yet to be initialized.
-            size_t mmap_size = base_size * power(2, handler_string_index);
-            *handler_string =
-                    (size_t) mmap(NULL,
-                                  mmap_size,
-                                  PROT_READ | PROT_WRITE,
-                                  MAP_ANONYMOUS | MAP_PRIVATE,
-                                  0, 0);
-            initialize_handler_string(
-                    mmap_size,
-                    (size_t *) *handler_string);
+/// Maps a file as the reserved address space, creating it if needed, and
+/// takes back the strings it had at its last checkpoint.
+/// \param path Path of the file.
+/// \param size Size of a new file, the one of an existing file is kept.
+/// \return false if the file could not be mapped at its address, or if
+/// strings were already allocated.
+bool str_persist_open(const char *path, size_t size) {
+    if (threaded || persist_fd != -1 || reserved != NULL ||
+        main_arena.handler_handler_string != NULL) {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    size_t os_page = os_page_size();
+    size_t header_size =
+            (sizeof(PersistHeader) + os_page - 1) / os_page * os_page;
+    PersistHeader header;
+    bool fresh = pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+                 header.magic != PERSIST_MAGIC;
+    char *base;
+    if (fresh) {
+        size = (size + os_page - 1) / os_page * os_page;
+        if (size <= header_size || ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
         }
-        cell = request_string((size_t *) *handler_string);
-        if (cell == NULL) {
-            handler_string_index++;
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        size = header.size;
+        base = mmap(header.base, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        // Older systems take the address as a hint only.
+        if (base != MAP_FAILED && base != header.base) {
+            munmap(base, size);
+            base = MAP_FAILED;
         }
-        if (cell != NULL)
-            cell->handler_string = (size_t *) *handler_string;
-    } while (cell == NULL);
-
-    cell->size = size;
-    cell->allocated = size;
-
-    size_t index = 0;
-    while (size > (base_size * power(2, index))) {
-        index++;
+    }
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
     }
 
-    do {
-        size_t *handler_data =
-                (size_t *) handler_handler_data + index;
-        if (*handler_data == 0) {
-            // Create new block
-            size_t mmap_size = base_size * power(2, index);
-            *handler_data = (size_t) mmap(NULL,
-                                          mmap_size,
-                                          PROT_READ | PROT_WRITE,
-                                          MAP_ANONYMOUS | MAP_PRIVATE,
-                                          0, 0);
-            initialize_handler_data(mmap_size,
-                                    (size_t *) *handler_data);
-        }
-        char *data = request_data(cell, (size_t *) *handler_data);
-        if (data == NULL) {
-            index++;
+    persist_fd = fd;
+    persist_header = (PersistHeader *) base;
+    reserved = base + header_size;
+    reserved_end = base + size;
+    if (fresh) {
+        persist_header->magic = PERSIST_MAGIC;
+        persist_header->base = base;
+        persist_header->size = size;
+        reserved_next = reserved;
+        // The pages stop growing only where data can go to a mapping of
+        // its own, which would not be in the file.
+        page_config.max_page_size = 0;
+        page_config.hugetlb = false;
+        str_checkpoint();
+    } else {
+        reserved_next = header.reserved_next;
+        memcpy(reserved_free, header.reserved_free, sizeof(reserved_free));
+        page_config = header.config;
+        main_arena = header.arena;
+        // What is not in the file, or only makes sense in the process that
+        // wrote it: the pin table is an anonymous mapping, and nothing is
+        // pinned, locked, or freed by another thread yet.
+        main_arena.remote_free = NULL;
+        main_arena.next = NULL;
+        main_arena.pins = NULL;
+        main_arena.pins_capacity = 0;
+        main_arena.pins_count = 0;
+        memset(&main_arena.lock, 0, sizeof(main_arena.lock));
+        main_arena.locking = false;
+        main_arena.lock_depth = 0;
+        // The String pages point to the arena, which is not in the file,
+        // and the program may be loaded elsewhere.
+        size_t *handler_handler = main_arena.handler_handler_string;
+        for (size_t i = 0; handler_handler != NULL && i < HANDLER_PAGES;
+             i++) {
+            size_t *handler_string = (size_t *) *(handler_handler + i);
+            if (handler_string != NULL) {
+                *(handler_string + STRING_ARENA) = (size_t) &main_arena;
+            }
         }
-        cell->data = data;
-        cell->handler_data = (size_t *) *handler_data;
-    } while (cell->data == NULL);
-    // Request pointer to the data in the handler_data
+    }
+    return true;
+}
 
+/// Sets a root, a string that can be found back after the file of the
+/// persistent mode is opened again.
+/// \param index Index of the root, less than STR_ROOTS.
+/// \param str The string, or NULL.
+void str_root_set(size_t index, String *str) {
+    if (persist_header != NULL) {
+        persist_header->roots[index] = str;
+    } else {
+        roots[index] = str;
+    }
+}
 
-    return cell;
+/// Returns a root set by str_root_set.
+/// \param index Index of the root, less than STR_ROOTS.
+/// \return The string, NULL if none was set.
+String *str_root(size_t index) {
+    return persist_header != NULL ? persist_header->roots[index] :
+           roots[index];
 }
 
-/// Frees the string structure by assigning the bit in the header to 0
-/// \param str The string struct to free
-void handler_string_free(const String *str) {
-    size_t *handler_string = str->handler_string;
-    size_t *inspector = (size_t *) handler_string;
-    size_t number_of_blocks = *inspector;
-    advance_word_size_t(inspector, ceil_size_t((double) number_of_blocks /
-                                               ((double) sizeof(size_t) * 8)));
-    advance_word_size_t(inspector, 1);
-    String *string_inspector = (String *) inspector;
-    size_t index = str - string_inspector;
-    size_t word_offset = index / 64;
-    size_t bit_offset = index % 64;
-    size_t *flag_inspector = ((size_t *) handler_string) + 1 + word_offset;
-    // Flips the bit at the bit_offset, indexed 0 at the left.
-    *flag_inspector &= ~((size_t) 1 << (sizeof(size_t) * 8 - 1 - bit_offset));
-}
-
-// TODO: Make it work
-
-/// Adds free spaces together if they are next to each other in memory.
-void handler_data_amalgamate(size_t *handler_data) {
-    bool modified = false;
-    /*
-     * This is the algorithm for amalgamation:
-     * 1. Keep previous at the set location, and check is current is next to
-     * previous, if so, merge them, then break out of the loop, if not, go to
-     * what current is pointing to and repeat until NULL.
-     * 2. If none of those worked, move previous to current, and current will
-     * once again iterate through all until it's NULL. These two will go until
-     * they both hit null, effectively checking all free block next to each
-     * other.
-     * 3. Keep doing 1 and 2 for every time that in a loop
-     * something was merged.
-     * 4. If nothing was merged, break out of the loop.
-     * While this might seem like a lot of iterating n^2, n shouldn't approach
-     * very high values, unless there was some really weird allocating and
-     * freeing of memory. Even then, str_compact will fix it.
-     */
-    do {
-        modified = false;
-        size_t *prev = (size_t *) handler_data;
-        while (prev != NULL) {
-            prev = (size_t *) *prev;
-            // Starts the iteration of curr at the first free block
-            size_t *curr = (size_t *) *(size_t *) handler_data;
-            size_t previous_size = *(prev + 1);
-            while (curr != NULL) {
-                curr = (size_t *) *curr;
-                if (curr == prev) continue;
-
-                size_t current_size = *(curr + 1);
-                if ((curr - prev) * sizeof(size_t) == previous_size) {
-                    // Merge the two blocks
-                    *prev = (size_t) *curr;
-                    *(prev + 1) = previous_size + current_size;
-                    modified = true;
-                    break;
-                }
-            }
-            if (modified) break;
+// Size of the buffer of the records of a trace, written to the file when
+// it can't take the longest record anymore.
+#define TRACE_BUFFER (64 << 10)
+#define TRACE_RECORD_MAX 64
+
+// The file of the trace, -1 when not recording. The records are built in
+// the buffer, and the last time and id are what the next record is
+// relative to.
+int trace_fd = -1;
+unsigned char trace_buffer[TRACE_BUFFER];
+size_t trace_used = 0;
+uint64_t trace_last_time = 0;
+size_t trace_last_id = 0;
+// Only taken in threaded mode, so that the records stay whole and in
+// order.
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Writes the buffered records to the file of the trace.
+void trace_flush(void) {
+    size_t written = 0;
+    while (written < trace_used) {
+        ssize_t n = write(trace_fd, trace_buffer + written,
+                          trace_used - written);
+        if (n <= 0) {
+            break;
         }
-    } while (modified);
+        written += n;
+    }
+    trace_used = 0;
 }
 
-/// Frees the string structure by adding the metadata back to the linked list.
-/// \param data Pointer to the start of the data
-/// \param allocated Amount of memory that was allocated for the string
-void handler_data_free(char *data, size_t allocated, size_t *handler_data) {
-    size_t *prev = (size_t *) handler_data;
-    size_t *curr = (size_t *) *prev;
-    size_t *new_block = (size_t *) data;
-
-    *prev = (size_t) new_block;
-    *new_block = (size_t) curr;
-    *(new_block + 1) = allocated;
+/// Returns the time in nanoseconds of a monotonic clock.
+uint64_t trace_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-//    handler_data_amalgamate(handler_data);
+#ifdef STR_INSTRUMENT
+/// Counts a call and its latency in the histogram of its operation.
+/// \param op The operation, from enum StrOp.
+/// \param ns The latency in nanoseconds.
+void record_latency(int op, uint64_t ns) {
+    size_t bucket = ns == 0 ? 0 : 63 - __builtin_clzl(ns);
+    if (bucket >= STR_LATENCY_BUCKETS) {
+        bucket = STR_LATENCY_BUCKETS - 1;
+    }
+    COUNT(calls[op], 1);
+    COUNT(latency[op][bucket], 1);
 }
+#endif
 
-/// Frees the selected string.
-/// \param str String to be freed from memory.
-void str_free(String *str) {
-    if (str == NULL) {
-        return;
+/// Appends a field to the current record, in LEB128: 7 bits per byte, the
+/// high bit set on all but the last one.
+/// \param value The field.
+void trace_put(size_t value) {
+    while (value >= 0x80) {
+        trace_buffer[trace_used++] = (unsigned char) (value | 0x80);
+        value >>= 7;
     }
-    handler_data_free(str->data, str->allocated, str->handler_data);
+    trace_buffer[trace_used++] = (unsigned char) value;
+}
 
-    handler_string_free(str);
+/// Appends the id of a string to the current record. The id is its
+/// address, which stays the same until it is freed, in words and relative
+/// to the last id, zigzag encoded so that close cells take one or two
+/// bytes.
+/// \param str The string.
+void trace_put_id(const String *str) {
+    size_t id = (size_t) str >> 3;
+    size_t delta = id - trace_last_id;
+    trace_last_id = id;
+    trace_put(delta << 1 ^ (size_t) ((int64_t) delta >> 63));
 }
 
-/// Gets the size of the string
-/// \param str String to get the size of
-/// \return Size of the string
-size_t str_size(String *str) {
-    return str->size;
+/// Starts a record, with its operation and the time since the last one.
+/// The fields follow, and trace_end closes it.
+/// \param op The operation, from enum StrTraceOp.
+void trace_begin(int op) {
+    if (threaded) {
+        pthread_mutex_lock(&trace_lock);
+    }
+    if (trace_used > TRACE_BUFFER - TRACE_RECORD_MAX) {
+        trace_flush();
+    }
+    uint64_t time = trace_time();
+    trace_buffer[trace_used++] = (unsigned char) op;
+    trace_put(time - trace_last_time);
+    trace_last_time = time;
 }
 
-/// Gets the pointer of the data in the string
-/// \param str String to get the data from
-/// \return Pointer to the data in the string
-char *str_data(String *str) {
-    return str->data;
+/// Ends the record started by trace_begin.
+void trace_end(void) {
+    if (threaded) {
+        pthread_mutex_unlock(&trace_lock);
+    }
 }
 
-/// Concatenates two strings together and returns the pointer to the new string.
-/// \param s1 The first string to concatenate
-/// \param s2 The second string to concatenate
-/// \return Pointer to the new string
-String *str_concat(String *s1, String *s2) {
-    size_t s1size = str_size(s1);
-    size_t s2size = str_size(s2);
-    String *s = str_alloc(s1size + s2size);
+/// Records an operation on one string with one field, or none.
+/// \param op The operation.
+/// \param str The string.
+/// \param value The field, if the operation has one.
+/// \param has_value Whether it has one.
+void trace_string(int op, const String *str, size_t value, bool has_value) {
+    trace_begin(op);
+    trace_put_id(str);
+    if (has_value) {
+        trace_put(value);
+    }
+    trace_end();
+}
 
-    char *sdata = str_data(s);
-    memcpy(sdata, str_data(s1), s1size);
-    memcpy(sdata + s1size, str_data(s2), s2size);
+/// Tells if the calls on a string are recorded, which is the case of the
+/// strings of every arena but those of str_arena_create.
+/// \param str The string.
+/// \return true if its allocation was recorded.
+bool is_traced(const String *str) {
+    return !((Arena *) *(str->handler_string + STRING_ARENA))->untraced;
+}
 
-    return s;
+/// Records a new string made from others. When one of them was never
+/// recorded, the new string is recorded as allocated, so that the trace
+/// never refers to a string it doesn't know.
+/// \param op The operation.
+/// \param s The new string.
+/// \param s1 The first string it is made from.
+/// \param s2 The second one, NULL if there is none.
+/// \return true if the record was started, the fields then follow and
+/// trace_end closes it.
+bool trace_derived(int op, const String *s, const String *s1,
+                   const String *s2) {
+    if (!is_traced(s1) || (s2 != NULL && !is_traced(s2))) {
+        trace_string(STR_TRACE_ALLOC, s, s->size, true);
+        return false;
+    }
+    trace_begin(op);
+    trace_put_id(s);
+    trace_put_id(s1);
+    if (s2 != NULL) {
+        trace_put_id(s2);
+    }
+    return true;
 }
 
-/// Copies the string into a new area of memory.
-/// \param string The beginning of the string area in memory.
-/// \param word Offset of words
-/// \param bit Offset of bits in last word
-void copy_new_data(String *string, size_t word, size_t bit) {
-    size_t base_size = sysconf(_SC_PAGESIZE);
-    size_t index = word * 64 + bit;
-    string += index;
-    char *old_data = string->data;
-    size_t size = string->size;
-    string->allocated = size;
+/// Starts recording the calls to a new trace file.
+/// \param path The file, replaced if it exists.
+/// \return false if the file could not be created.
+bool str_trace_start(const char *path) {
+    if (trace_fd != -1) {
+        str_trace_stop();
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    trace_fd = fd;
+    memcpy(trace_buffer, STR_TRACE_MAGIC, 8);
+    trace_used = 8;
+    trace_last_time = trace_time();
+    trace_last_id = 0;
+    return true;
+}
 
-    index = 0;
-    while (size > (base_size * power(2, index))) {
-        index++;
+/// Writes what is left of the trace and closes its file.
+void str_trace_stop(void) {
+    if (trace_fd == -1) {
+        return;
     }
+    trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+}
 
-    char *data = NULL;
-    do {
-        size_t *handler_data =
-                (size_t *) handler_handler_data + index;
-        if (*handler_data == 0) {
-            // Create new block
-            size_t mmap_size = base_size * power(2, index);
-            *handler_data = (size_t) mmap(NULL,
-                                          mmap_size,
-                                          PROT_READ | PROT_WRITE,
-                                          MAP_ANONYMOUS | MAP_PRIVATE,
-                                          0, 0);
-            initialize_handler_data(mmap_size,
-                                    (size_t *) *handler_data);
-        }
-        data = request_data(string, (size_t *) *handler_data);
-        if (data == NULL) {
-            index++;
-        }
-        string->data = data;
-        string->handler_data = (size_t *) *handler_data;
-    } while (data == NULL);
-    memcpy(string->data, old_data, size);
+/// Called when a thread exits, so its arena and its strings can be taken
+/// over by the next thread that needs an arena.
+/// \param arena The arena of the thread.
+void abandon_arena(void *arena) {
+    pthread_mutex_lock(&page_lock);
+    ((Arena *) arena)->abandoned = true;
+    pthread_mutex_unlock(&page_lock);
 }
 
-/// Compacts the used data memory so that it is de-fragmented.
-void str_compact(void) {
-    /*
-     * Need to get all the current strings in the first string struct, then
-     * for every string allocate a new data area, copy the data over, and when
-     * it's done, free the old data area and all that was mmap.
-     */
-    void *old_handler_handler_data = handler_handler_data;
-    long base_size = sysconf(_SC_PAGESIZE);
-    handler_handler_data = mmap(NULL, base_size,
-                                PROT_READ | PROT_WRITE,
-                                MAP_ANONYMOUS | MAP_PRIVATE,
-                                0, 0);
-    for (size_t i = 0; i < base_size; i += sizeof(size_t)) {
-        *((size_t *) handler_handler_data + i) = (size_t) NULL;
-    }
-    size_t *handler_handler_inspector = (size_t *) handler_handler_string;
-    while ((size_t *) *handler_handler_inspector != NULL) {
-        // Loop through the flags and get the used strings.
-        size_t *handler_string_inspector =
-                (size_t *) *handler_handler_inspector;
-        size_t number_of_blocks = *handler_string_inspector;
-        size_t word_flags = number_of_blocks / (sizeof(size_t) * 8) + 1;
-        advance_word_size_t(handler_string_inspector, 1);
-        size_t *beginning_of_strings = handler_string_inspector + word_flags;
+/// Returns the arena the calling thread allocates in, taking over an
+/// abandoned one or creating one the first time a thread allocates.
+/// \return The arena of the thread.
+Arena *current_arena(void) {
+    if (!threaded) {
+        return &main_arena;
+    }
+    if (thread_arena != NULL) {
+        return thread_arena;
+    }
 
-        bool finished = false;
-        for (size_t word = 0; word < word_flags; word++) {
-            for (size_t bit = 0; bit < sizeof(size_t) * 8; bit++) {
-                if (word * 64 + bit > number_of_blocks) {
-                    finished = true;
-                    break;
-                }
-                size_t mut_word = *handler_string_inspector;
-                // Goes from left to right, by checking with AND mask.
-                // Ex: 11011111 & 00100000 => index of the shift
-                if ((mut_word &
-                     ((size_t) 1 << (sizeof(size_t) * 8 - bit - 1)))) {
-                    // Do the funny on this
-                    copy_new_data((String *) beginning_of_strings, word, bit);
-                }
-            }
-            if (finished) break;
-            advance_word_size_t(handler_string_inspector, 1);
-        }
-        advance_word_size_t(handler_handler_inspector, 1);
+    pthread_mutex_lock(&page_lock);
+    Arena *arena = &main_arena;
+    while (arena != NULL && !arena->abandoned) {
+        arena = arena->next;
     }
-    // Deallocate the old mmap areas
-    for (size_t i = 0; i < base_size; i += sizeof(size_t)) {
-        if (*((size_t *) old_handler_handler_data + i) != 0) {
-            munmap((void *) *((size_t *) old_handler_handler_data + i),
-                   base_size * power(2, i / sizeof(size_t)));
-        }
+    if (arena != NULL) {
+        arena->abandoned = false;
     }
-    munmap(old_handler_handler_data, base_size);
-}
+    pthread_mutex_unlock(&page_lock);
 
-/// Gets the size of the string in bytes
-/// \param string The beginning area for String structs
-/// \param word Index of current word of flags
-/// \param bit Index of current bit in word
-/// \return Size in bytes of the string.
-size_t str_get_size(String *string, size_t word, size_t bit) {
-    size_t index = word * 64 + bit;
-    string += index;
-    return string->size;
+    if (arena == NULL) {
+        // All zeros, the headers are created on the first allocation.
+        arena = map_pages(sizeof(Arena));
+        pthread_mutex_lock(&page_lock);
+        arena->next = main_arena.next;
+        main_arena.next = arena;
+        pthread_mutex_unlock(&page_lock);
+    }
+    pthread_setspecific(thread_arena_key, arena);
+    thread_arena = arena;
+    return arena;
 }
 
-/// Returns the amount of memory used by the strings.
-size_t str_livesize(void) {
-    // Get the currently used strings in memory from handler_handler_string
-    size_t livesize = 0;
-    size_t *handler_handler_inspector = (size_t *) handler_handler_string;
-    while ((size_t *) *handler_handler_inspector != NULL) {
-        size_t *handler_string_inspector =
-                (size_t *) *handler_handler_inspector;
-        size_t number_of_blocks = *handler_string_inspector;
-        size_t word_flags = number_of_blocks / (sizeof(size_t) * 8) + 1;
-        advance_word_size_t(handler_string_inspector, 1);
-        size_t *beginning_of_strings = handler_string_inspector + word_flags;
+// Set while the thread of the background compaction runs.
+bool background_running = false;
 
-        bool finished = false;
-        for (size_t word = 0; word < word_flags; word++) {
-            for (size_t bit = 0; bit < sizeof(size_t) * 8; bit++) {
-                if (word * 64 + bit > number_of_blocks) {
-                    finished = true;
-                    break;
-                }
-                size_t mut_word = *handler_string_inspector;
-                // Goes from left to right, by checking with AND mask.
-                // Ex: 11011111 & 00100000 => index of the shift
-                if ((mut_word &
-                     ((size_t) 1 << (sizeof(size_t) * 8 - bit - 1)))) {
-                    livesize += str_get_size((String *) beginning_of_strings,
-                                             word, bit);
-                }
-            }
-            if (finished) break;
-            advance_word_size_t(handler_string_inspector, 1);
+/// Begins an operation of the calling thread on its own arena. While the
+/// background compaction runs, the operations hold the lock of the arena
+/// so that no string moves under them. An arena only starts or stops
+/// locking between two operations of its owner, and the compaction thread
+/// leaves it alone until it locks.
+/// \return The arena of the calling thread.
+Arena *enter_arena(void) {
+    Arena *arena = current_arena();
+    if (arena->lock_depth == 0) {
+        bool locking =
+                __atomic_load_n(&background_running, __ATOMIC_ACQUIRE);
+        if (locking != arena->locking) {
+            __atomic_store_n(&arena->locking, locking, __ATOMIC_RELEASE);
         }
-        advance_word_size_t(handler_handler_inspector, 1);
     }
-    return livesize;
+    // The public functions call each other, only the first one locks.
+    if (arena->locking && arena->lock_depth++ == 0) {
+        pthread_mutex_lock(&arena->lock);
+    }
+    return arena;
 }
 
-/// Returns the amount of 'free' memory available.
-/// \return Total amount of free memory in bytes.
-size_t str_freesize(void) {
-    size_t *data_block_inspector = (size_t *) handler_handler_data;
-    size_t total_free = 0;
-    for (size_t i = 0; i < sysconf(_SC_PAGESIZE) / sizeof(size_t); i++) {
-        if ((size_t *) *data_block_inspector == NULL) {
-            advance_word_size_t(data_block_inspector, 1);
-            continue;
-        }
-        size_t *data_free_inspector = (size_t *) *data_block_inspector;
-        while ((size_t *) *data_free_inspector != NULL) {
-            data_free_inspector = (size_t *) *data_free_inspector;
-            total_free += *(data_free_inspector + 1);
-        }
-        advance_word_size_t(data_block_inspector, 1);
+/// Begins an operation that only needs the arena of the calling thread if
+/// it has one, like freeing: in threaded mode, a thread that only frees
+/// strings of other threads gives them back to their arenas and never
+/// takes one of its own.
+/// \return The arena of the calling thread, NULL if it has none.
+Arena *enter_arena_if_any(void) {
+    if (threaded && thread_arena == NULL) {
+        return NULL;
     }
-    return total_free;
+    return enter_arena();
+}
+
+/// Ends an operation begun by enter_arena.
+/// \param arena The arena of the calling thread.
+void leave_arena(Arena *arena) {
+    if (arena->locking && --arena->lock_depth == 0) {
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/// Turns on the threaded mode, where each thread has its own arena.
+void str_threads_enable(void) {
+    // The arenas of the threads would not be in the file.
+    if (threaded || persist_fd != -1) {
+        return;
+    }
+    pthread_key_create(&thread_arena_key, abandon_arena);
+    // Whichever thread allocates first takes over the strings that were
+    // allocated before.
+    main_arena.abandoned = true;
+    threaded = true;
+}
+
+/// Returns the index in the word of the first available cell.
+/// \param word: The word to search in.
+/// \return The index of the first available cell, -1 if none.
+size_t first_free_cell(size_t word) {
+    if (word == (size_t) -1) {
+        return -1;
+    }
+    // Goes from left to right, the first 0 is the first leading 1 of ~word.
+    return __builtin_clzl(~word);
+}
+
+/// Mask of the bit at an index, indexed 0 at the left like the flags.
+/// \param index Index of the bit in the word.
+/// \return The word with only that bit set.
+size_t left_bit(size_t index) {
+    return (size_t) 1 << (sizeof(size_t) * 8 - 1 - index);
+}
+
+/// Ceiling function, rounds to the next highest integer.
+/// \param d Double to round.
+/// \return d, rounded to the highest size_t integer.
+size_t ceil_size_t(double d) {
+    return (size_t) (size_t) d + (d - (double) (size_t) d > 0);
+}
+
+/// Number of words needed for a bitmap.
+/// \param bits Number of bits in the bitmap.
+/// \return ceil(bits / 64)
+size_t words_for_bits(size_t bits) {
+    return ceil_size_t((double) bits / ((double) sizeof(size_t) * 8));
+}
+
+/// Returns the beginning of the flags of a String page.
+/// \param handler_string The String page.
+/// \return Pointer to the first word of flags.
+size_t *string_flags(size_t *handler_string) {
+    size_t number_of_blocks = *(handler_string + STRING_CELLS);
+    return handler_string + STRING_SUMMARY +
+           words_for_bits(words_for_bits(number_of_blocks));
+}
+
+/// Returns the first cell of a String page, right after its flags.
+/// \param handler_string The String page.
+/// \return Pointer to the first String cell.
+String *string_cells(size_t *handler_string) {
+    size_t number_of_blocks = *(handler_string + STRING_CELLS);
+    return (String *) (string_flags(handler_string) +
+                       words_for_bits(number_of_blocks));
+}
+
+/// Floor of the base 2 logarithm, with a bit scan instead of a loop.
+/// \param n Number to get the logarithm of, must not be 0.
+/// \return floor(log2(n))
+size_t log2_floor(size_t n) {
+    return sizeof(size_t) * 8 - 1 - __builtin_clzl(n);
+}
+
+/// Ceiling of the base 2 logarithm.
+/// \param n Number to get the logarithm of.
+/// \return ceil(log2(n)), 0 if n is 0 or 1.
+size_t log2_ceil(size_t n) {
+    return n <= 1 ? 0 : log2_floor(n - 1) + 1;
+}
+
+/// Rounds a requested amount of bytes to the size of the area that will
+/// hold it: the header, the owner and a whole number of words, and at least
+/// MIN_AREA. It is a multiple of 16 bytes, so that every area but the last
+/// of a page ends on a 16 byte boundary and the data of the next one
+/// starts on one.
+/// \param size Amount of bytes requested.
+/// \return The size of the area in bytes.
+size_t area_size_for(size_t size) {
+    size_t words = ceil_size_t((double) size / (double) sizeof(size_t)) +
+                   AREA_DATA;
+    // An even number of words, so that the data stays aligned.
+    words = (words + 1) & ~(size_t) 1;
+    size_t area = words * sizeof(size_t);
+    return area < MIN_AREA ? MIN_AREA : area;
+}
+
+/// Size in bytes of an area, read from its header.
+/// \param area Beginning of the area.
+/// \return The size of the area, header included.
+size_t area_size(const size_t *area) {
+    return *area & ~AREA_FLAGS;
+}
+
+/// Returns the bin of a free area of the given size.
+/// \param size Size of the area in bytes, at least MIN_AREA.
+/// \return Index of the bin.
+size_t bin_of(size_t size) {
+    return log2_floor(size) - MIN_AREA_LOG2;
+}
+
+/// Number of words of metadata at the beginning of a data page, which
+/// needs one bin per size class that fits in the page.
+/// \param size Size of the page in bytes.
+/// \return Number of words before the first area of the page.
+size_t data_metadata_words(size_t size) {
+    // Even, so that the first area and its data are aligned.
+    return (DATA_BINS + bin_of(size) + 2) & ~(size_t) 1;
+}
+
+/// Size of the biggest area a data page can hold, all of it except the
+/// metadata and the header that closes the page.
+/// \param size Size of the page in bytes.
+/// \return Size of the area in bytes.
+size_t data_page_capacity(size_t size) {
+    return size - (data_metadata_words(size) + 1) * sizeof(size_t);
+}
+
+/// Size of the page at an index of a header, base_page_size * 2^index
+/// bytes up to max_page_size.
+/// \param index Index of the page.
+/// \return The size in bytes.
+size_t page_size_at(size_t index) {
+    size_t base = page_config.base_page_size != 0 ?
+            page_config.base_page_size : os_page_size();
+    size_t cap = page_config.max_page_size;
+    if (cap != 0 && index >= log2_floor(cap / base)) {
+        return cap;
+    }
+    if (index >= 63 - log2_floor(base)) {
+        // Past what a size_t holds, a size no mapping gets.
+        return (size_t) 1 << 63;
+    }
+    return base << index;
+}
+
+/// Sets the page policy, before the first allocation.
+/// \param new_config The policy.
+void str_config(const StrConfig *new_config) {
+    if (main_arena.handler_handler_string != NULL || threaded) {
+        return;
+    }
+    page_config = *new_config;
+    size_t os_page = os_page_size();
+    if (page_config.base_page_size != 0) {
+        // A multiple of the system pages, and a power of two like them.
+        size_t asked = page_config.base_page_size;
+        page_config.base_page_size =
+                asked <= os_page ? os_page : (size_t) 1 << log2_ceil(asked);
+    }
+    size_t base = page_size_at(0);
+    if (page_config.max_page_size != 0) {
+        // A size the pages double to, and at least the first one.
+        size_t asked = page_config.max_page_size;
+        page_config.max_page_size =
+                asked < base ? base : base << log2_floor(asked / base);
+    }
+    if (page_config.reserve != 0 && reserved == NULL) {
+        size_t size =
+                (page_config.reserve + os_page - 1) / os_page * os_page;
+        // Only the pages that are touched take memory.
+        reserved = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED) {
+            reserved = NULL;
+            return;
+        }
+        reserved_next = reserved;
+        reserved_end = reserved + size;
+    }
+}
+
+/// Returns the index of the first data page that is big enough for an
+/// area of `size` bytes, pages being page_size_at(index) bytes.
+/// \param size Size of the area in bytes.
+/// \return The index of the page in handler_handler_data, HANDLER_PAGES
+/// if none is big enough.
+size_t data_page_index(size_t size) {
+    size_t base_size = page_size_at(0);
+    size_t index = log2_ceil(ceil_size_t((double) size / (double) base_size));
+    // The metadata can push it to the next page, but never further.
+    if (data_page_capacity(base_size << index) < size) {
+        index++;
+    }
+    if (page_config.max_page_size != 0 &&
+        page_size_at(index) != base_size << index) {
+        // Past the cap, the pages stop growing.
+        if (data_page_capacity(page_config.max_page_size) < size) {
+            return HANDLER_PAGES;
+        }
+        index = log2_floor(page_config.max_page_size / base_size);
+    }
+    return index;
+}
+
+/// Marks an area as free, writing its header and footer, and adds it to
+/// the bin of its size.
+/// \param handler_data The data page the area is in.
+/// \param area Beginning of the free area.
+/// \param size Size of the area in bytes.
+void bin_push(size_t *handler_data, size_t *area, size_t size) {
+    size_t bin = bin_of(size);
+    size_t *head = handler_data + DATA_BINS + bin;
+    size_t *next = (size_t *) *head;
+    // A free area is never next to another free one, so the one before it
+    // is always used.
+    *area = size | AREA_PREV_USED;
+    *(area + 1) = (size_t) next;
+    *(area + 2) = (size_t) NULL;
+    *(area + size / sizeof(size_t) - 1) = size;
+    if (next != NULL) {
+        *(next + 2) = (size_t) area;
+    }
+    *head = (size_t) area;
+    *(handler_data + DATA_BITMAP) |= (size_t) 1 << bin;
+}
+
+/// Takes a free area out of its bin, in constant time since the bins are
+/// doubly linked.
+/// \param handler_data The data page the area is in.
+/// \param area Beginning of the free area.
+void bin_remove(size_t *handler_data, size_t *area) {
+    size_t bin = bin_of(area_size(area));
+    size_t *next = (size_t *) *(area + 1);
+    size_t *prev = (size_t *) *(area + 2);
+    if (prev != NULL) {
+        *(prev + 1) = (size_t) next;
+    } else {
+        *(handler_data + DATA_BINS + bin) = (size_t) next;
+        if (next == NULL) {
+            *(handler_data + DATA_BITMAP) &= ~((size_t) 1 << bin);
+        }
+    }
+    if (next != NULL) {
+        *(next + 2) = (size_t) prev;
+    }
+}
+
+/// Returns the pointer of an available cell that matches
+/// the requested size in handler_data, and sets cell->allocated to the
+/// number of bytes the area that was taken can hold.
+/// \param cell The cell to get the pointer for.
+/// \return Pointer to the available cell, NULL if none is available.
+char *request_data(String *cell, size_t *handler_data) {
+    size_t requested = area_size_for(cell->allocated);
+    if (requested > data_page_capacity(*(handler_data + DATA_PAGE_SIZE)) ||
+        *(handler_data + DATA_EVACUATING)) {
+        return NULL;
+    }
+    size_t bitmap = *(handler_data + DATA_BITMAP);
+    size_t *bins = handler_data + DATA_BINS;
+    COUNT(data_pages_probed, 1);
+
+    // The head of the bin of the requested size is most likely a block
+    // freed by a string of the same size, so it is tried first.
+    size_t bin = bin_of(requested);
+    size_t *curr = (size_t *) *(bins + bin);
+    COUNT(freelist_nodes, 1);
+    if (curr == NULL || area_size(curr) < requested) {
+        // Every area of a larger bin fits, so the smallest non-empty one
+        // is found with a single bit scan.
+        size_t larger = bitmap & (~(size_t) 1 << bin);
+        if (larger != 0) {
+            curr = (size_t *) *(bins + __builtin_ctzl(larger));
+        } else {
+            // Last resort, the areas of the requested bin that are
+            // smaller than the head might still be big enough.
+            while (curr != NULL && area_size(curr) < requested) {
+                curr = (size_t *) *(curr + 1);
+                COUNT(freelist_nodes, 1);
+            }
+            if (curr == NULL) {
+                return NULL;
+            }
+        }
+    }
+    bin_remove(handler_data, curr);
+
+    // If the remaining size is too small to be a free area, then just add
+    // it to the string, otherwise split and put the rest in its bin.
+    size_t size = area_size(curr);
+    if (size - requested < MIN_AREA) {
+        requested = size;
+        *(curr + size / sizeof(size_t)) |= AREA_PREV_USED;
+    } else {
+        bin_push(handler_data, curr + requested / sizeof(size_t),
+                 size - requested);
+    }
+    *curr = requested | AREA_USED | AREA_PREV_USED;
+    *(curr + 1) = (size_t) cell;
+    *(handler_data + DATA_LIVE) += requested;
+    cell->allocated = requested - AREA_DATA * sizeof(size_t);
+    return (char *) (curr + AREA_DATA);
+}
+
+/// Tells if a String page has no free cell left, moving its hint to the
+/// first summary word that still has one.
+/// \param handler_string The String page.
+/// \return true if every cell of the page is used.
+bool string_page_full(size_t *handler_string) {
+    size_t number_of_summary_words =
+            words_for_bits(words_for_bits(*(handler_string + STRING_CELLS)));
+    size_t *summary = handler_string + STRING_SUMMARY;
+    // Every summary word before the hint is known to be 0.
+    size_t summary_offset = *(handler_string + STRING_HINT);
+    while (summary_offset < number_of_summary_words &&
+           *(summary + summary_offset) == 0) {
+        summary_offset++;
+    }
+    *(handler_string + STRING_HINT) = summary_offset;
+    return summary_offset == number_of_summary_words;
+}
+
+/// Takes up to n free cells of a String page, a whole word of flags at a
+/// time, so that a batch of cells costs one write per word.
+/// \param handler_string The String page.
+/// \param out Where the cells taken go.
+/// \param n Number of cells wanted.
+/// \return The number of cells taken, less than n if the page is full.
+size_t request_strings(size_t *handler_string, String **out, size_t n) {
+    size_t *summary = handler_string + STRING_SUMMARY;
+    String *cells = string_cells(handler_string);
+    size_t taken = 0;
+    while (taken < n && !string_page_full(handler_string)) {
+        COUNT(flag_words_scanned, 1);
+        size_t summary_offset = *(handler_string + STRING_HINT);
+        size_t word_offset = summary_offset * sizeof(size_t) * 8 +
+                             __builtin_clzl(*(summary + summary_offset));
+        size_t *inspector = string_flags(handler_string) + word_offset;
+        size_t free_cells = ~*inspector;
+        size_t mask = 0;
+        while (free_cells != 0 && taken < n) {
+            size_t index = __builtin_clzl(free_cells);
+            free_cells &= ~left_bit(index);
+            mask |= left_bit(index);
+            out[taken++] = cells + word_offset * sizeof(size_t) * 8 + index;
+        }
+        // Flip the bits to 1 to signify we're taking them with OR mask
+        *inspector |= mask;
+        if (*inspector == (size_t) -1) {
+            *(summary + summary_offset) &= ~left_bit(word_offset % 64);
+        }
+    }
+    return taken;
+}
+
+/// Returns the pointer to the first available cell
+/// in handler_string for the string struct.
+/// \return Pointer to the first String cell, NULL if the page is full.
+String *request_string(size_t *handler_string) {
+    String *cell;
+    return request_strings(handler_string, &cell, 1) == 1 ? cell : NULL;
+}
+
+/// Initializes the handler_string so that the first size_t contains
+/// the amount of cells available to use, followed by the index of the page,
+/// the summary hint, the summary words and the
+/// num_cells/(sizeof(size_t)*8) words used for the cell flags.
+/// \param size Size of the handler requested by mmap
+/// \param index Index of the page in handler_handler_string
+/// \param arena The arena the page belongs to
+void initialize_handler_string(size_t size, size_t *handler_string,
+                               size_t index, Arena *arena) {
+    size_t struct_string_size = sizeof(String);
+    // The first words are reserved for the metadata of the page.
+    // This is the completely maximum, without any flags.
+    size_t max_cells = (size - sizeof(size_t) * STRING_SUMMARY) /
+                       struct_string_size;
+
+    // Now to reserve the flag areas.
+    size_t number_of_flag_words = words_for_bits(max_cells);
+    size_t number_of_summary_words = words_for_bits(number_of_flag_words);
+
+    // Readjust max_cells, I know there are cases where there might be a word
+    // of flags that will just have 1s, but that is not too much of a problem.
+    // Ex: 65 blocks of Strings => 2 words of flags, but that extra word takes
+    // up the space of the last block, so there's only 64 cells.
+    max_cells = (size - sizeof(size_t) * (STRING_SUMMARY +
+                                          number_of_summary_words +
+                                          number_of_flag_words)) /
+                struct_string_size;
+    // The readers find the flags and cells with max_cells, which can
+    // need one word less than the estimate.
+    number_of_flag_words = words_for_bits(max_cells);
+    number_of_summary_words = words_for_bits(number_of_flag_words);
+
+    *(handler_string + STRING_CELLS) = max_cells;
+    *(handler_string + STRING_INDEX) = index;
+    *(handler_string + STRING_ARENA) = (size_t) arena;
+    *(handler_string + STRING_HINT) = 0;
+
+    // Every word of flags has a free cell.
+    size_t *inspector = handler_string + STRING_SUMMARY;
+    for (size_t i = 0; i < number_of_summary_words; i++) {
+        *inspector = (size_t) -1;
+        advance_word_size_t(inspector, 1);
+    }
+    if (number_of_flag_words % 64 != 0) {
+        *(inspector - 1) = ~((size_t) -1 >> (number_of_flag_words % 64));
+    }
+
+    // Now to set the rest of the bits to 0.
+    for (size_t i = 0; i < number_of_flag_words; i++) {
+        *inspector = 0;
+        advance_word_size_t(inspector, 1);
+    }
+
+    // The flags are indexed 0 at the left, so the cells that exist are the
+    // high bits of the last word and the rest of it is set to 1.
+    size_t flags_in_last_block = max_cells % 64;
+    if (flags_in_last_block != 0) {
+        *(inspector - 1) = (size_t) -1 >> flags_in_last_block;
+    }
+}
+
+/// Initializes the handler_data so that the first size_t contains the
+/// size of the page, the bins are all empty except for the one holding the
+/// single free area that spans the rest of the page, and the last word is
+/// the used header that closes the page.
+/// \param size Size of the block allocated by mmap
+void initialize_handler_data(size_t size, size_t *handler_data) {
+    size_t metadata_words = data_metadata_words(size);
+    *(handler_data + DATA_PAGE_SIZE) = size;
+    for (size_t i = DATA_LIVE; i < metadata_words; i++) {
+        *(handler_data + i) = (size_t) NULL;
+    }
+    *(handler_data + size / sizeof(size_t) - 1) = AREA_USED;
+
+    bin_push(handler_data, handler_data + metadata_words,
+             data_page_capacity(size));
+}
+
+/// Maps a data page for the arena and counts it.
+/// \param arena The arena the page is for.
+/// \param size Size in bytes of the page.
+/// \return The initialized data page, NULL if there is none left.
+size_t *map_data_page(Arena *arena, size_t size) {
+    size_t *handler_data = map_pages(size);
+    if (handler_data == NULL) {
+        return NULL;
+    }
+    initialize_handler_data(size, handler_data);
+    arena->used_size += size;
+    arena->mapped_pages++;
+    arena->data_capacity += data_page_capacity(size);
+    return handler_data;
+}
+
+/// Gives a data page of the arena back to the system, along with whatever
+/// its used areas were counted for.
+/// \param arena The arena that owns the page.
+/// \param handler_data The data page.
+void unmap_data_page(Arena *arena, size_t *handler_data) {
+    size_t size = *(handler_data + DATA_PAGE_SIZE);
+    arena->used_size -= size;
+    arena->mapped_pages--;
+    arena->data_capacity -= data_page_capacity(size);
+    arena->data_used -= *(handler_data + DATA_LIVE);
+    unmap_pages(handler_data, size);
+}
+
+// Size above which a string gets a mapping of its own.
+size_t large_threshold = 1 << 20;
+
+/// Sets the size above which a string gets a mapping of its own. It only
+/// affects the strings allocated or moved from then on.
+/// \param size The threshold in bytes.
+void str_large_threshold(size_t size) {
+    large_threshold = size;
+}
+
+/// Size of the mapping of a large string, its area rounded to whole
+/// system pages.
+/// \param size The number of bytes the string must hold.
+/// \return The size of the mapping in bytes.
+size_t large_mapping_size(size_t size) {
+    size_t base_size = os_page_size();
+    size_t size_with_links =
+            area_size_for(size) + LARGE_LINKS * sizeof(size_t);
+    return (size_with_links + base_size - 1) / base_size * base_size;
+}
+
+/// Puts a large mapping at the head of the list of its arena, or back in
+/// its place after mremap moved it.
+/// \param arena The arena the mapping belongs to.
+/// \param mapping The mapping, whose links are already set.
+void link_large(Arena *arena, size_t *mapping) {
+    size_t *next = (size_t *) *mapping;
+    size_t *prev = (size_t *) *(mapping + 1);
+    if (next != NULL) {
+        *(next + 1) = (size_t) mapping;
+    }
+    if (prev != NULL) {
+        *prev = (size_t) mapping;
+    } else {
+        arena->large = mapping;
+    }
+}
+
+/// Takes a large mapping out of the list of its arena.
+/// \param arena The arena the mapping belongs to.
+/// \param mapping The mapping.
+void unlink_large(Arena *arena, size_t *mapping) {
+    size_t *next = (size_t *) *mapping;
+    size_t *prev = (size_t *) *(mapping + 1);
+    if (next != NULL) {
+        *(next + 1) = (size_t) prev;
+    }
+    if (prev != NULL) {
+        *prev = (size_t) next;
+    } else {
+        arena->large = next;
+    }
+}
+
+/// Tells if a string has a mapping of its own.
+/// \param str The string, which has a data area.
+/// \return true if the data area of the string is a large one.
+bool is_large(const String *str) {
+    return *((size_t *) str->data - AREA_DATA) & AREA_LARGE;
+}
+
+/// Gives a string a mapping of its own, big enough for cell->allocated
+/// bytes. Sets cell->data, cell->allocated and cell->handler_data, which
+/// is the mapping itself.
+/// \param arena The arena the string belongs to.
+/// \param cell The string.
+/// \return false if there was no mapping left, the string is then left
+/// untouched.
+bool allocate_large(Arena *arena, String *cell) {
+    size_t size = large_mapping_size(cell->allocated);
+    size_t *mapping = map_movable_pages(size);
+    if (mapping == NULL) {
+        return false;
+    }
+    *mapping = (size_t) arena->large;
+    *(mapping + 1) = (size_t) NULL;
+    link_large(arena, mapping);
+    size_t *area = mapping + LARGE_LINKS;
+    size -= LARGE_LINKS * sizeof(size_t);
+    *area = size | AREA_USED | AREA_PREV_USED | AREA_LARGE;
+    *(area + 1) = (size_t) cell;
+    arena->used_size += size + LARGE_LINKS * sizeof(size_t);
+    arena->mapped_pages++;
+    cell->data = (char *) (area + AREA_DATA);
+    cell->allocated = size - AREA_DATA * sizeof(size_t);
+    cell->handler_data = area;
+    return true;
+}
+
+/// Resizes the mapping of a large string with mremap, so that its data is
+/// never copied.
+/// \param arena The arena the string belongs to.
+/// \param str The string, which has a large data area.
+/// \param size The number of bytes the string must hold.
+/// \return false if there was no room for the new mapping, the string is
+/// then left as it was.
+bool resize_large(Arena *arena, String *str, size_t size) {
+    size_t *mapping = (size_t *) str->handler_data - LARGE_LINKS;
+    size_t old_size = area_size(mapping + LARGE_LINKS) +
+                      LARGE_LINKS * sizeof(size_t);
+    size_t new_size = large_mapping_size(size);
+    if (new_size == old_size) {
+        return true;
+    }
+    mapping = remap_pages(mapping, old_size, new_size);
+    if (mapping == NULL) {
+        return false;
+    }
+    link_large(arena, mapping);
+    size_t *area = mapping + LARGE_LINKS;
+    *area = (new_size - LARGE_LINKS * sizeof(size_t)) | (*area & AREA_FLAGS);
+    arena->used_size += new_size - old_size;
+    str->data = (char *) (area + AREA_DATA);
+    str->allocated = area_size(area) - AREA_DATA * sizeof(size_t);
+    str->handler_data = area;
+    return true;
+}
+
+/// Finds a data area for the string, starting at the first page big enough
+/// for it and creating the pages that don't exist yet if allowed. Sets
+/// cell->data, cell->allocated and cell->handler_data.
+/// \param arena The arena to allocate in.
+/// \param cell The string that needs an area of cell->allocated bytes.
+/// \param map_new Whether pages that don't exist yet can be created.
+/// \return false if there was no room in the existing pages and map_new
+/// is false, or if no page could be mapped, the string is then left
+/// untouched.
+bool allocate_data(Arena *arena, String *cell, bool map_new) {
+    // The mappings of large strings would not be in the file.
+    if (cell->allocated > large_threshold && persist_fd == -1) {
+        return map_new && allocate_large(arena, cell);
+    }
+    size_t index = data_page_index(area_size_for(cell->allocated));
+
+    for (; index < HANDLER_PAGES; index++) {
+        size_t *handler_data =
+                (size_t *) arena->handler_handler_data + index;
+        if (*handler_data == 0) {
+            if (!map_new) {
+                continue;
+            }
+            // Create new block
+            *handler_data =
+                    (size_t) map_data_page(arena, page_size_at(index));
+            if (*handler_data == 0) {
+                continue;
+            }
+        }
+        char *data = request_data(cell, (size_t *) *handler_data);
+        if (data != NULL) {
+            arena->data_used += cell->allocated + AREA_DATA * sizeof(size_t);
+            cell->data = data;
+            cell->handler_data = (size_t *) *handler_data;
+            return true;
+        }
+    }
+    // Too big for the pages, or every page is full with a capped size. In
+    // persistent mode, the file is full.
+    return map_new && persist_fd == -1 && allocate_large(arena, cell);
+}
+
+/// Tells if a String page of an arena may still have a free cell.
+/// \param handler_handler The String header of the arena.
+/// \param index Index of the page.
+/// \return true if its bit is set in the bitmap of the header.
+bool page_nonfull(const size_t *handler_handler, size_t index) {
+    return *(handler_handler + STRING_NONFULL + index / 64) &
+           ((size_t) 1 << index % 64);
+}
+
+/// Sets or clears the bit of a String page in the bitmap of the pages that
+/// have a free cell.
+/// \param handler_handler The String header of the arena.
+/// \param index Index of the page.
+/// \param nonfull Whether the page has a free cell.
+void set_page_nonfull(size_t *handler_handler, size_t index, bool nonfull) {
+    size_t *word = handler_handler + STRING_NONFULL + index / 64;
+    if (nonfull) {
+        *word |= (size_t) 1 << index % 64;
+    } else {
+        *word &= ~((size_t) 1 << index % 64);
+    }
+}
+
+/// Finds the first String page that has a free cell.
+/// \param handler_handler The String header of the arena.
+/// \return Its index, HANDLER_PAGES if none has.
+size_t first_nonfull_page(const size_t *handler_handler) {
+    for (size_t word = 0; word < HANDLER_PAGES / 64; word++) {
+        size_t bits = *(handler_handler + STRING_NONFULL + word);
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzl(bits);
+        }
+    }
+    return HANDLER_PAGES;
+}
+
+/// Frees String cells of the same word of flags by assigning their bits in
+/// the header to 0, and marking the word and its page as having a free
+/// cell.
+/// \param arena The arena that owns the cells
+/// \param handler_string The String page of the cells
+/// \param word_offset Index of the word of flags
+/// \param mask The bits of the cells in the word
+void handler_string_free_word(Arena *arena, size_t *handler_string,
+                              size_t word_offset, size_t mask) {
+    *(string_flags(handler_string) + word_offset) &= ~mask;
+
+    size_t summary_offset = word_offset / 64;
+    *(handler_string + STRING_SUMMARY + summary_offset) |=
+            left_bit(word_offset % 64);
+    if (summary_offset < *(handler_string + STRING_HINT)) {
+        *(handler_string + STRING_HINT) = summary_offset;
+    }
+    set_page_nonfull(arena->handler_handler_string,
+                     *(handler_string + STRING_INDEX), true);
+}
+
+/// Frees the string structure by assigning the bit in the header to 0, and
+/// marking its word of flags and its page as having a free cell.
+/// \param arena The arena that owns the string
+/// \param str The string struct to free
+void handler_string_free(Arena *arena, const String *str) {
+    size_t *handler_string = str->handler_string;
+    size_t index = str - string_cells(handler_string);
+    // The bit at index % 64, indexed 0 at the left.
+    handler_string_free_word(arena, handler_string, index / 64,
+                             left_bit(index % 64));
+}
+
+/// Frees the data area of a string, merging it with the areas right before
+/// and after it in memory when they are free, and adds the result to the
+/// bin of its size. The mapping of a large string is given back instead.
+/// \param arena The arena that owns the page
+/// \param data Pointer to the start of the data
+/// \param allocated Amount of memory that was allocated for the string
+void handler_data_free(Arena *arena, char *data, size_t allocated,
+                       size_t *handler_data) {
+    size_t *area = (size_t *) data - AREA_DATA;
+    size_t size = allocated + AREA_DATA * sizeof(size_t);
+    if (*area & AREA_LARGE) {
+        size_t *mapping = area - LARGE_LINKS;
+        unlink_large(arena, mapping);
+        size += LARGE_LINKS * sizeof(size_t);
+        arena->used_size -= size;
+        arena->mapped_pages--;
+        unmap_pages(mapping, size);
+        return;
+    }
+    *(handler_data + DATA_LIVE) -= size;
+    arena->data_used -= size;
+    arena->freed_since_release += size;
+
+    size_t *next = area + size / sizeof(size_t);
+    if (!(*next & AREA_USED)) {
+        bin_remove(handler_data, next);
+        size += area_size(next);
+    }
+    if (!(*area & AREA_PREV_USED)) {
+        // The footer of the previous area is right before this header.
+        size_t *prev = area - *(area - 1) / sizeof(size_t);
+        bin_remove(handler_data, prev);
+        size += area_size(prev);
+        area = prev;
+    }
+
+    bin_push(handler_data, area, size);
+    *(area + size / sizeof(size_t)) &= ~AREA_PREV_USED;
+}
+
+/// Adds strings to the live counters of an arena, or takes them out.
+/// \param arena The arena that owns the strings.
+/// \param size Sum of the sizes of the strings, negated to take them out.
+/// \param strings Number of strings, negated to take them out.
+void count_live(Arena *arena, size_t size, size_t strings) {
+    if (threaded) {
+        __atomic_fetch_add(&arena->live_size, size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&arena->live_strings, strings, __ATOMIC_RELAXED);
+    } else {
+        arena->live_size += size;
+        arena->live_strings += strings;
+    }
+}
+
+/// Frees a string in the arena that owns it.
+/// \param arena The arena that owns the string.
+/// \param str String to be freed from memory.
+void arena_free(Arena *arena, String *str) {
+    if (str->data != NULL) {
+        handler_data_free(arena, str->data, str->allocated,
+                          str->handler_data);
+    }
+
+    handler_string_free(arena, str);
+}
+
+/// Frees the strings other threads gave back to the arena.
+/// \param arena The arena of the calling thread.
+void drain_remote_frees(Arena *arena) {
+    if (__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    String *str = __atomic_exchange_n(&arena->remote_free, NULL,
+                                      __ATOMIC_ACQUIRE);
+    while (str != NULL) {
+        String *next = str->next_remote;
+        arena_free(arena, str);
+        str = next;
+    }
+}
+
+/// Maps the two headers of an arena the first time it allocates.
+/// \param arena The arena of the calling thread.
+/// \param base_size Size of the system pages.
+/// \return false if there were no pages left, the arena is then left
+/// without headers.
+bool initialize_arena(Arena *arena, size_t base_size) {
+    void *handler_handler_string = map_pages(base_size);
+    void *handler_handler_data = map_pages(base_size);
+    if (handler_handler_string == NULL || handler_handler_data == NULL) {
+        if (handler_handler_string != NULL) {
+            unmap_pages(handler_handler_string, base_size);
+        }
+        if (handler_handler_data != NULL) {
+            unmap_pages(handler_handler_data, base_size);
+        }
+        return false;
+    }
+    arena->handler_handler_string = handler_handler_string;
+    arena->handler_handler_data = handler_handler_data;
+    arena->used_size += base_size * 2;
+    arena->mapped_pages += 2;
+    // Initialize them both to contain all 0s.
+    // Probably doesn't matter.
+    size_t number_of_blocks = base_size / sizeof(size_t);
+    for (size_t i = 0; i < number_of_blocks; i++) {
+        *(((size_t *) arena->handler_handler_string) + i) = 0;
+        *(((size_t *) arena->handler_handler_data) + i) = 0;
+    }
+    // The pages themselves are created the first time they're needed.
+    return true;
+}
+
+/// Takes String cells in the arena, without any data area yet. The cells
+/// come from the last page used while it has free cells, otherwise from
+/// the first page that has some, and a page is only created when all are
+/// full.
+/// \param arena The arena of the calling thread.
+/// \param base_size Size of the system pages.
+/// \param out Where the cells go.
+/// \param n Number of cells.
+/// \return The number of cells taken, less than n once every slot of the
+/// header has a full page or when no page could be mapped.
+size_t allocate_cells(Arena *arena, size_t base_size, String **out,
+                      size_t n) {
+    if (arena->handler_handler_string == NULL &&
+        !initialize_arena(arena, base_size)) {
+        return 0;
+    }
+
+    size_t *handler_handler = (size_t *) arena->handler_handler_string;
+    size_t handler_string_index = *(handler_handler + STRING_LAST_PAGE);
+    size_t taken = 0;
+    while (taken < n) {
+        COUNT(string_pages_probed, 1);
+        if (!page_nonfull(handler_handler, handler_string_index)) {
+            handler_string_index = first_nonfull_page(handler_handler);
+        }
+        if (handler_string_index == HANDLER_PAGES) {
+            handler_string_index = 0;
+            while (handler_string_index < HANDLER_PAGES &&
+                   *(handler_handler + handler_string_index) != 0) {
+                handler_string_index++;
+            }
+            if (handler_string_index == HANDLER_PAGES) {
+                // Only with pages capped by str_config.
+                handler_string_index = 0;
+                break;
+            }
+            // The block has yet to be initialized.
+            size_t mmap_size = page_size_at(handler_string_index);
+            *(handler_handler + handler_string_index) =
+                    (size_t) map_pages(mmap_size);
+            if (*(handler_handler + handler_string_index) == 0) {
+                handler_string_index = 0;
+                break;
+            }
+            arena->used_size += mmap_size;
+            arena->mapped_pages++;
+            initialize_handler_string(
+                    mmap_size,
+                    (size_t *) *(handler_handler + handler_string_index),
+                    handler_string_index, arena);
+            set_page_nonfull(handler_handler, handler_string_index, true);
+        }
+
+        size_t *handler_string =
+                (size_t *) *(handler_handler + handler_string_index);
+        size_t first = taken;
+        taken += request_strings(handler_string, out + taken, n - taken);
+        for (size_t i = first; i < taken; i++) {
+            out[i]->handler_string = handler_string;
+        }
+        if (string_page_full(handler_string)) {
+            set_page_nonfull(handler_handler, handler_string_index, false);
+        }
+    }
+    *(handler_handler + STRING_LAST_PAGE) = handler_string_index;
+    return taken;
+}
+
+/// Takes a String cell in the arena, without any data area yet.
+/// \param arena The arena of the calling thread.
+/// \param size Size of the string.
+/// \return Pointer to the string structure, NULL if there is no room.
+String *allocate_string(Arena *arena, size_t size) {
+    String *cell;
+    if (allocate_cells(arena, os_page_size(), &cell, 1) == 0) {
+        return NULL;
+    }
+    cell->size = size;
+    cell->allocated = size;
+    cell->references = 1;
+    cell->hash = 0;
+    count_live(arena, size, 1);
+    return cell;
+}
+
+/// Gives back a String cell whose string got no data area, as if it had
+/// never been allocated.
+/// \param arena The arena that owns the cell.
+/// \param cell The string.
+void discard_cell(Arena *arena, String *cell) {
+    count_live(arena, -cell->size, -1);
+    handler_string_free(arena, cell);
+}
+
+/// Allocates a new string of size 'size' in the arena, as str_arena_alloc
+/// does but without a latency sample, for the operations that allocate
+/// their result and are timed as themselves.
+/// \param arena The arena to allocate in.
+/// \param size Size of the memory requested for the string
+/// \return Pointer to the string structure
+String *arena_alloc(Arena *arena, size_t size) {
+    drain_remote_frees(arena);
+    String *cell = allocate_string(arena, size);
+
+    // Request pointer to the data in the handler_data
+    if (cell != NULL && size > STRING_INLINE &&
+        !allocate_data(arena, cell, true)) {
+        discard_cell(arena, cell);
+        cell = NULL;
+    }
+    return cell;
+}
+
+/// Allocates a new string of size 'size' in the arena and
+/// returns the pointer to the structure.
+/// \param arena The arena to allocate in.
+/// \param size Size of the memory requested for the string
+/// \return Pointer to the string structure
+String *str_arena_alloc(Arena *arena, size_t size) {
+    TIME_START(start);
+    String *cell = arena_alloc(arena, size);
+    TIME_END(STR_OP_ALLOC, start);
+    return cell;
+}
+
+/// Allocates a new string of size 'size' and
+/// returns the pointer to the structure.
+/// \param size Size of the memory requested for the string
+/// \return Pointer to the string structure
+String *str_alloc(size_t size) {
+    Arena *arena = enter_arena();
+    String *str = str_arena_alloc(arena, size);
+    leave_arena(arena);
+    if (trace_fd != -1 && str != NULL) {
+        trace_string(STR_TRACE_ALLOC, str, size, true);
+    }
+    return str;
+}
+
+/// Tells if the data of a string of a batch is carved out of a shared
+/// area, rather than kept inline or allocated on its own.
+/// \param size Size of the string.
+/// \param max_run Largest area shared by strings of the batch.
+/// \return true if the string gets a part of a shared area.
+bool carved_in_batch(size_t size, size_t max_run) {
+    return size > STRING_INLINE && area_size_for(size) <= max_run;
+}
+
+/// Gives the strings of a batch that are carved a single data area, cut
+/// into one used area per string. They end up next to each other, as if
+/// allocated one after the other in a free area, with a single search of
+/// the bins.
+/// \param arena The arena of the calling thread.
+/// \param strs The strings, with their sizes set, the first one carved,
+/// NULL for those already given back.
+/// \param n Number of strings, the last one carved.
+/// \param total Sum of the sizes of the areas of the strings carved.
+/// \param max_run Largest area shared by strings of the batch.
+/// \return false if there was no room for the area, the strings are then
+/// left without data.
+bool carve_data(Arena *arena, String **strs, size_t n, size_t total,
+                size_t max_run) {
+    String *first = strs[0];
+    first->allocated = total - AREA_DATA * sizeof(size_t);
+    if (!allocate_data(arena, first, true)) {
+        return false;
+    }
+    size_t *handler_data = first->handler_data;
+    size_t *area = (size_t *) first->data - AREA_DATA;
+    // The area can be a little bigger than asked, the last string gets it.
+    size_t rest = first->allocated + AREA_DATA * sizeof(size_t);
+
+    for (size_t i = 0; i < n; i++) {
+        String *str = strs[i];
+        if (str == NULL || !carved_in_batch(str->size, max_run)) {
+            continue;
+        }
+        size_t size = i == n - 1 ? rest : area_size_for(str->size);
+        *area = size | AREA_USED | AREA_PREV_USED;
+        *(area + 1) = (size_t) str;
+        str->data = (char *) (area + AREA_DATA);
+        str->allocated = size - AREA_DATA * sizeof(size_t);
+        str->handler_data = handler_data;
+        area += size / sizeof(size_t);
+        rest -= size;
+    }
+    return true;
+}
+
+/// Carves the data of a run of a batch, see carve_data, or gives back the
+/// cells of the strings carved when there is no room for it.
+/// \param arena The arena of the calling thread.
+/// \param strs The strings, the first one carved. The ones given back are
+/// set to NULL.
+/// \param n Number of strings, the last one carved.
+/// \param total Sum of the sizes of the areas of the strings carved.
+/// \param max_run Largest area shared by strings of the batch.
+void carve_or_discard(Arena *arena, String **strs, size_t n, size_t total,
+                      size_t max_run) {
+    if (carve_data(arena, strs, n, total, max_run)) {
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (strs[i] != NULL && carved_in_batch(strs[i]->size, max_run)) {
+            discard_cell(arena, strs[i]);
+            strs[i] = NULL;
+        }
+    }
+}
+
+/// Allocates n strings at once. The cells are taken a word of flags at a
+/// time, and the data of consecutive strings is carved out of one area.
+/// \param sizes Sizes of the strings.
+/// \param n Number of strings.
+/// \param out Where the pointers to the string structures go, NULL for
+/// those that got no room.
+void str_alloc_batch(const size_t *sizes, size_t n, String **out) {
+    if (n == 0) {
+        return;
+    }
+    Arena *arena = enter_arena();
+    drain_remote_frees(arena);
+    size_t base_size = os_page_size();
+    size_t taken = allocate_cells(arena, base_size, out, n);
+    for (size_t i = taken; i < n; i++) {
+        out[i] = NULL;
+    }
+    n = taken;
+
+    size_t live = 0;
+    for (size_t i = 0; i < n; i++) {
+        out[i]->size = sizes[i];
+        out[i]->allocated = sizes[i];
+        out[i]->references = 1;
+        out[i]->hash = 0;
+        live += sizes[i];
+    }
+    count_live(arena, live, n);
+
+    // The strings are carved in runs of at most BATCH_RUN_PAGES pages, a
+    // string too big for a run gets its own area.
+    size_t max_run = base_size * BATCH_RUN_PAGES;
+    if (max_run > large_threshold) {
+        max_run = large_threshold;
+    }
+    if (page_config.max_page_size != 0 &&
+        max_run > data_page_capacity(page_config.max_page_size)) {
+        max_run = data_page_capacity(page_config.max_page_size);
+    }
+    size_t first = n;
+    size_t last = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!carved_in_batch(sizes[i], max_run)) {
+            if (sizes[i] > STRING_INLINE &&
+                !allocate_data(arena, out[i], true)) {
+                discard_cell(arena, out[i]);
+                out[i] = NULL;
+            }
+            continue;
+        }
+        size_t area = area_size_for(sizes[i]);
+        if (first != n && total + area > max_run) {
+            carve_or_discard(arena, out + first, last + 1 - first, total,
+                             max_run);
+            first = n;
+            total = 0;
+        }
+        if (first == n) {
+            first = i;
+        }
+        last = i;
+        total += area;
+    }
+    if (first != n) {
+        carve_or_discard(arena, out + first, last + 1 - first, total,
+                         max_run);
+    }
+    leave_arena(arena);
+    if (trace_fd != -1) {
+        for (size_t i = 0; i < n; i++) {
+            if (out[i] == NULL) {
+                continue;
+            }
+            trace_string(STR_TRACE_ALLOC, out[i], sizes[i], true);
+        }
+    }
+}
+
+/// Tells if a string is a rope that was not flattened yet.
+/// \param str The string.
+/// \return true if the content of the string is still in its operands.
+bool is_rope(const String *str) {
+    return str->size > STRING_INLINE && str->data == NULL;
+}
+
+/// Hash of a content, FNV-1a folded to 32 bits.
+/// \param data The bytes.
+/// \param size Number of bytes.
+/// \return The hash, never 0.
+uint32_t hash_bytes(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    uint32_t folded = (uint32_t) (hash ^ (hash >> 32));
+    return folded == 0 ? 1 : folded;
+}
+
+/// Maps a table of interned strings twice as big, or the first one, and
+/// puts the strings of the old one in it. Their hashes are in the String
+/// cells, so nothing is hashed again.
+/// \param arena The arena that owns the table.
+/// \return false if there were no pages left, the old table is then kept.
+bool grow_interned(Arena *arena) {
+    String **old = arena->interned;
+    size_t old_capacity = arena->interned_capacity;
+    size_t capacity = old == NULL ?
+            os_page_size() / sizeof(String *) : old_capacity * 2;
+    // Zeroed pages, every slot is empty.
+    String **table = map_pages(capacity * sizeof(String *));
+    if (table == NULL) {
+        return false;
+    }
+    arena->interned = table;
+    arena->interned_capacity = capacity;
+    arena->used_size += capacity * sizeof(String *);
+    arena->mapped_pages++;
+    if (old == NULL) {
+        return true;
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i] == NULL) {
+            continue;
+        }
+        size_t slot = old[i]->hash & (capacity - 1);
+        while (arena->interned[slot] != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        arena->interned[slot] = old[i];
+    }
+    arena->used_size -= old_capacity * sizeof(String *);
+    arena->mapped_pages--;
+    unmap_pages(old, old_capacity * sizeof(String *));
+    return true;
+}
+
+/// Takes a string out of the table of interned strings. The strings after
+/// it that were pushed past their slot are shifted back, so that the
+/// table never needs tombstones.
+/// \param arena The arena that owns the table.
+/// \param str The interned string.
+void unintern(Arena *arena, String *str) {
+    size_t mask = arena->interned_capacity - 1;
+    size_t hole = str->hash & mask;
+    while (arena->interned[hole] != str) {
+        hole = (hole + 1) & mask;
+    }
+    for (size_t i = (hole + 1) & mask; arena->interned[i] != NULL;
+         i = (i + 1) & mask) {
+        // The string can fill the hole if its own slot is not between the
+        // hole and where it is, going around the end of the table.
+        size_t home = arena->interned[i]->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            arena->interned[hole] = arena->interned[i];
+            hole = i;
+        }
+    }
+    arena->interned[hole] = NULL;
+    arena->interned_count--;
+    str->hash = 0;
+}
+
+/// Tells if a string is a view of the data area of a block.
+/// \param str The string.
+/// \return true if the content of the string is in its block.
+bool is_view(const String *str) {
+    return str->size > STRING_INLINE && str->view_handler_data == NULL;
+}
+
+/// Frees the String cell and the data area of a string that nothing
+/// references anymore.
+/// \param str String to be freed from memory.
+void free_string(String *str) {
+    Arena *owner = (Arena *) *(str->handler_string + STRING_ARENA);
+    // Before next_remote takes the place of the size. The bytes of a view
+    // are counted by its block.
+    count_live(owner, is_view(str) ? 0 : -str->size, -1);
+    if (str->size <= STRING_INLINE || is_view(str)) {
+        str->data = NULL;
+    }
+    if (threaded && owner != thread_arena) {
+        // Only the owner touches its pages, so the string is pushed on its
+        // stack of remote frees. Pushing never races with the owner taking
+        // the whole stack at once, so there is no ABA problem.
+        String *head = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+        do {
+            str->next_remote = head;
+        } while (!__atomic_compare_exchange_n(&owner->remote_free, &head, str,
+                                              true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+        return;
+    }
+    arena_free(owner, str);
+}
+
+/// Adds a reference to a string, in the thread that owns it: the ropes,
+/// views and interned strings that take references are not made in
+/// threaded mode. At REFERENCES_MAX the count stays there.
+/// \param str The string.
+void add_reference(String *str) {
+    if (str->references != REFERENCES_MAX) {
+        str->references++;
+    }
+}
+
+/// Takes away a reference to a string, unless its count saturated.
+/// \param str The string.
+/// \return The number of references left, never 0 for a saturated count.
+size_t drop_reference(String *str) {
+    if (str->references == REFERENCES_MAX) {
+        return REFERENCES_MAX;
+    }
+    return threaded ?
+           __atomic_sub_fetch(&str->references, 1, __ATOMIC_ACQ_REL) :
+           --str->references;
+}
+
+/// Drops one reference to a string, and frees it if it was the last one,
+/// along with the references it held on its operands or its block. Only
+/// the smaller operand is released by a recursive call, so the recursion
+/// never goes deeper than log2 of the size, whatever the shape of the
+/// ropes.
+/// \param str The string.
+void release_string(String *str) {
+    while (str != NULL) {
+        if (drop_reference(str) != 0) {
+            return;
+        }
+        if (str->hash != 0) {
+            unintern((Arena *) *(str->handler_string + STRING_ARENA), str);
+        }
+        String *next = NULL;
+        if (is_rope(str)) {
+            String *smaller = str->left;
+            next = str->right;
+            if (smaller->size > next->size) {
+                smaller = str->right;
+                next = str->left;
+            }
+            release_string(smaller);
+        } else if (is_view(str)) {
+            next = str->base;
+        }
+        free_string(str);
+        str = next;
+    }
+}
+
+/*
+ * Giving back free memory without moving anything. The whole system pages
+ * inside the free areas of the data pages are dropped with madvise, and
+ * the String pages without any used cell are unmapped. A free area that
+ * was dropped gets a tag in its fourth word, which is not part of what
+ * was dropped, so the next calls skip it until it changes: the tag holds
+ * its address and size, and a merge or a split gives a free area another
+ * start or another size. At worst the bytes of a string that were never
+ * written leave an old tag, and the area stays resident.
+ */
+
+// Mixed with the address and size of a free area to tag it as dropped.
+#define RELEASED_TAG ((size_t) 0x72656c6561736564)
+
+// Bytes of data areas freed in an arena after which str_free gives the
+// free memory back, 0 for never.
+size_t release_threshold = 0;
+
+/// Sets how many bytes of data areas an arena frees before str_free gives
+/// its free memory back, see stralloc.h.
+/// \param bytes The threshold, 0 to only do it on request.
+void str_release_threshold(size_t bytes) {
+    release_threshold = bytes;
+}
+
+/// Tells if no cell of a String page is used, every word of flags being
+/// as initialize_handler_string left it.
+/// \param handler_string The String page.
+/// \return true if every cell is free.
+bool string_page_empty(size_t *handler_string) {
+    size_t cells = *(handler_string + STRING_CELLS);
+    size_t number_of_flag_words = words_for_bits(cells);
+    size_t *flags = string_flags(handler_string);
+    for (size_t word = 0; word + 1 < number_of_flag_words; word++) {
+        if (*(flags + word) != 0) {
+            return false;
+        }
+    }
+    // The bits after the last cell are set.
+    size_t padding = cells % 64 != 0 ? (size_t) -1 >> (cells % 64) : 0;
+    return *(flags + number_of_flag_words - 1) == padding;
+}
+
+/// Drops the whole system pages inside the free areas of a data page. A
+/// page being evacuated in the background is left alone, since its
+/// evacuation may be halfway through one of its free areas.
+/// \param handler_data The data page.
+/// \return The number of bytes dropped.
+size_t release_free_areas(size_t *handler_data) {
+    if (*(handler_data + DATA_EVACUATING)) {
+        return 0;
+    }
+    size_t base_size = os_page_size();
+    // In persistent mode the file must let go of them too.
+    int advice = persist_fd != -1 ? MADV_REMOVE : MADV_DONTNEED;
+    size_t released = 0;
+    size_t bitmap = *(handler_data + DATA_BITMAP);
+    // Only the bins of areas of at least two system pages can hold one
+    // whole page after the tag.
+    size_t smallest_bin = bin_of(base_size * 2);
+    bitmap &= (size_t) -1 << smallest_bin;
+    while (bitmap != 0) {
+        size_t bin = __builtin_ctzl(bitmap);
+        bitmap &= bitmap - 1;
+        for (size_t *area = (size_t *) *(handler_data + DATA_BINS + bin);
+             area != NULL; area = (size_t *) *(area + 1)) {
+            size_t size = area_size(area);
+            size_t tag = (size_t) area ^ size ^ RELEASED_TAG;
+            if (*(area + 3) == tag) {
+                continue;
+            }
+            // After the header, the links and the tag, before the footer.
+            size_t start = ((size_t) (area + 4) + base_size - 1) &
+                           ~(base_size - 1);
+            size_t end = ((size_t) (area + size / sizeof(size_t) - 1)) &
+                         ~(base_size - 1);
+            if (start < end) {
+                COUNT(madvises, 1);
+                if (madvise((void *) start, end - start, advice) != 0) {
+                    continue;
+                }
+                released += end - start;
+            }
+            *(area + 3) = tag;
+        }
+    }
+    return released;
+}
+
+/// Gives the free memory of an arena back to the system, see
+/// str_release_free_memory.
+/// \param arena The arena.
+/// \return The number of bytes given back.
+size_t str_arena_release_free_memory(Arena *arena) {
+    drain_remote_frees(arena);
+    arena->freed_since_release = 0;
+    if (arena->handler_handler_string == NULL) {
+        return 0;
+    }
+    size_t released = 0;
+    size_t *handler_handler = (size_t *) arena->handler_handler_string;
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_string = (size_t *) *(handler_handler + i);
+        if (handler_string == NULL || !string_page_empty(handler_string)) {
+            continue;
+        }
+        // allocate_cells maps a page in the first empty slot again.
+        size_t size = page_size_at(i);
+        unmap_pages(handler_string, size);
+        *(handler_handler + i) = (size_t) NULL;
+        set_page_nonfull(handler_handler, i, false);
+        arena->used_size -= size;
+        arena->mapped_pages--;
+        released += size;
+    }
+
+    handler_handler = (size_t *) arena->handler_handler_data;
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + i);
+        if (handler_data != NULL) {
+            released += release_free_areas(handler_data);
+        }
+    }
+    COUNT(released_bytes, released);
+    return released;
+}
+
+/// Gives the free memory of the arena of the calling thread back to the
+/// system.
+/// \return The number of bytes given back.
+size_t str_release_free_memory(void) {
+    Arena *arena = enter_arena();
+    size_t released = str_arena_release_free_memory(arena);
+    leave_arena(arena);
+    return released;
+}
+
+/// Gives the free memory of an arena back once it freed enough since the
+/// last time, see str_release_threshold. Only the calling thread's arena
+/// is touched in threaded mode, the others may be in use.
+/// \param arena The arena of the strings that were freed.
+/// \param current The arena of the calling thread, NULL if it has none.
+void release_past_threshold(Arena *arena, Arena *current) {
+    if (release_threshold != 0 && (!threaded || arena == current) &&
+        arena->freed_since_release >= release_threshold) {
+        str_arena_release_free_memory(arena);
+    }
+}
+
+/// Frees the selected string.
+/// \param str String to be freed from memory.
+void str_free(String *str) {
+    if (str == NULL) {
+        return;
+    }
+    // Before the cell can be taken again by another thread.
+    if (trace_fd != -1 && is_traced(str)) {
+        trace_string(STR_TRACE_FREE, str, 0, false);
+    }
+    TIME_START(start);
+    Arena *arena = enter_arena_if_any();
+    Arena *owner = (Arena *) *(str->handler_string + STRING_ARENA);
+    release_string(str);
+    release_past_threshold(owner, arena);
+    if (arena != NULL) {
+        leave_arena(arena);
+    }
+    TIME_END(STR_OP_FREE, start);
+}
+
+/// Frees n strings at once. The cells of the calling thread's arena that
+/// share a word of flags are freed with a single write, and the live
+/// counters are updated once. Ropes and the strings of other threads are
+/// freed as by str_free, and so are views and interned strings.
+/// \param strs The strings, NULL ones are skipped.
+/// \param n Number of strings.
+void str_free_batch(String **strs, size_t n) {
+    Arena *arena = enter_arena_if_any();
+    size_t *handler_string = NULL;
+    size_t word_offset = 0;
+    size_t mask = 0;
+    size_t live = 0;
+    size_t strings = 0;
+    for (size_t i = 0; i < n; i++) {
+        String *str = strs[i];
+        if (str == NULL) {
+            continue;
+        }
+        if (trace_fd != -1 && is_traced(str)) {
+            trace_string(STR_TRACE_FREE, str, 0, false);
+        }
+        if (is_rope(str) || is_view(str) || str->hash != 0 ||
+            (Arena *) *(str->handler_string + STRING_ARENA) != arena) {
+            release_string(str);
+            continue;
+        }
+        if (drop_reference(str) != 0) {
+            continue;
+        }
+        live += str->size;
+        strings++;
+        if (str->size > STRING_INLINE) {
+            handler_data_free(arena, str->data, str->allocated,
+                              str->handler_data);
+        }
+
+        size_t index = str - string_cells(str->handler_string);
+        if (str->handler_string != handler_string ||
+            index / 64 != word_offset) {
+            if (mask != 0) {
+                handler_string_free_word(arena, handler_string, word_offset,
+                                         mask);
+            }
+            handler_string = str->handler_string;
+            word_offset = index / 64;
+            mask = 0;
+        }
+        mask |= left_bit(index % 64);
+    }
+    if (mask != 0) {
+        handler_string_free_word(arena, handler_string, word_offset, mask);
+    }
+    if (arena != NULL) {
+        count_live(arena, -live, -strings);
+        release_past_threshold(arena, arena);
+        leave_arena(arena);
+    }
+}
+
+/// Copies the content of a string, rope or not, to a buffer. As when
+/// releasing, only the smaller operand of a rope is copied by a recursive
+/// call.
+/// \param buffer Where the content goes.
+/// \param str The string.
+void copy_content(char *buffer, String *str) {
+    while (is_rope(str)) {
+        String *left = str->left;
+        String *right = str->right;
+        if (left == right) {
+            // A string concatenated with itself is copied only once.
+            copy_content(buffer, left);
+            memcpy(buffer + left->size, buffer, left->size);
+            return;
+        }
+        if (left->size < right->size) {
+            copy_content(buffer, left);
+            buffer += left->size;
+            str = right;
+        } else {
+            copy_content(buffer + left->size, right);
+            str = left;
+        }
+    }
+    memcpy(buffer, str_cdata(str), str->size);
+}
+
+/// Gives a rope a data area with the content of its operands, then lets
+/// go of the operands.
+/// \param arena The arena that owns the rope.
+/// \param rope The rope.
+/// \return false if there was no room for the data area, the rope is then
+/// left as it was.
+bool flatten_rope(Arena *arena, String *rope) {
+    String *left = rope->left;
+    String *right = rope->right;
+    rope->allocated = rope->size;
+    if (!allocate_data(arena, rope, true)) {
+        // allocated was written over left.
+        rope->left = left;
+        return false;
+    }
+
+    char *buffer = rope->data;
+    copy_content(buffer, left);
+    copy_content(buffer + left->size, right);
+    COUNT(concat_bytes, rope->size);
+    release_string(left);
+    release_string(right);
+    return true;
+}
+
+/// Gets the size of the string
+/// \param str String to get the size of
+/// \return Size of the string
+size_t str_size(String *str) {
+    return str->size;
+}
+
+/// Gives a view a data area of its own with its content. The view takes
+/// the data area of its block when no other view shares it, otherwise the
+/// content is copied.
+/// \param arena The arena that owns the view.
+/// \param view The view.
+/// \return false if there was no room for the copy, the view is then left
+/// as it was.
+bool unshare_view(Arena *arena, String *view) {
+    String *block = view->base;
+    size_t offset = view->offset;
+    size_t size = view->size;
+    if (block->references == 1) {
+        // The content goes to the beginning of the area.
+        memmove(block->data, block->data + offset, size);
+        view->allocated = block->allocated;
+        view->data = block->data;
+        view->handler_data = block->handler_data;
+        *((size_t *) view->data - AREA_DATA + 1) = (size_t) view;
+        Arena *owner = (Arena *) *(block->handler_string + STRING_ARENA);
+        count_live(owner, -block->size, -1);
+        count_live(arena, size, 0);
+        handler_string_free(owner, block);
+        return true;
+    }
+    view->allocated = size;
+    if (!allocate_data(arena, view, true)) {
+        // allocated was written over offset.
+        view->offset = offset;
+        return false;
+    }
+    memcpy(view->data, block->data + offset, size);
+    count_live(arena, size, 0);
+    release_string(block);
+    return true;
+}
+
+/// Gets the pointer of the data in the string, to read it only. A view
+/// gives the data of its block.
+/// \param str String to get the data from
+/// \return Pointer to the data in the string, NULL for a rope that there
+/// was no room to flatten.
+const char *str_cdata(String *str) {
+    if (str->size <= STRING_INLINE) {
+        return str->inline_data;
+    }
+    Arena *arena = enter_arena();
+    if (str->data == NULL &&
+        !flatten_rope((Arena *) *(str->handler_string + STRING_ARENA),
+                      str)) {
+        leave_arena(arena);
+        return NULL;
+    }
+    const char *data = is_view(str) ? str->base->data + str->offset :
+                       str->data;
+    leave_arena(arena);
+    return data;
+}
+
+/// Gets the pointer of the data in the string. A view gets its own copy
+/// first, so that writing to it doesn't change the other views.
+/// \param str String to get the data from
+/// \return Pointer to the data in the string, NULL for a rope or a view
+/// that there was no room to give a data area of its own.
+char *str_data(String *str) {
+    if (str->size <= STRING_INLINE) {
+        return str->inline_data;
+    }
+    Arena *current = enter_arena();
+    Arena *arena = (Arena *) *(str->handler_string + STRING_ARENA);
+    if ((str->data == NULL && !flatten_rope(arena, str)) ||
+        (is_view(str) && !unshare_view(arena, str))) {
+        leave_arena(current);
+        return NULL;
+    }
+    char *data = str->data;
+    leave_arena(current);
+    return data;
+}
+
+/// Grows the data area of a string over the area right after it, when
+/// that one is free and the two together are big enough.
+/// \param arena The arena that owns the string.
+/// \param str The string, which has a data area.
+/// \param size The number of bytes the area must hold.
+/// \return true if the area now holds size bytes, false if it was left
+/// as it was.
+bool grow_data_in_place(Arena *arena, String *str, size_t size) {
+    size_t *handler_data = str->handler_data;
+    size_t *area = (size_t *) str->data - AREA_DATA;
+    size_t current = area_size(area);
+    size_t *next = area + current / sizeof(size_t);
+    size_t requested = area_size_for(size);
+    // A page being evacuated only loses strings, see
+    // evacuate_in_background.
+    if (*next & AREA_USED || current + area_size(next) < requested ||
+        *(handler_data + DATA_EVACUATING)) {
+        return false;
+    }
+
+    // Same as request_data, the rest of the free area is split off unless
+    // it is too small.
+    size_t total = current + area_size(next);
+    bin_remove(handler_data, next);
+    if (total - requested < MIN_AREA) {
+        requested = total;
+        *(area + total / sizeof(size_t)) |= AREA_PREV_USED;
+    } else {
+        bin_push(handler_data, area + requested / sizeof(size_t),
+                 total - requested);
+    }
+    *area = requested | (*area & AREA_FLAGS);
+    *(handler_data + DATA_LIVE) += requested - current;
+    arena->data_used += requested - current;
+    str->allocated = requested - AREA_DATA * sizeof(size_t);
+    return true;
+}
+
+/// Changes the size of a string, keeping its content up to the smaller of
+/// the two sizes. The data area grows in place if it can, otherwise the
+/// string moves to an area half again as big as needed, so that a string
+/// that keeps growing only moves O(log n) times. A large string is
+/// remapped instead, without any copy.
+/// \param str The string.
+/// \param size The new size.
+/// \return false if there was no room for it, the string is then left as
+/// it was.
+bool resize_string(String *str, size_t size) {
+    Arena *arena = (Arena *) *(str->handler_string + STRING_ARENA);
+    size_t old_size = str->size;
+    // The content of a rope is needed, and its operands are no use after.
+    char *old_data = str_data(str);
+    if (old_data == NULL) {
+        return false;
+    }
+
+    if (old_size <= STRING_INLINE) {
+        if (size > STRING_INLINE) {
+            // The content is where the pointers go.
+            char content[STRING_INLINE];
+            memcpy(content, old_data, old_size);
+            str->allocated = size + size / 2;
+            if (!allocate_data(arena, str, true)) {
+                // allocated was written over the content.
+                memcpy(str->inline_data, content, old_size);
+                return false;
+            }
+            memcpy(str->data, content, old_size);
+        }
+        count_live(arena, size - old_size, 0);
+        str->size = size;
+        return true;
+    }
+
+    if (size <= STRING_INLINE) {
+        size_t allocated = str->allocated;
+        size_t *handler_data = str->handler_data;
+        char content[STRING_INLINE];
+        memcpy(content, old_data, size);
+        handler_data_free(arena, old_data, allocated, handler_data);
+        memcpy(str->inline_data, content, size);
+        count_live(arena, size - old_size, 0);
+        str->size = size;
+        return true;
+    }
+
+    if (is_large(str)) {
+        if (!resize_large(arena, str, size)) {
+            return false;
+        }
+    } else if (size > str->allocated &&
+               !grow_data_in_place(arena, str, size)) {
+        size_t old_allocated = str->allocated;
+        size_t *old_handler_data = str->handler_data;
+        str->allocated = size + size / 2;
+        if (!allocate_data(arena, str, true)) {
+            str->allocated = old_allocated;
+            return false;
+        }
+        memcpy(str->data, old_data, old_size);
+        handler_data_free(arena, old_data, old_allocated, old_handler_data);
+    }
+    count_live(arena, size - old_size, 0);
+    str->size = size;
+    return true;
+}
+
+/// Changes the size of a string, see resize_string.
+/// \param str The string.
+/// \param size The new size.
+/// \return false if there was no room for it, see resize_string.
+bool str_resize(String *str, size_t size) {
+    if (trace_fd != -1 && is_traced(str)) {
+        trace_string(STR_TRACE_RESIZE, str, size, true);
+    }
+    TIME_START(start);
+    Arena *arena = enter_arena();
+    bool resized = resize_string(str, size);
+    leave_arena(arena);
+    TIME_END(STR_OP_RESIZE, start);
+    return resized;
+}
+
+/// Adds bytes at the end of a string, growing it like str_resize.
+/// \param dst The string.
+/// \param src The bytes to add, which can be part of dst itself.
+/// \param n The number of bytes to add.
+/// \return false if there was no room for them, dst is then left as it
+/// was.
+bool str_append(String *dst, const char *src, size_t n) {
+    Arena *arena = enter_arena();
+    size_t size = str_size(dst);
+    // A view gets its own copy in str_resize, src is found in the shared
+    // data first.
+    const char *data = str_cdata(dst);
+    size_t offset = src - data;
+    bool inside = src >= data && src < data + size;
+    if (data == NULL || !str_resize(dst, size + n)) {
+        leave_arena(arena);
+        return false;
+    }
+    char *new_data = str_data(dst);
+    if (inside) {
+        // The string may have moved.
+        src = new_data + offset;
+    }
+    memcpy(new_data + size, src, n);
+    leave_arena(arena);
+    return true;
+}
+
+// Whether str_concat makes ropes instead of copying.
+bool ropes = false;
+
+/// Turns the rope mode on or off. It only affects the strings
+/// concatenated from then on.
+/// \param enable Whether str_concat makes ropes.
+void str_ropes_enable(bool enable) {
+    ropes = enable;
+}
+
+/// Concatenates two strings together in the arena and returns the pointer
+/// to the new string.
+/// \param arena The arena the new string is allocated in.
+/// \param s1 The first string to concatenate
+/// \param s2 The second string to concatenate
+/// \return Pointer to the new string
+String *str_arena_concat(Arena *arena, String *s1, String *s2) {
+    TIME_START(start);
+    size_t s1size = str_size(s1);
+    size_t s2size = str_size(s2);
+    // In persistent mode, the rope could find the file full once flattened.
+    if (ropes && !threaded && persist_fd == -1 &&
+        s1size + s2size > STRING_INLINE) {
+        String *s = allocate_string(arena, s1size + s2size);
+        if (s == NULL) {
+            TIME_END(STR_OP_CONCAT, start);
+            return NULL;
+        }
+        s->left = s1;
+        s->data = NULL;
+        s->right = s2;
+        add_reference(s1);
+        add_reference(s2);
+        TIME_END(STR_OP_CONCAT, start);
+        return s;
+    }
+    const char *s1data = str_cdata(s1);
+    const char *s2data = str_cdata(s2);
+    String *s = s1data != NULL && s2data != NULL ?
+            arena_alloc(arena, s1size + s2size) : NULL;
+    if (s == NULL) {
+        TIME_END(STR_OP_CONCAT, start);
+        return NULL;
+    }
+
+    char *sdata = str_data(s);
+    memcpy(sdata, s1data, s1size);
+    memcpy(sdata + s1size, s2data, s2size);
+    COUNT(concat_bytes, s1size + s2size);
+
+    TIME_END(STR_OP_CONCAT, start);
+    return s;
+}
+
+/// Concatenates two strings together and returns the pointer to the new string.
+/// \param s1 The first string to concatenate
+/// \param s2 The second string to concatenate
+/// \return Pointer to the new string
+String *str_concat(String *s1, String *s2) {
+    Arena *arena = enter_arena();
+    String *s = str_arena_concat(arena, s1, s2);
+    leave_arena(arena);
+    if (trace_fd != -1 && s != NULL &&
+        trace_derived(STR_TRACE_CONCAT, s, s1, s2)) {
+        trace_end();
+    }
+    return s;
+}
+
+/// Turns a string with a data area into a view of a new block, which
+/// takes over the data area.
+/// \param arena The arena that owns the string.
+/// \param str The string.
+/// \return The block, referenced by str only, NULL when there is no room
+/// for it, str is then left as it was.
+String *share_string(Arena *arena, String *str) {
+    String *block = allocate_string(arena, str->size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->allocated = str->allocated;
+    block->data = str->data;
+    block->handler_data = str->handler_data;
+    *((size_t *) block->data - AREA_DATA + 1) = (size_t) block;
+    str->offset = 0;
+    str->base = block;
+    str->view_handler_data = NULL;
+    count_live(arena, -str->size, 0);
+    return block;
+}
+
+/// Makes a string of the bytes of another one, as a view of its block
+/// when it is too long to be inline, without copying anything.
+/// \param str The string.
+/// \param offset Offset of the bytes in str.
+/// \param size Number of bytes.
+/// \return Pointer to the new string.
+String *make_view(String *str, size_t offset, size_t size) {
+    const char *data = str_cdata(str);
+    if (data == NULL) {
+        return NULL;
+    }
+    // The block and the view go in the arena of str, which is also the
+    // one its data area is freed against.
+    Arena *arena = (Arena *) *(str->handler_string + STRING_ARENA);
+    if (size <= STRING_INLINE || threaded || persist_fd != -1 ||
+        __atomic_load_n(&arena->pins_count, __ATOMIC_RELAXED) != 0) {
+        // Another thread could be compacting the pages of str. A pinned
+        // string must keep its data area, see str_pin. In persistent mode,
+        // the copy is the only time the file can be found full.
+        String *s = arena_alloc(current_arena(), size);
+        if (s != NULL) {
+            memcpy(str_data(s), data + offset, size);
+        }
+        return s;
+    }
+    String *view = allocate_string(arena, size);
+    if (view == NULL) {
+        return NULL;
+    }
+    String *block;
+    if (is_view(str)) {
+        block = str->base;
+        offset += str->offset;
+    } else {
+        block = share_string(arena, str);
+        if (block == NULL) {
+            discard_cell(arena, view);
+            return NULL;
+        }
+    }
+    add_reference(block);
+    count_live(arena, -size, 0);
+    view->offset = offset;
+    view->base = block;
+    view->view_handler_data = NULL;
+    return view;
+}
+
+/// Duplicates a string in constant time, the two share the data until one
+/// of them is written to.
+/// \param str The string.
+/// \return Pointer to the new string.
+String *str_dup(String *str) {
+    Arena *arena = enter_arena();
+    String *s = make_view(str, 0, str->size);
+    leave_arena(arena);
+    if (trace_fd != -1 && s != NULL &&
+        trace_derived(STR_TRACE_DUP, s, str, NULL)) {
+        trace_end();
+    }
+    return s;
+}
+
+/// Returns the bytes [offset, offset + size) of a string, sharing them
+/// with it.
+/// \param str The string.
+/// \param offset Offset of the first byte.
+/// \param size Number of bytes.
+/// \return Pointer to the new string.
+String *str_substr(String *str, size_t offset, size_t size) {
+    Arena *arena = enter_arena();
+    String *s = make_view(str, offset, size);
+    leave_arena(arena);
+    if (trace_fd != -1 && s != NULL &&
+        trace_derived(STR_TRACE_SUBSTR, s, str, NULL)) {
+        trace_put(offset);
+        trace_put(size);
+        trace_end();
+    }
+    return s;
+}
+
+/// Returns the interned string of a content: the same String every time,
+/// with one more reference, until its last reference is freed.
+/// \param data The content.
+/// \param size Number of bytes of the content.
+/// \return Pointer to the string structure.
+String *intern(const char *data, size_t size) {
+    if (threaded) {
+        // The table is not shared between the arenas.
+        String *s = arena_alloc(current_arena(), size);
+        if (s != NULL) {
+            memcpy(str_data(s), data, size);
+        }
+        return s;
+    }
+    Arena *arena = current_arena();
+    // At most three quarters full, so the probes stay short. Without
+    // pages left, fuller, but always with an empty slot to end the probes.
+    if ((arena->interned_count + 1) * 4 > arena->interned_capacity * 3 &&
+        !grow_interned(arena) &&
+        arena->interned_count + 1 >= arena->interned_capacity) {
+        return NULL;
+    }
+    uint32_t hash = hash_bytes(data, size);
+    size_t mask = arena->interned_capacity - 1;
+    size_t slot = hash & mask;
+    for (String *s = arena->interned[slot]; s != NULL;
+         s = arena->interned[slot]) {
+        if (s->hash == hash && s->size == size &&
+            memcmp(str_cdata(s), data, size) == 0) {
+            add_reference(s);
+            return s;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    String *s = arena_alloc(arena, size);
+    if (s == NULL) {
+        return NULL;
+    }
+    memcpy(str_data(s), data, size);
+    s->hash = hash;
+    arena->interned[slot] = s;
+    arena->interned_count++;
+    return s;
+}
+
+/// Returns the interned string of a content, see intern. The trace keeps
+/// the hash of the content instead of the content itself.
+/// \param data The content.
+/// \param size Number of bytes of the content.
+/// \return Pointer to the string structure.
+String *str_intern(const char *data, size_t size) {
+    Arena *arena = enter_arena();
+    String *s = intern(data, size);
+    leave_arena(arena);
+    if (trace_fd != -1 && s != NULL) {
+        trace_begin(STR_TRACE_INTERN);
+        trace_put_id(s);
+        trace_put(size);
+        trace_put(hash_bytes(data, size));
+        trace_end();
+    }
+    return s;
+}
+
+/// Calls visit for every live String cell of the arena, in the order of
+/// the pages and of the cells. The flags are read again after each call,
+/// so the cells that visit frees are not visited.
+/// \param arena The arena.
+/// \param visit The function called for each string.
+/// \param ctx Passed to visit.
+void for_each_live_string(Arena *arena,
+                          void (*visit)(Arena *, String *, void *),
+                          void *ctx) {
+    size_t *handler_handler = (size_t *) arena->handler_handler_string;
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_string = (size_t *) *(handler_handler + i);
+        if (handler_string == NULL) {
+            continue;
+        }
+        size_t cells = *(handler_string + STRING_CELLS);
+        size_t *flags = string_flags(handler_string);
+        String *first = string_cells(handler_string);
+        for (size_t word = 0; word < words_for_bits(cells); word++) {
+            // The bits of the cells not visited yet, indexed 0 at the left.
+            for (size_t bit = 0; bit < 64; bit++) {
+                size_t used = *(flags + word) & ((size_t) -1 >> bit);
+                if (used == 0) {
+                    break;
+                }
+                bit = __builtin_clzl(used);
+                if (word * 64 + bit >= cells) {
+                    // The bits after the last cell are all set.
+                    break;
+                }
+                visit(arena, first + word * 64 + bit, ctx);
+            }
+        }
+    }
+}
+
+/// Gives the content of a rope left by copy_new_data or plan_move a data
+/// area in the new pages, once every other string is there. Without room,
+/// it stays a rope, whose operands are in the new pages.
+/// \param arena The arena being compacted.
+/// \param string The string.
+/// \param ctx Unused.
+void flatten_planned_rope(Arena *arena, String *string, void *ctx) {
+    (void) ctx;
+    if (is_rope(string)) {
+        flatten_rope(arena, string);
+    }
+}
+
+/// Copies the string into a new area of memory.
+/// \param arena The arena being compacted.
+/// \param string The beginning of the string area in memory.
+/// \param word Offset of words
+/// \param bit Offset of bits in last word
+/// \return false if there was no room for a new area, the string then
+/// keeps its old one. The ropes are left for flatten_planned_rope, since
+/// the compaction may still be undone until every string is moved.
+bool copy_new_data(Arena *arena, String *string, size_t word, size_t bit) {
+    size_t index = word * 64 + bit;
+    string += index;
+    char *old_data = string->data;
+    size_t size = string->size;
+    if (size <= STRING_INLINE) {
+        return true;
+    }
+    if (is_rope(string) || is_view(string)) {
+        // The block of a view is moved on its own, and the offset stays
+        // the same.
+        return true;
+    }
+    if (is_large(string)) {
+        // It is alone in its mapping, there is nothing to compact.
+        return true;
+    }
+    size_t old_allocated = string->allocated;
+    string->allocated = size;
+
+    if (!allocate_data(arena, string, true)) {
+        string->allocated = old_allocated;
+        return false;
+    }
+    memcpy(string->data, old_data, size);
+    COUNT(compact_bytes, size);
+    return true;
+}
+
+/// Gives the arena a new header of data pages, with no page yet, so that a
+/// compaction allocates every string again in new pages.
+/// \param arena The arena being compacted.
+/// \return The old header, whose pages still hold the strings, NULL if
+/// there was no page for the new one, the arena is then left as it was.
+void *replace_data_header(Arena *arena) {
+    size_t base_size = os_page_size();
+    size_t *handler_handler_data = map_pages(base_size);
+    if (handler_handler_data == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < base_size / sizeof(size_t); i++) {
+        *(handler_handler_data + i) = (size_t) NULL;
+    }
+    void *old_handler_handler_data = arena->handler_handler_data;
+    arena->handler_handler_data = handler_handler_data;
+    return old_handler_handler_data;
+}
+
+/// Gives back the data pages of a header replaced by a compaction, and the
+/// header itself.
+/// \param arena The arena being compacted.
+/// \param old_handler_handler_data The header from replace_data_header.
+void unmap_old_data_pages(Arena *arena, void *old_handler_handler_data) {
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *old_page =
+                (size_t *) *((size_t *) old_handler_handler_data + i);
+        if (old_page != NULL) {
+            unmap_data_page(arena, old_page);
+        }
+    }
+    unmap_pages(old_handler_handler_data, os_page_size());
+}
+
+/// Undoes the moves of a compaction that found no room for a string: the
+/// strings go back to their areas in the old pages, which are still used
+/// and hold the same content, then the new pages and header are given
+/// back and the old header takes their place.
+/// \param arena The arena being compacted.
+/// \param old_handler_handler_data The header from replace_data_header.
+void restore_data_header(Arena *arena, void *old_handler_handler_data) {
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *old_page =
+                (size_t *) *((size_t *) old_handler_handler_data + i);
+        if (old_page == NULL) {
+            continue;
+        }
+        size_t *area = old_page +
+                       data_metadata_words(*(old_page + DATA_PAGE_SIZE));
+        for (; area_size(area) != 0;
+             area += area_size(area) / sizeof(size_t)) {
+            String *owner = (String *) *(area + 1);
+            if (!(*area & AREA_USED) ||
+                owner->data == (char *) (area + AREA_DATA)) {
+                continue;
+            }
+            if (is_large(owner)) {
+                // Not in the new pages, its mapping goes on its own.
+                handler_data_free(arena, owner->data, owner->allocated,
+                                  owner->handler_data);
+            }
+            owner->allocated = area_size(area) - AREA_DATA * sizeof(size_t);
+            owner->data = (char *) (area + AREA_DATA);
+            owner->handler_data = old_page;
+        }
+    }
+    unmap_old_data_pages(arena, arena->handler_handler_data);
+    arena->handler_handler_data = old_handler_handler_data;
+}
+
+/// Ends the packing of a data page by str_compact_in_place: what is left
+/// after the last string becomes a single free area, or the page is given
+/// back to the system when no string was packed in it.
+/// \param arena The arena that owns the page.
+/// \param index Index of the page in handler_handler_data.
+/// \param end_of_strings Word after the last string packed in the page.
+/// \param last_area The last string packed in the page, NULL if none.
+void close_packed_page(Arena *arena, size_t index, size_t *end_of_strings,
+                       size_t *last_area) {
+    size_t *slot = (size_t *) arena->handler_handler_data + index;
+    size_t *handler_data = (size_t *) *slot;
+    size_t page_size = *(handler_data + DATA_PAGE_SIZE);
+    size_t metadata_words = data_metadata_words(page_size);
+    if (last_area == NULL) {
+        unmap_data_page(arena, handler_data);
+        *slot = (size_t) NULL;
+        return;
+    }
+
+    // The strings that left the page were never freed from it.
+    arena->data_used -= *(handler_data + DATA_LIVE);
+    for (size_t i = DATA_LIVE; i < metadata_words; i++) {
+        *(handler_data + i) = (size_t) NULL;
+    }
+    size_t *end_of_page = handler_data + page_size / sizeof(size_t) - 1;
+    size_t rest = (end_of_page - end_of_strings) * sizeof(size_t);
+    if (rest >= MIN_AREA) {
+        bin_push(handler_data, end_of_strings, rest);
+        *end_of_page = AREA_USED;
+    } else {
+        // Too small to be free on its own, the last string gets it.
+        *last_area += rest;
+        ((String *) *(last_area + 1))->allocated += rest;
+        end_of_strings = end_of_page;
+        *end_of_page = AREA_USED | AREA_PREV_USED;
+    }
+    *(handler_data + DATA_LIVE) =
+            (end_of_strings - (handler_data + metadata_words)) *
+            sizeof(size_t);
+    arena->data_used += *(handler_data + DATA_LIVE);
+}
+
+/// Compacts the used data memory of the arena without any new page: the
+/// strings slide towards the beginning of the pages, in the order of the
+/// pages, and the pages left empty are given back to the system.
+/// \param arena The arena of the calling thread.
+void compact_in_place(Arena *arena) {
+    drain_remote_frees(arena);
+    if (arena->handler_handler_data == NULL) {
+        return;
+    }
+    TIME_START(start);
+    size_t *handler_handler = (size_t *) arena->handler_handler_data;
+
+    // Where the next string goes. It never gets past the string being
+    // moved, since everything before that one is packed by then, so
+    // nothing is overwritten before it is moved.
+    size_t destination_index = HANDLER_PAGES;
+    size_t *destination = NULL;
+    size_t *destination_end = NULL;
+    size_t *last_area = NULL;
+
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + i);
+        if (handler_data == NULL) {
+            continue;
+        }
+        size_t page_size = *(handler_data + DATA_PAGE_SIZE);
+        if (destination == NULL) {
+            destination_index = i;
+            destination = handler_data + data_metadata_words(page_size);
+            destination_end = handler_data + page_size / sizeof(size_t) - 1;
+        }
+
+        // Walks the areas in memory order, the page ends with a header of
+        // size 0.
+        size_t *area = handler_data + data_metadata_words(page_size);
+        while (area_size(area) != 0) {
+            size_t *next = area + area_size(area) / sizeof(size_t);
+            if (*area & AREA_USED) {
+                String *owner = (String *) *(area + 1);
+                size_t needed = area_size_for(owner->size);
+                // The string always fits in its own page, so this never
+                // goes past it.
+                while (destination + needed / sizeof(size_t) >
+                       destination_end) {
+                    close_packed_page(arena, destination_index, destination,
+                                      last_area);
+                    do {
+                        destination_index++;
+                    } while (*(handler_handler + destination_index) == 0);
+                    size_t *page =
+                            (size_t *) *(handler_handler + destination_index);
+                    size_t size = *(page + DATA_PAGE_SIZE);
+                    destination = page + data_metadata_words(size);
+                    destination_end = page + size / sizeof(size_t) - 1;
+                    last_area = NULL;
+                }
+
+                // The data first, the header can be over the old data.
+                memmove(destination + AREA_DATA, area + AREA_DATA,
+                        owner->size);
+                COUNT(compact_bytes, owner->size);
+                *destination = needed | AREA_USED | AREA_PREV_USED;
+                *(destination + 1) = (size_t) owner;
+                owner->data = (char *) (destination + AREA_DATA);
+                owner->allocated = needed - AREA_DATA * sizeof(size_t);
+                owner->handler_data =
+                        (size_t *) *(handler_handler + destination_index);
+                last_area = destination;
+                destination += needed / sizeof(size_t);
+            }
+            area = next;
+        }
+    }
+    if (destination == NULL) {
+        TIME_END(STR_OP_COMPACT, start);
+        return;
+    }
+
+    // Everything after the last destination was moved out.
+    close_packed_page(arena, destination_index, destination, last_area);
+    for (size_t i = destination_index + 1; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + i);
+        if (handler_data != NULL) {
+            unmap_data_page(arena, handler_data);
+            *(handler_handler + i) = (size_t) NULL;
+        }
+    }
+    TIME_END(STR_OP_COMPACT, start);
+}
+
+/// Compacts the used data memory of the arena so that it is de-fragmented.
+/// In persistent mode, the file may not have room for a copy of every
+/// string, and the arena is compacted in place instead. Otherwise, when
+/// there is no room for the copies, the arena is left as it was.
+/// \param arena The arena to compact.
+void str_arena_compact(Arena *arena) {
+    /*
+     * Need to get all the current strings in the first string struct, then
+     * for every string allocate a new data area, copy the data over, and when
+     * it's done, free the old data area and all that was mmap.
+     */
+    if (persist_fd != -1) {
+        compact_in_place(arena);
+        return;
+    }
+    drain_remote_frees(arena);
+    if (arena->handler_handler_string == NULL) {
+        return;
+    }
+    TIME_START(start);
+    void *old_handler_handler_data = replace_data_header(arena);
+    if (old_handler_handler_data == NULL) {
+        TIME_END(STR_OP_COMPACT, start);
+        return;
+    }
+    // Whether a string found no room, the moves are then undone.
+    bool failed = false;
+    size_t *handler_handler_inspector =
+            (size_t *) arena->handler_handler_string;
+    for (size_t i = 0; i < HANDLER_PAGES && !failed; i++) {
+        // Loop through the flags and get the used strings.
+        size_t *handler_string = (size_t *) *handler_handler_inspector;
+        advance_word_size_t(handler_handler_inspector, 1);
+        if (handler_string == NULL) {
+            continue;
+        }
+        size_t number_of_blocks = *(handler_string + STRING_CELLS);
+        size_t word_flags = words_for_bits(number_of_blocks);
+        size_t *handler_string_inspector = string_flags(handler_string);
+        String *beginning_of_strings = string_cells(handler_string);
+
+        bool finished = false;
+        for (size_t word = 0; word < word_flags; word++) {
+            for (size_t bit = 0; bit < sizeof(size_t) * 8; bit++) {
+                if (word * 64 + bit >= number_of_blocks) {
+                    finished = true;
+                    break;
+                }
+                size_t mut_word = *handler_string_inspector;
+                // Goes from left to right, by checking with AND mask.
+                // Ex: 11011111 & 00100000 => index of the shift
+                if ((mut_word &
+                     ((size_t) 1 << (sizeof(size_t) * 8 - bit - 1)))) {
+                    // Do the funny on this
+                    if (!copy_new_data(arena, beginning_of_strings, word,
+                                       bit)) {
+                        failed = true;
+                        finished = true;
+                        break;
+                    }
+                }
+            }
+            if (finished) break;
+            advance_word_size_t(handler_string_inspector, 1);
+        }
+    }
+    if (failed) {
+        restore_data_header(arena, old_handler_handler_data);
+    } else {
+        for_each_live_string(arena, flatten_planned_rope, NULL);
+        unmap_old_data_pages(arena, old_handler_handler_data);
+    }
+    TIME_END(STR_OP_COMPACT, start);
+}
+
+/// Compacts the used data memory so that it is de-fragmented.
+void str_compact(void) {
+    if (trace_fd != -1) {
+        trace_begin(STR_TRACE_COMPACT);
+        trace_put(STR_TRACE_COMPACT_FULL);
+        trace_end();
+    }
+    Arena *arena = enter_arena();
+    str_arena_compact(arena);
+    leave_arena(arena);
+}
+
+// The most threads a parallel compaction copies with.
+#define COMPACT_THREADS 64
+// Below this many bytes per thread, starting one costs more than it saves.
+#define COMPACT_THREAD_BYTES (256 * 1024)
+
+/// A string that got a new data area in a parallel compaction, and where
+/// its content still is.
+typedef struct Move {
+    String *string;
+    char *old_data;
+} Move;
+
+/// The strings a parallel compaction moves, in the order their new areas
+/// were given.
+typedef struct MovePlan {
+    Move *moves;
+    size_t count;
+    size_t capacity;
+    // Sum of the sizes of the strings.
+    size_t bytes;
+    // Whether a string found no room, the moves are then undone.
+    bool failed;
+} MovePlan;
+
+/// The part of the moves that one thread copies.
+typedef struct MoveRange {
+    Move *moves;
+    size_t count;
+} MoveRange;
+
+/// Gives a string its new data area, as copy_new_data does, but only
+/// records the copy for the threads. The ropes are skipped, since their
+/// operands can be among the strings not copied yet.
+/// \param arena The arena being compacted.
+/// \param string The string.
+/// \param ctx The MovePlan.
+void plan_move(Arena *arena, String *string, void *ctx) {
+    MovePlan *plan = ctx;
+    if (plan->failed || string->size <= STRING_INLINE || is_rope(string) ||
+        is_view(string) || is_large(string)) {
+        return;
+    }
+    char *old_data = string->data;
+    size_t old_allocated = string->allocated;
+    string->allocated = string->size;
+    if (!allocate_data(arena, string, true)) {
+        string->allocated = old_allocated;
+        plan->failed = true;
+        return;
+    }
+    if (plan->count == plan->capacity) {
+        // More strings than the arena counted, this one is copied now.
+        memcpy(string->data, old_data, string->size);
+        COUNT(compact_bytes, string->size);
+        return;
+    }
+    plan->moves[plan->count].string = string;
+    plan->moves[plan->count].old_data = old_data;
+    plan->count++;
+    plan->bytes += string->size;
+}
+
+/// Copies the strings of a range to their new areas.
+/// \param arg The MoveRange.
+/// \return NULL.
+void *copy_moves(void *arg) {
+    MoveRange *range = arg;
+    for (size_t i = 0; i < range->count; i++) {
+        Move *move = range->moves + i;
+        memcpy(move->string->data, move->old_data, move->string->size);
+    }
+    return NULL;
+}
+
+/// Copies the moves of a plan with up to `threads` threads, the calling
+/// one included, each taking a run of moves with about the same number of
+/// bytes.
+/// \param plan The moves.
+/// \param threads Number of threads.
+void copy_in_parallel(MovePlan *plan, size_t threads) {
+    if (threads > plan->bytes / COMPACT_THREAD_BYTES) {
+        threads = plan->bytes / COMPACT_THREAD_BYTES;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    MoveRange ranges[COMPACT_THREADS];
+    pthread_t workers[COMPACT_THREADS];
+    bool started[COMPACT_THREADS];
+    size_t next = 0;
+    size_t bytes = 0;
+    for (size_t t = 0; t < threads; t++) {
+        // The run ends when its share of the bytes is reached.
+        size_t end_bytes = plan->bytes / threads * (t + 1);
+        ranges[t].moves = plan->moves + next;
+        while (next < plan->count &&
+               (bytes < end_bytes || t == threads - 1)) {
+            bytes += plan->moves[next].string->size;
+            next++;
+        }
+        ranges[t].count = plan->moves + next - ranges[t].moves;
+    }
+    for (size_t t = 1; t < threads; t++) {
+        started[t] = pthread_create(&workers[t], NULL, copy_moves,
+                                    &ranges[t]) == 0;
+        if (!started[t]) {
+            copy_moves(&ranges[t]);
+        }
+    }
+    copy_moves(&ranges[0]);
+    for (size_t t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
+        }
+    }
+    COUNT(compact_bytes, plan->bytes);
+}
+
+/// Compacts the arena as str_arena_compact does, with the copies spread
+/// over several threads. The new areas are still given one string after
+/// the other by the calling thread, in the same order, since the arena has
+/// a single data page of each size. In persistent mode it is compacted in
+/// place, see str_arena_compact.
+/// \param arena The arena to compact.
+/// \param threads Number of threads, 0 for one per processor.
+void str_arena_compact_parallel(Arena *arena, size_t threads) {
+    if (threads == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = processors > 0 ? processors : 1;
+    }
+    if (threads > COMPACT_THREADS) {
+        threads = COMPACT_THREADS;
+    }
+    if (threads == 1 || persist_fd != -1) {
+        str_arena_compact(arena);
+        return;
+    }
+    drain_remote_frees(arena);
+    if (arena->handler_handler_string == NULL) {
+        return;
+    }
+    TIME_START(start);
+    void *old_handler_handler_data = replace_data_header(arena);
+    if (old_handler_handler_data == NULL) {
+        TIME_END(STR_OP_COMPACT, start);
+        return;
+    }
+    MovePlan plan = {NULL, 0, 0, 0, false};
+    size_t base_size = os_page_size();
+    size_t moves_size =
+            (__atomic_load_n(&arena->live_strings, __ATOMIC_RELAXED) *
+             sizeof(Move) + base_size - 1) / base_size * base_size;
+    if (moves_size != 0) {
+        plan.moves = map_movable_pages(moves_size);
+        if (plan.moves != NULL) {
+            plan.capacity = moves_size / sizeof(Move);
+        }
+    }
+    for_each_live_string(arena, plan_move, &plan);
+    if (plan.failed) {
+        restore_data_header(arena, old_handler_handler_data);
+    } else {
+        copy_in_parallel(&plan, threads);
+        for_each_live_string(arena, flatten_planned_rope, NULL);
+        unmap_old_data_pages(arena, old_handler_handler_data);
+    }
+    if (plan.capacity != 0) {
+        unmap_pages(plan.moves, moves_size);
+    }
+    TIME_END(STR_OP_COMPACT, start);
+}
+
+/// Compacts the used data memory with several threads, see
+/// str_arena_compact_parallel.
+/// \param threads Number of threads, 0 for one per processor.
+void str_compact_parallel(size_t threads) {
+    if (trace_fd != -1) {
+        trace_begin(STR_TRACE_COMPACT);
+        trace_put(STR_TRACE_COMPACT_FULL);
+        trace_end();
+    }
+    Arena *arena = enter_arena();
+    str_arena_compact_parallel(arena, threads);
+    leave_arena(arena);
+}
+
+/// Compacts the used data memory without any new page, see
+/// compact_in_place.
+void str_compact_in_place(void) {
+    if (trace_fd != -1) {
+        trace_begin(STR_TRACE_COMPACT);
+        trace_put(STR_TRACE_COMPACT_IN_PLACE);
+        trace_end();
+    }
+    Arena *arena = enter_arena();
+    compact_in_place(arena);
+    leave_arena(arena);
+}
+
+/// Moves every string of a data page to the other pages of the arena,
+/// without mapping new pages, and unmaps the page if it ends up empty.
+/// \param arena The arena that owns the page.
+/// \param index Index of the page in handler_handler_data.
+/// \return The number of bytes of strings that were moved.
+size_t evacuate_data_page(Arena *arena, size_t index) {
+    size_t *slot = (size_t *) arena->handler_handler_data + index;
+    size_t *handler_data = (size_t *) *slot;
+    size_t page_size = *(handler_data + DATA_PAGE_SIZE);
+    size_t moved = 0;
+    // So that none of the strings are moved to the page itself.
+    *(handler_data + DATA_EVACUATING) = true;
+
+    // Walks the areas in memory order, the page ends with a header of
+    // size 0.
+    size_t *area = handler_data + data_metadata_words(page_size);
+    while (area_size(area) != 0 && *(handler_data + DATA_LIVE) != 0) {
+        // Freeing a used area merges it with the next one if it is free,
+        // but that header stays as it was, so it still leads to the area
+        // after it.
+        size_t *next = area + area_size(area) / sizeof(size_t);
+        if (*area & AREA_USED) {
+            String *owner = (String *) *(area + 1);
+            char *old_data = owner->data;
+            size_t old_allocated = owner->allocated;
+            owner->allocated = owner->size;
+            if (!allocate_data(arena, owner, false)) {
+                // The other pages are full, the rest stays here.
+                owner->allocated = old_allocated;
+                break;
+            }
+            memcpy(owner->data, old_data, owner->size);
+            COUNT(compact_bytes, owner->size);
+            handler_data_free(arena, old_data, old_allocated,
+                              handler_data);
+            moved += owner->size;
+        }
+        area = next;
+    }
+
+    *(handler_data + DATA_EVACUATING) = false;
+    if (*(handler_data + DATA_LIVE) == 0) {
+        unmap_data_page(arena, handler_data);
+        *slot = (size_t) NULL;
+    }
+    return moved;
+}
+
+// Occupancy of a data page under which str_compact_partial empties it.
+double compact_threshold = 0.5;
+
+/// Sets the occupancy under which str_compact_partial empties a data page.
+/// \param occupancy Fraction of the page used by strings, from 0 to 1.
+void str_compact_threshold(double occupancy) {
+    compact_threshold = occupancy;
+}
+
+/// Occupancy of a data page.
+/// \param handler_data The data page.
+/// \return The fraction of the page used by strings, from 0 to 1.
+double data_page_occupancy(const size_t *handler_data) {
+    return (double) *(handler_data + DATA_LIVE) /
+           (double) data_page_capacity(*(handler_data + DATA_PAGE_SIZE));
+}
+
+/// Finds the data pages whose occupancy is under the threshold, sorted
+/// sparsest first, since they give back the most memory for each byte
+/// moved.
+/// \param arena The arena, which has a header of data pages.
+/// \param candidates Where the indexes of the pages go.
+/// \return The number of pages found.
+size_t sparse_data_pages(Arena *arena, size_t *candidates) {
+    size_t *handler_handler = (size_t *) arena->handler_handler_data;
+    size_t number_of_candidates = 0;
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + i);
+        if (handler_data == NULL ||
+            data_page_occupancy(handler_data) >= compact_threshold) {
+            continue;
+        }
+        size_t j = number_of_candidates++;
+        while (j > 0 && data_page_occupancy(
+                (size_t *) *(handler_handler + candidates[j - 1])) >
+                        data_page_occupancy(handler_data)) {
+            candidates[j] = candidates[j - 1];
+            j--;
+        }
+        candidates[j] = i;
+    }
+    return number_of_candidates;
+}
+
+/// Sums the sizes of the strings of a data page, the bytes that
+/// evacuate_data_page would move. DATA_LIVE also counts the headers and
+/// the padding of the areas.
+/// \param handler_data The data page.
+/// \return The number of bytes of strings in the page.
+size_t data_page_string_bytes(size_t *handler_data) {
+    size_t bytes = 0;
+    size_t *area = handler_data +
+                   data_metadata_words(*(handler_data + DATA_PAGE_SIZE));
+    while (area_size(area) != 0) {
+        if (*area & AREA_USED) {
+            bytes += ((String *) *(area + 1))->size;
+        }
+        area += area_size(area) / sizeof(size_t);
+    }
+    return bytes;
+}
+
+/// Compacts only the data pages of the arena whose occupancy is under the
+/// threshold, see str_compact_partial.
+/// \param arena The arena of the calling thread.
+/// \param max_bytes_moved Maximum number of bytes of strings to move.
+/// \return The number of bytes of strings that were moved.
+size_t compact_partial(Arena *arena, size_t max_bytes_moved) {
+    drain_remote_frees(arena);
+    if (arena->handler_handler_data == NULL) {
+        return 0;
+    }
+    TIME_START(start);
+    size_t *handler_handler = (size_t *) arena->handler_handler_data;
+    size_t candidates[HANDLER_PAGES];
+    size_t number_of_candidates = sparse_data_pages(arena, candidates);
+
+    size_t moved = 0;
+    for (size_t i = 0; i < number_of_candidates; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + candidates[i]);
+        // The strings moved so far may have filled it up. The page is
+        // only walked when its live size, an upper bound of its string
+        // bytes, is over the budget.
+        if (data_page_occupancy(handler_data) >= compact_threshold ||
+            (*(handler_data + DATA_LIVE) > max_bytes_moved - moved &&
+             data_page_string_bytes(handler_data) >
+                     max_bytes_moved - moved)) {
+            continue;
+        }
+        moved += evacuate_data_page(arena, candidates[i]);
+    }
+    TIME_END(STR_OP_COMPACT, start);
+    return moved;
+}
+
+/// Compacts only the data pages whose occupancy is under the threshold,
+/// sparsest first, as long as their strings fit in the byte budget. Unlike
+/// str_compact, the cost only depends on the pages that are emptied.
+/// \param max_bytes_moved Maximum number of bytes of strings to move.
+/// \return The number of bytes of strings that were moved.
+size_t str_compact_partial(size_t max_bytes_moved) {
+    if (trace_fd != -1) {
+        trace_begin(STR_TRACE_COMPACT);
+        trace_put(STR_TRACE_COMPACT_PARTIAL);
+        trace_put(max_bytes_moved);
+        trace_end();
+    }
+    Arena *arena = enter_arena();
+    size_t moved = compact_partial(arena, max_bytes_moved);
+    leave_arena(arena);
+    return moved;
+}
+
+/*
+ * Background compaction. A thread empties the sparse data pages of the
+ * arenas of the threads, as str_compact_partial does, while their owners
+ * keep allocating: they hold the lock of their arena for each operation,
+ * see enter_arena, and the thread takes it to move at most
+ * BACKGROUND_STEP_BYTES at a time. The owners can't allocate in a page
+ * being evacuated, they can only free its strings. The pinned strings
+ * are left where they are, and their page for the next pass.
+ */
+
+// Most bytes of strings the background compaction moves while it holds
+// the lock of an arena.
+#define BACKGROUND_STEP_BYTES (64 * 1024)
+
+// The thread of the background compaction, and how it is told to stop.
+pthread_t background_thread;
+pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t background_wakeup = PTHREAD_COND_INITIALIZER;
+bool background_stopping = false;
+unsigned background_interval_ms;
+
+/// Slot of a string in the table of pins of its arena, or the empty slot
+/// where it would go.
+/// \param arena The arena, which has a table of pins.
+/// \param str The string.
+/// \return Index of the slot.
+size_t pin_slot(Arena *arena, const String *str) {
+    size_t mask = arena->pins_capacity - 1;
+    size_t slot = ((size_t) str / sizeof(String) * 0x9e3779b97f4a7c15ULL >>
+                   32) & mask;
+    while (arena->pins[slot].str != NULL && arena->pins[slot].str != str) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/// Maps a table of pins twice as big, or the first one, and puts the pins
+/// of the old one in it. It is not counted in the used size, like the
+/// other memory that is not for the strings.
+/// \param arena The arena that owns the table.
+/// \return false if there were no pages left, the old table is then kept.
+bool grow_pins(Arena *arena) {
+    Pin *old = arena->pins;
+    size_t old_capacity = arena->pins_capacity;
+    size_t capacity = old == NULL ?
+            os_page_size() / sizeof(Pin) : old_capacity * 2;
+    // Zeroed pages, every slot is empty.
+    Pin *table = map_movable_pages(capacity * sizeof(Pin));
+    if (table == NULL) {
+        return false;
+    }
+    arena->pins = table;
+    arena->pins_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].str != NULL) {
+            arena->pins[pin_slot(arena, old[i].str)] = old[i];
+        }
+    }
+    if (old != NULL) {
+        unmap_pages(old, old_capacity * sizeof(Pin));
+    }
+    return true;
+}
+
+/// Tells if a string is pinned, with the lock of its arena.
+/// \param arena The arena of the string.
+/// \param str The string.
+/// \return true if str_pin was called more times than str_unpin.
+bool is_pinned(Arena *arena, const String *str) {
+    return arena->pins_count != 0 &&
+           arena->pins[pin_slot(arena, str)].str == str;
+}
+
+/// Keeps the data of a string where it is, see stralloc.h. A rope or a
+/// view first gets a data area of its own, which is what stays put.
+/// \param str The string.
+/// \return false if there was no room for that data area, the string is
+/// then not pinned.
+bool str_pin(String *str) {
+    // The cell never moves, but the compaction thread can be moving the
+    // data, so the string is only looked at with the lock.
+    Arena *arena = (Arena *) *(str->handler_string + STRING_ARENA);
+    pthread_mutex_lock(&arena->lock);
+    if (is_rope(str) || is_view(str)) {
+        // str_data takes the lock itself. Only the calling thread makes
+        // ropes and views of its strings, so it stays flattened.
+        pthread_mutex_unlock(&arena->lock);
+        if (str_data(str) == NULL) {
+            return false;
+        }
+        pthread_mutex_lock(&arena->lock);
+    }
+    // At most three quarters full, so the probes stay short. Without
+    // pages left, fuller, but always with an empty slot to end the probes.
+    if ((arena->pins_count + 1) * 4 > arena->pins_capacity * 3 &&
+        !grow_pins(arena) &&
+        arena->pins_count + 1 >= arena->pins_capacity) {
+        pthread_mutex_unlock(&arena->lock);
+        return false;
+    }
+    size_t slot = pin_slot(arena, str);
+    if (arena->pins[slot].str == NULL) {
+        arena->pins[slot].str = str;
+        arena->pins[slot].count = 0;
+        // Read without the lock by make_view.
+        __atomic_fetch_add(&arena->pins_count, 1, __ATOMIC_RELAXED);
+    }
+    arena->pins[slot].count++;
+    pthread_mutex_unlock(&arena->lock);
+    return true;
+}
+
+/// Undoes a str_pin. The string is taken out of the table at the last
+/// one, and the strings after it that were pushed past their slot are
+/// shifted back, as in unintern.
+/// \param str The string.
+void str_unpin(String *str) {
+    Arena *arena = (Arena *) *(str->handler_string + STRING_ARENA);
+    pthread_mutex_lock(&arena->lock);
+    size_t hole = arena->pins_count != 0 ? pin_slot(arena, str) : 0;
+    if (arena->pins_count == 0 || arena->pins[hole].str != str ||
+        --arena->pins[hole].count != 0) {
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+    size_t mask = arena->pins_capacity - 1;
+    for (size_t i = (hole + 1) & mask; arena->pins[i].str != NULL;
+         i = (i + 1) & mask) {
+        size_t home = ((size_t) arena->pins[i].str / sizeof(String) *
+                       0x9e3779b97f4a7c15ULL >> 32) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            arena->pins[hole] = arena->pins[i];
+            hole = i;
+        }
+    }
+    arena->pins[hole].str = NULL;
+    __atomic_fetch_sub(&arena->pins_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/// Moves the data of a string out of a page evacuated in the background.
+/// The new area is filled before the string points to it, then the
+/// pointer is swapped at once, so a reader sees either copy whole.
+/// \param arena The arena, whose lock is held.
+/// \param owner The string.
+/// \param size Its size, read once by the caller, see
+/// evacuate_in_background.
+/// \param handler_data The page being evacuated.
+/// \return false if no other page has room for it.
+bool relocate_string(Arena *arena, String *owner, size_t size,
+                     size_t *handler_data) {
+    String moved = *owner;
+    moved.allocated = size;
+    if (!allocate_data(arena, &moved, false)) {
+        return false;
+    }
+    // The area was given to the copy.
+    *((size_t *) moved.data - AREA_DATA + 1) = (size_t) owner;
+    memcpy(moved.data, owner->data, size);
+    COUNT(compact_bytes, size);
+    size_t old_allocated = owner->allocated;
+    owner->allocated = moved.allocated;
+    owner->handler_data = moved.handler_data;
+    char *old_data = __atomic_exchange_n(&owner->data, moved.data,
+                                         __ATOMIC_RELEASE);
+    handler_data_free(arena, old_data, old_allocated, handler_data);
+    return true;
+}
+
+/// Tells if the data pages after a page have room for its strings. The
+/// owner can't allocate in a page being evacuated either, so without that
+/// room both would map a new page.
+/// \param arena The arena.
+/// \param index Index of the page in handler_handler_data.
+/// \return true if the free bytes of the next pages are at least twice its
+/// live size, for the fragmentation of both.
+bool has_room_above(Arena *arena, size_t index) {
+    size_t *handler_handler = arena->handler_handler_data;
+    size_t live = *((size_t *) *(handler_handler + index) + DATA_LIVE);
+    size_t room = 0;
+    for (size_t i = index + 1; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + i);
+        if (handler_data != NULL && !*(handler_data + DATA_EVACUATING)) {
+            room += data_page_capacity(*(handler_data + DATA_PAGE_SIZE)) -
+                    *(handler_data + DATA_LIVE);
+        }
+    }
+    return room >= live * 2;
+}
+
+/// Moves the strings of a data page to the other pages of the arena, in
+/// steps of BACKGROUND_STEP_BYTES, letting go of the lock between them.
+/// Between two steps the owner can only free strings of the page, which
+/// lowers its live size. The headers of the areas it freed can be stale,
+/// so when the live size changed the next step starts over from the
+/// beginning of the page, where the areas already moved are free. Other
+/// threads can free strings of the page at any time, without the lock:
+/// each step first frees the ones given back so far, and a string given
+/// back during the step is left where it is.
+/// \param arena The arena.
+/// \param index Index of the page in handler_handler_data.
+void evacuate_in_background(Arena *arena, size_t index) {
+    size_t *handler_handler = NULL;
+    size_t *handler_data = NULL;
+    size_t *area = NULL;
+    size_t live = 0;
+    for (;;) {
+        pthread_mutex_lock(&arena->lock);
+        drain_remote_frees(arena);
+        if (handler_data == NULL) {
+            handler_handler = arena->handler_handler_data;
+            handler_data = (size_t *) *(handler_handler + index);
+            if (handler_data == NULL ||
+                data_page_occupancy(handler_data) >= compact_threshold ||
+                *(handler_data + DATA_EVACUATING) ||
+                !has_room_above(arena, index)) {
+                pthread_mutex_unlock(&arena->lock);
+                return;
+            }
+            *(handler_data + DATA_EVACUATING) = true;
+            area = NULL;
+        } else if (arena->handler_handler_data != handler_handler ||
+                   (size_t *) *(handler_handler + index) != handler_data ||
+                   !*(handler_data + DATA_EVACUATING)) {
+            // A compaction of the owner replaced or rebuilt the page.
+            pthread_mutex_unlock(&arena->lock);
+            return;
+        } else if (*(handler_data + DATA_LIVE) != live) {
+            area = NULL;
+        }
+        if (area == NULL) {
+            area = handler_data +
+                   data_metadata_words(*(handler_data + DATA_PAGE_SIZE));
+        }
+
+        size_t moved = 0;
+        bool full = false;
+        while (area_size(area) != 0 && *(handler_data + DATA_LIVE) != 0 &&
+               moved < BACKGROUND_STEP_BYTES) {
+            size_t *next = area + area_size(area) / sizeof(size_t);
+            if (*area & AREA_USED) {
+                String *owner = (String *) *(area + 1);
+                // Once pushed on remote_free, the size is a pointer or NULL,
+                // which no string with an area can have.
+                size_t size = __atomic_load_n(&owner->size, __ATOMIC_RELAXED);
+                if (size > STRING_INLINE && size <= owner->allocated &&
+                    !is_pinned(arena, owner)) {
+                    if (!relocate_string(arena, owner, size, handler_data)) {
+                        full = true;
+                        break;
+                    }
+                    moved += size;
+                }
+            }
+            area = next;
+        }
+
+        bool done = full || area_size(area) == 0 ||
+                    *(handler_data + DATA_LIVE) == 0 ||
+                    __atomic_load_n(&background_stopping, __ATOMIC_RELAXED);
+        if (done) {
+            *(handler_data + DATA_EVACUATING) = false;
+            if (*(handler_data + DATA_LIVE) == 0) {
+                unmap_data_page(arena, handler_data);
+                *(handler_handler + index) = (size_t) NULL;
+            }
+        } else {
+            live = *(handler_data + DATA_LIVE);
+        }
+        pthread_mutex_unlock(&arena->lock);
+        if (done) {
+            return;
+        }
+        // So that the owner gets the lock between two steps.
+        sched_yield();
+    }
+}
+
+/// Evacuates the sparse pages of an arena that the background compaction
+/// may touch.
+/// \param arena The arena.
+void compact_in_background(Arena *arena) {
+    size_t candidates[HANDLER_PAGES];
+    size_t number_of_candidates = 0;
+    pthread_mutex_lock(&arena->lock);
+    if (arena->handler_handler_data != NULL) {
+        number_of_candidates = sparse_data_pages(arena, candidates);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    for (size_t i = 0; i < number_of_candidates &&
+                       !__atomic_load_n(&background_stopping,
+                                        __ATOMIC_RELAXED); i++) {
+        evacuate_in_background(arena, candidates[i]);
+    }
+}
+
+/// The thread of the background compaction: a pass over the arenas of the
+/// threads that lock, then a wait of background_interval_ms.
+/// \param unused Unused.
+/// \return NULL.
+void *background_main(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&background_lock);
+    while (!background_stopping) {
+        pthread_mutex_unlock(&background_lock);
+        Arena *arena = &main_arena;
+        while (arena != NULL) {
+            if (__atomic_load_n(&arena->locking, __ATOMIC_ACQUIRE)) {
+                compact_in_background(arena);
+            }
+            pthread_mutex_lock(&page_lock);
+            arena = arena->next;
+            pthread_mutex_unlock(&page_lock);
+        }
+        pthread_mutex_lock(&background_lock);
+        if (!background_stopping) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += background_interval_ms / 1000;
+            until.tv_nsec += background_interval_ms % 1000 * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&background_wakeup, &background_lock,
+                                   &until);
+        }
+    }
+    pthread_mutex_unlock(&background_lock);
+    return NULL;
+}
+
+/// Starts the thread of the background compaction.
+/// \param interval_ms Time between two passes, in milliseconds.
+/// \return false if it already runs or the thread can't be created.
+bool str_compact_background_start(unsigned interval_ms) {
+    if (background_running) {
+        return false;
+    }
+    background_stopping = false;
+    background_interval_ms = interval_ms;
+    __atomic_store_n(&background_running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&background_thread, NULL, background_main, NULL) !=
+        0) {
+        __atomic_store_n(&background_running, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+/// Stops the thread of the background compaction, once its current step
+/// is over. The arenas stop locking at the next operation of their owner.
+void str_compact_background_stop(void) {
+    if (!background_running) {
+        return;
+    }
+    pthread_mutex_lock(&background_lock);
+    __atomic_store_n(&background_stopping, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&background_wakeup);
+    pthread_mutex_unlock(&background_lock);
+    pthread_join(background_thread, NULL);
+    __atomic_store_n(&background_running, false, __ATOMIC_RELEASE);
+}
+
+/// Returns the amount of memory used by the strings of the arena.
+/// \param arena The arena.
+size_t str_arena_livesize(Arena *arena) {
+    return __atomic_load_n(&arena->live_size, __ATOMIC_RELAXED);
+}
+
+/// Returns the amount of memory used by the strings.
+size_t str_livesize(void) {
+    return str_arena_livesize(current_arena());
+}
+
+/// Returns the amount of 'free' memory available in the arena.
+/// \param arena The arena.
+/// \return Total amount of free memory in bytes.
+size_t str_arena_freesize(Arena *arena) {
+    drain_remote_frees(arena);
+    return arena->data_capacity - arena->data_used;
+}
+
+/// Returns the amount of 'free' memory available.
+/// \return Total amount of free memory in bytes.
+size_t str_freesize(void) {
+    Arena *arena = enter_arena();
+    size_t size = str_arena_freesize(arena);
+    leave_arena(arena);
+    return size;
+}
+
+/// Returns the amount of memory the arena got from the system.
+/// \param arena The arena.
+/// \return Total amount of used memory in bytes.
+size_t str_arena_usedsize(Arena *arena) {
+    return arena->used_size;
 }
 
 /// Returns the total amount of memory used by stralloc.h.
 /// \return Total amount of used memory in bytes.
 size_t str_usedsize(void) {
-    size_t base_size = sysconf(_SC_PAGESIZE);
+    Arena *arena = enter_arena();
+    size_t size = str_arena_usedsize(arena);
+    leave_arena(arena);
+    return size;
+}
 
-    // Both headers
-    size_t used_size = base_size * 2;
+/// Returns the size of the biggest free area of the arena, which is what a
+/// long-running process can still allocate without new pages or a
+/// compaction.
+/// \param arena The arena.
+/// \return Size in bytes of the largest free area, 0 if there is none.
+size_t str_arena_largestfree(Arena *arena) {
+    drain_remote_frees(arena);
+    size_t *data_block_inspector = (size_t *) arena->handler_handler_data;
+    size_t largest = 0;
+    if (data_block_inspector == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *data_block_inspector;
+        advance_word_size_t(data_block_inspector, 1);
+        if (handler_data == NULL || *(handler_data + DATA_BITMAP) == 0) {
+            continue;
+        }
+        // Only the highest non-empty bin can hold the largest area.
+        size_t bin = log2_floor(*(handler_data + DATA_BITMAP));
+        size_t *data_free_inspector =
+                (size_t *) *(handler_data + DATA_BINS + bin);
+        while (data_free_inspector != NULL) {
+            if (area_size(data_free_inspector) > largest) {
+                largest = area_size(data_free_inspector);
+            }
+            data_free_inspector = (size_t *) *(data_free_inspector + 1);
+        }
+    }
+    return largest;
+}
 
-    for (size_t i = 0; i < 2; i++) {
-        size_t *block_inspector;
-        size_t index = 0;
-        if (i == 0) {
-            block_inspector = (size_t *) handler_handler_string;
-        } else {
-            block_inspector = (size_t *) handler_handler_data;
+/// Returns the size of the biggest free area, which is what a long-running
+/// process can still allocate without new pages or a compaction.
+/// \return Size in bytes of the largest free area, 0 if there is none.
+size_t str_largestfree(void) {
+    Arena *arena = enter_arena();
+    size_t size = str_arena_largestfree(arena);
+    leave_arena(arena);
+    return size;
+}
+
+/// Returns all the counters of the arena at once.
+/// \param arena The arena.
+/// \return The counters, and the largest free area.
+StrStats str_arena_stats(Arena *arena) {
+    StrStats stats;
+    // Also drains the remote frees.
+    stats.largestfree = str_arena_largestfree(arena);
+    stats.livesize = __atomic_load_n(&arena->live_size, __ATOMIC_RELAXED);
+    stats.freesize = arena->data_capacity - arena->data_used;
+    stats.usedsize = arena->used_size;
+    stats.strings =
+            __atomic_load_n(&arena->live_strings, __ATOMIC_RELAXED);
+    stats.pages = arena->mapped_pages;
+    return stats;
+}
+
+/// Returns all the counters of the arena of the calling thread at once.
+/// \return The counters, and the largest free area.
+StrStats str_stats(void) {
+    Arena *arena = enter_arena();
+    StrStats stats = str_arena_stats(arena);
+    leave_arena(arena);
+    return stats;
+}
+
+/// Creates an arena of its own, whose strings are only allocated by
+/// str_arena_alloc and str_arena_concat. It is not in the list of the
+/// arenas of the threads, so no thread ever takes it over.
+/// \return The arena, without any page until its first allocation.
+Arena *str_arena_create(void) {
+    // All zeros, the headers are created on the first allocation.
+    Arena *arena = map_movable_pages(sizeof(Arena));
+    if (arena != NULL) {
+        arena->untraced = true;
+    }
+    return arena;
+}
+
+/// Unmaps the large strings of an arena.
+/// \param arena The arena.
+void unmap_large(Arena *arena) {
+    size_t *mapping = arena->large;
+    while (mapping != NULL) {
+        size_t *next = (size_t *) *mapping;
+        size_t size = area_size(mapping + LARGE_LINKS) +
+                      LARGE_LINKS * sizeof(size_t);
+        arena->used_size -= size;
+        arena->mapped_pages--;
+        unmap_pages(mapping, size);
+        mapping = next;
+    }
+    arena->large = NULL;
+}
+
+/// Unmaps the table of pinned strings of an arena, if it has one.
+/// \param arena The arena.
+void unmap_pins(Arena *arena) {
+    if (arena->pins == NULL) {
+        return;
+    }
+    unmap_pages(arena->pins, arena->pins_capacity * sizeof(Pin));
+    arena->pins = NULL;
+    arena->pins_capacity = 0;
+    arena->pins_count = 0;
+}
+
+/// Unmaps the table of interned strings of an arena, if it has one.
+/// \param arena The arena.
+void unmap_interned(Arena *arena) {
+    if (arena->interned == NULL) {
+        return;
+    }
+    arena->used_size -= arena->interned_capacity * sizeof(String *);
+    arena->mapped_pages--;
+    unmap_pages(arena->interned, arena->interned_capacity * sizeof(String *));
+    arena->interned = NULL;
+    arena->interned_capacity = 0;
+    arena->interned_count = 0;
+}
+
+/// Frees every string of the arena at once, without looking at them: the
+/// pages are initialized again and kept for the next allocations, and
+/// only the large strings and the table of interned strings are given
+/// back to the system.
+/// \param arena The arena.
+void str_arena_reset(Arena *arena) {
+    __atomic_store_n(&arena->remote_free, NULL, __ATOMIC_RELAXED);
+    unmap_large(arena);
+    unmap_interned(arena);
+    unmap_pins(arena);
+    arena->live_size = 0;
+    arena->live_strings = 0;
+    arena->data_used = 0;
+    arena->freed_since_release = 0;
+    if (arena->handler_handler_string == NULL) {
+        return;
+    }
+
+    size_t *handler_handler = (size_t *) arena->handler_handler_string;
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_string = (size_t *) *(handler_handler + i);
+        if (handler_string != NULL) {
+            initialize_handler_string(page_size_at(i), handler_string, i,
+                                      arena);
+        }
+        set_page_nonfull(handler_handler, i, handler_string != NULL);
+    }
+    *(handler_handler + STRING_LAST_PAGE) = 0;
+
+    handler_handler = (size_t *) arena->handler_handler_data;
+    for (size_t i = 0; i < HANDLER_PAGES; i++) {
+        size_t *handler_data = (size_t *) *(handler_handler + i);
+        if (handler_data != NULL) {
+            initialize_handler_data(*(handler_data + DATA_PAGE_SIZE),
+                                    handler_data);
+        }
+    }
+}
+
+/// Gives every page of an arena back to the system, along with the arena
+/// itself. Its strings must not be used anymore, not even freed.
+/// \param arena The arena, created by str_arena_create.
+void str_arena_destroy(Arena *arena) {
+    unmap_large(arena);
+    unmap_interned(arena);
+    unmap_pins(arena);
+    if (arena->handler_handler_string != NULL) {
+        size_t *handler_handler = (size_t *) arena->handler_handler_string;
+        for (size_t i = 0; i < HANDLER_PAGES; i++) {
+            size_t *handler_string = (size_t *) *(handler_handler + i);
+            if (handler_string != NULL) {
+                unmap_pages(handler_string, page_size_at(i));
+            }
+        }
+        handler_handler = (size_t *) arena->handler_handler_data;
+        for (size_t i = 0; i < HANDLER_PAGES; i++) {
+            size_t *handler_data = (size_t *) *(handler_handler + i);
+            if (handler_data != NULL) {
+                unmap_data_page(arena, handler_data);
+            }
+        }
+        unmap_pages(arena->handler_handler_string, os_page_size());
+        unmap_pages(arena->handler_handler_data, os_page_size());
+    }
+    unmap_pages(arena, sizeof(Arena));
+}
+
+/// Copies the counters of the instrumentation.
+/// \param out Where they go, all zeros without the instrumentation.
+/// \return false if the instrumentation is not compiled.
+bool str_instrument(StrInstrument *out) {
+#ifdef STR_INSTRUMENT
+    // Relaxed counters, a snapshot taken while other threads allocate is
+    // only approximate.
+    memcpy(out, &instrument, sizeof(StrInstrument));
+    return true;
+#else
+    memset(out, 0, sizeof(StrInstrument));
+    return false;
+#endif
+}
+
+/// Sets the counters of the instrumentation back to zero.
+void str_instrument_reset(void) {
+#ifdef STR_INSTRUMENT
+    memset(&instrument, 0, sizeof(StrInstrument));
+#endif
+}
+
+/// Writes the counters of the calling thread's arena and those of the
+/// instrumentation, as key=value lines.
+/// \param f The file to write to.
+void str_stats_dump(FILE *f) {
+    static const char *const op_names[STR_OPS] = {
+            "alloc", "free", "concat", "resize", "compact"
+    };
+    StrStats stats = str_stats();
+    fprintf(f, "stats live=%zu free=%zu used=%zu largestfree=%zu "
+               "strings=%zu pages=%zu\n", stats.livesize, stats.freesize,
+            stats.usedsize, stats.largestfree, stats.strings, stats.pages);
+    StrInstrument counters;
+    if (!str_instrument(&counters)) {
+        fprintf(f, "instrument enabled=0\n");
+        return;
+    }
+    fprintf(f, "instrument enabled=1 freelist_nodes=%zu "
+               "data_pages_probed=%zu string_pages_probed=%zu "
+               "flag_words_scanned=%zu mmaps=%zu munmaps=%zu mremaps=%zu "
+               "madvises=%zu reserved=%zu compact_bytes=%zu "
+               "concat_bytes=%zu released_bytes=%zu\n",
+            counters.freelist_nodes, counters.data_pages_probed,
+            counters.string_pages_probed, counters.flag_words_scanned,
+            counters.mmaps, counters.munmaps, counters.mremaps,
+            counters.madvises, counters.reserved, counters.compact_bytes,
+            counters.concat_bytes, counters.released_bytes);
+    for (int op = 0; op < STR_OPS; op++) {
+        fprintf(f, "calls op=%s count=%zu\n", op_names[op],
+                counters.calls[op]);
+        for (int bucket = 0; bucket < STR_LATENCY_BUCKETS; bucket++) {
+            if (counters.latency[op][bucket] != 0) {
+                fprintf(f, "latency op=%s min_ns=%zu count=%zu\n",
+                        op_names[op], (size_t) 1 << bucket,
+                        counters.latency[op][bucket]);
+            }
+        }
+    }
+}
+
+/// Calls the walker for every String cell, every area of the data pages
+/// and every large mapping of an arena, in the order of the pages and of
+/// the addresses in each page.
+/// \param arena The arena.
+/// \param walker The function called for each block.
+/// \param ctx Passed to the walker.
+void str_arena_heap_walk(Arena *arena, StrHeapWalker walker, void *ctx) {
+    drain_remote_frees(arena);
+    StrBlock block;
+    if (arena->handler_handler_string != NULL) {
+        size_t *handler_handler = (size_t *) arena->handler_handler_string;
+        block.kind = STR_BLOCK_CELL;
+        block.size = sizeof(String);
+        for (size_t i = 0; i < HANDLER_PAGES; i++) {
+            size_t *handler_string = (size_t *) *(handler_handler + i);
+            if (handler_string == NULL) {
+                continue;
+            }
+            block.page = handler_string;
+            block.page_index = i;
+            block.page_size = page_size_at(i);
+            size_t cells = *(handler_string + STRING_CELLS);
+            size_t *flags = string_flags(handler_string);
+            String *first = string_cells(handler_string);
+            for (size_t cell = 0; cell < cells; cell++) {
+                block.used = *(flags + cell / 64) & left_bit(cell % 64);
+                block.address = first + cell;
+                block.owner = block.used ? first + cell : NULL;
+                walker(&block, ctx);
+            }
+        }
+
+        handler_handler = (size_t *) arena->handler_handler_data;
+        block.kind = STR_BLOCK_AREA;
+        for (size_t i = 0; i < HANDLER_PAGES; i++) {
+            size_t *handler_data = (size_t *) *(handler_handler + i);
+            if (handler_data == NULL) {
+                continue;
+            }
+            size_t page_size = *(handler_data + DATA_PAGE_SIZE);
+            block.page = handler_data;
+            block.page_index = i;
+            block.page_size = page_size;
+            size_t *area = handler_data + data_metadata_words(page_size);
+            // The last word is the used header of size 0 closing the page.
+            size_t *end = handler_data + page_size / sizeof(size_t) - 1;
+            while (area < end) {
+                block.used = *area & AREA_USED;
+                block.address = area;
+                block.size = area_size(area);
+                block.owner = block.used ? (String *) *(area + 1) : NULL;
+                walker(&block, ctx);
+                area += block.size / sizeof(size_t);
+            }
+        }
+    }
+
+    block.kind = STR_BLOCK_LARGE;
+    block.used = true;
+    block.page_index = HANDLER_PAGES;
+    for (size_t *mapping = arena->large; mapping != NULL;
+         mapping = (size_t *) *mapping) {
+        size_t *area = mapping + LARGE_LINKS;
+        block.page = mapping;
+        block.page_size = area_size(area) + LARGE_LINKS * sizeof(size_t);
+        block.address = area;
+        block.size = area_size(area);
+        block.owner = (String *) *(area + 1);
+        walker(&block, ctx);
+    }
+}
+
+/// Calls the walker for every block of the calling thread's arena, see
+/// str_arena_heap_walk.
+/// \param walker The function called for each block.
+/// \param ctx Passed to the walker.
+void str_heap_walk(StrHeapWalker walker, void *ctx) {
+    Arena *arena = enter_arena();
+    str_arena_heap_walk(arena, walker, ctx);
+    leave_arena(arena);
+}
+
+// What the map of the heap keeps for each page, or for all the large
+// mappings together.
+typedef struct PageMap {
+    const void *page;
+    size_t page_size;
+    size_t used_blocks;
+    size_t used_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free;
+} PageMap;
+
+// The pages of both kinds, the large mappings, then the free areas by
+// bin, for the walker of str_heap_map.
+typedef struct HeapMap {
+    PageMap pages[2][HANDLER_PAGES];
+    PageMap large;
+    PageMap bins[SIZE_CLASSES];
+} HeapMap;
+
+/// Adds a block to the map of its page, and to its bin if it is a free
+/// area.
+/// \param block The block.
+/// \param ctx The HeapMap.
+void map_block(const StrBlock *block, void *ctx) {
+    HeapMap *map = ctx;
+    PageMap *page = block->kind == STR_BLOCK_LARGE ? &map->large :
+                    &map->pages[block->kind][block->page_index];
+    if (block->kind == STR_BLOCK_LARGE) {
+        page->page_size += block->page_size;
+    } else {
+        page->page = block->page;
+        page->page_size = block->page_size;
+    }
+    if (block->used) {
+        page->used_blocks++;
+        page->used_bytes += block->size;
+        return;
+    }
+    page->free_blocks++;
+    page->free_bytes += block->size;
+    if (block->size > page->largest_free) {
+        page->largest_free = block->size;
+    }
+    if (block->kind == STR_BLOCK_AREA) {
+        PageMap *bin = &map->bins[bin_of(block->size)];
+        bin->page_size = MIN_AREA << bin_of(block->size);
+        bin->free_blocks++;
+        bin->free_bytes += block->size;
+        if (block->size > bin->largest_free) {
+            bin->largest_free = block->size;
         }
+    }
+}
+
+/// Writes one row of the map of the heap.
+/// \param f The file.
+/// \param json Whether the rows are JSON objects instead of CSV lines.
+/// \param first Whether it is the first row, for the commas of JSON.
+/// \param kind What the row is about.
+/// \param index The index of the page or of the bin.
+/// \param row The counters of the row.
+void write_map_row(FILE *f, bool json, bool first, const char *kind,
+                   size_t index, const PageMap *row) {
+    size_t total = row->used_bytes + row->free_bytes;
+    double occupancy = total == 0 ? 0 : (double) row->used_bytes / total;
+    // 0 when all the free bytes are in one block, close to 1 when they are
+    // scattered in small ones.
+    double fragmentation = row->free_bytes == 0 ? 0 :
+            1 - (double) row->largest_free / row->free_bytes;
+    if (json) {
+        fprintf(f, "%s\n  {\"kind\": \"%s\", \"index\": %zu, "
+                   "\"address\": \"%p\", \"size\": %zu, "
+                   "\"used_blocks\": %zu, \"used_bytes\": %zu, "
+                   "\"free_blocks\": %zu, \"free_bytes\": %zu, "
+                   "\"largest_free\": %zu, \"occupancy\": %.4f, "
+                   "\"fragmentation\": %.4f}", first ? "" : ",", kind,
+                index, row->page, row->page_size, row->used_blocks,
+                row->used_bytes, row->free_blocks, row->free_bytes,
+                row->largest_free, occupancy, fragmentation);
+    } else {
+        fprintf(f, "%s,%zu,%p,%zu,%zu,%zu,%zu,%zu,%zu,%.4f,%.4f\n", kind,
+                index, row->page, row->page_size, row->used_blocks,
+                row->used_bytes, row->free_blocks, row->free_bytes,
+                row->largest_free, occupancy, fragmentation);
+    }
+}
+
+/// Writes the map of the calling thread's arena: one row per page, one
+/// for all the large mappings, and one per bin with free areas.
+/// \param f The file.
+/// \param format STR_MAP_CSV or STR_MAP_JSON.
+void str_heap_map(FILE *f, int format) {
+    static const char *const kinds[2] = {"string", "data"};
+    // Too big for the stack of a thread.
+    static HeapMap map;
+    memset(&map, 0, sizeof(map));
+    str_heap_walk(map_block, &map);
 
-        for (size_t j = 0; j < base_size / sizeof(size_t); j++) {
-            if ((size_t *) *block_inspector != NULL) {
-                used_size += base_size * power(2, index);
-                index++;
-                advance_word_size_t(block_inspector, 1);
-            } else {
-                index++;
-                advance_word_size_t(block_inspector, 1);
+    bool json = format == STR_MAP_JSON;
+    bool first = true;
+    if (json) {
+        fprintf(f, "[");
+    } else {
+        fprintf(f, "kind,index,address,size,used_blocks,used_bytes,"
+                   "free_blocks,free_bytes,largest_free,occupancy,"
+                   "fragmentation\n");
+    }
+    for (int kind = 0; kind < 2; kind++) {
+        for (size_t i = 0; i < HANDLER_PAGES; i++) {
+            if (map.pages[kind][i].page != NULL) {
+                write_map_row(f, json, first, kinds[kind], i,
+                              &map.pages[kind][i]);
+                first = false;
             }
         }
     }
+    if (map.large.used_blocks != 0) {
+        write_map_row(f, json, first, "large", 0, &map.large);
+        first = false;
+    }
+    for (size_t i = 0; i < SIZE_CLASSES; i++) {
+        if (map.bins[i].free_blocks != 0) {
+            write_map_row(f, json, first, "bin", i, &map.bins[i]);
+            first = false;
+        }
+    }
+    if (json) {
+        fprintf(f, "\n]\n");
+    }
+}
+
+/*
+ * String kernels. Each one has a scalar version and, on x86-64, versions
+ * for SSE4.2 (16 byte vectors) and AVX2 (32 byte vectors), picked at the
+ * first call from what the processor supports. The vector loops use
+ * unaligned loads, since views start anywhere in their block, and never
+ * read past the end of a string except for a single vector that stays in
+ * the same system page as its last byte, which is always mapped.
+ */
+
+// The kernels of one level of vector instructions.
+typedef struct Kernels {
+    // Index of the first byte that differs, n if none does.
+    size_t (*mismatch)(const char *a, const char *b, size_t n);
+    size_t (*find_byte)(const char *data, size_t n, unsigned char c);
+    size_t (*find)(const char *haystack, size_t n, const char *needle,
+                   size_t m);
+    uint32_t (*hash)(const char *data, size_t n);
+} Kernels;
+
+/// Tells if a load of `width` bytes at `p` stays in the system page of p.
+/// System pages are at least 4 KiB, which is all this needs.
+/// \param p The address of the load.
+/// \param width Size of the load.
+/// \return true if the load can't fault when p is readable.
+bool load_in_page(const void *p, size_t width) {
+    return ((size_t) p & 4095) <= 4096 - width;
+}
+
+/// Scalar mismatch, a word at a time.
+/// \param a The first bytes.
+/// \param b The second bytes.
+/// \param n Number of bytes to compare.
+/// \return Index of the first byte that differs, n if none does.
+size_t mismatch_scalar(const char *a, const char *b, size_t n) {
+    size_t i = 0;
+    for (; i + sizeof(size_t) <= n; i += sizeof(size_t)) {
+        size_t x, y;
+        memcpy(&x, a + i, sizeof(size_t));
+        memcpy(&y, b + i, sizeof(size_t));
+        if (x != y) {
+            // Little endian, the first byte is the lowest.
+            return i + __builtin_ctzl(x ^ y) / 8;
+        }
+    }
+    for (; i < n; i++) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+size_t find_byte_scalar(const char *data, size_t n, unsigned char c) {
+    const char *found = memchr(data, c, n);
+    return found == NULL ? STR_NOT_FOUND : (size_t) (found - data);
+}
+
+size_t find_scalar(const char *haystack, size_t n, const char *needle,
+                   size_t m) {
+    const char *found = memmem(haystack, n, needle, m);
+    return found == NULL ? STR_NOT_FOUND : (size_t) (found - haystack);
+}
+
+// CRC-32C (Castagnoli) table, the polynomial of the SSE4.2 instruction,
+// so that every level gives the same hashes.
+uint32_t crc32c_table[256];
+
+/// Fills the table of the scalar CRC-32C, once.
+void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+uint32_t hash_scalar(const char *data, size_t n) {
+    uint32_t crc = (uint32_t) -1;
+    for (size_t i = 0; i < n; i++) {
+        crc = crc32c_table[(crc ^ (unsigned char) data[i]) & 0xff] ^
+              (crc >> 8);
+    }
+    return ~crc;
+}
+
+const Kernels scalar_kernels = {
+        mismatch_scalar, find_byte_scalar, find_scalar, hash_scalar
+};
+
+#if defined(__x86_64__)
+/*
+ * The SSE4.2 and AVX2 versions are the same loops with vectors of 16 and
+ * 32 bytes. Only the loads and compares differ, so they are written once
+ * as macros over these names.
+ */
+#define SIMD_KERNELS(suffix, isa, Vector, WIDTH, load, set1, cmpeq,          \
+                     movemask, full)                                         \
+                                                                             \
+__attribute__((target(isa)))                                                 \
+size_t mismatch_##suffix(const char *a, const char *b, size_t n) {           \
+    size_t i = 0;                                                            \
+    for (; i + WIDTH <= n; i += WIDTH) {                                     \
+        uint32_t equal = movemask(cmpeq(load((const Vector *) (a + i)),      \
+                                        load((const Vector *) (b + i))));    \
+        if (equal != full) {                                                 \
+            return i + __builtin_ctz(~equal);                                \
+        }                                                                    \
+    }                                                                        \
+    if (i == n) {                                                            \
+        return n;                                                            \
+    }                                                                        \
+    if (n >= WIDTH) {                                                        \
+        /* The last vector overlaps bytes already known to be equal. */      \
+        i = n - WIDTH;                                                       \
+    } else if (!load_in_page(a, WIDTH) || !load_in_page(b, WIDTH)) {         \
+        return mismatch_scalar(a, b, n);                                     \
+    }                                                                        \
+    uint32_t equal = movemask(cmpeq(load((const Vector *) (a + i)),          \
+                                    load((const Vector *) (b + i))));        \
+    /* Only the bytes of the strings count. */                               \
+    uint32_t valid = n - i >= WIDTH ? full :                                 \
+                     (uint32_t) (((uint64_t) 1 << (n - i)) - 1);             \
+    uint32_t differ = ~equal & valid;                                        \
+    return differ == 0 ? n : i + __builtin_ctz(differ);                      \
+}                                                                            \
+                                                                             \
+__attribute__((target(isa)))                                                 \
+size_t find_byte_##suffix(const char *data, size_t n, unsigned char c) {     \
+    Vector wanted = set1((char) c);                                          \
+    size_t i = 0;                                                            \
+    for (; i + WIDTH <= n; i += WIDTH) {                                     \
+        uint32_t found = movemask(cmpeq(load((const Vector *) (data + i)),   \
+                                        wanted));                            \
+        if (found != 0) {                                                    \
+            return i + __builtin_ctz(found);                                 \
+        }                                                                    \
+    }                                                                        \
+    if (i == n) {                                                            \
+        return STR_NOT_FOUND;                                                \
+    }                                                                        \
+    if (n >= WIDTH) {                                                        \
+        i = n - WIDTH;                                                       \
+    } else if (!load_in_page(data, WIDTH)) {                                 \
+        return find_byte_scalar(data, n, c);                                 \
+    }                                                                        \
+    uint32_t found = movemask(cmpeq(load((const Vector *) (data + i)),       \
+                                    wanted));                                \
+    found &= n - i >= WIDTH ? full :                                         \
+             (uint32_t) (((uint64_t) 1 << (n - i)) - 1);                     \
+    return found == 0 ? STR_NOT_FOUND : i + __builtin_ctz(found);            \
+}                                                                            \
+                                                                             \
+/* The candidates are the positions where both the first and the last        \
+   byte of the needle match, a vector of positions at a time, and only       \
+   those are compared in full. */                                            \
+__attribute__((target(isa)))                                                 \
+size_t find_##suffix(const char *haystack, size_t n, const char *needle,     \
+                     size_t m) {                                             \
+    if (m == 0) {                                                            \
+        return 0;                                                            \
+    }                                                                        \
+    if (m > n) {                                                             \
+        return STR_NOT_FOUND;                                                \
+    }                                                                        \
+    if (m == 1) {                                                            \
+        return find_byte_##suffix(haystack, n, *needle);                     \
+    }                                                                        \
+    Vector first = set1(needle[0]);                                          \
+    Vector last = set1(needle[m - 1]);                                       \
+    size_t i = 0;                                                            \
+    for (; i + m - 1 + WIDTH <= n; i += WIDTH) {                             \
+        uint32_t candidates =                                                \
+                movemask(cmpeq(load((const Vector *) (haystack + i)),        \
+                               first)) &                                     \
+                movemask(cmpeq(load((const Vector *)                         \
+                                            (haystack + i + m - 1)),         \
+                               last));                                       \
+        while (candidates != 0) {                                            \
+            size_t at = i + __builtin_ctz(candidates);                       \
+            if (memcmp(haystack + at + 1, needle + 1, m - 2) == 0) {         \
+                return at;                                                   \
+            }                                                                \
+            candidates &= candidates - 1;                                    \
+        }                                                                    \
+    }                                                                        \
+    size_t rest = find_scalar(haystack + i, n - i, needle, m);               \
+    return rest == STR_NOT_FOUND ? STR_NOT_FOUND : i + rest;                 \
+}
+
+#include <immintrin.h>
+
+// The compares give a mask of bytes, movemask a bit per byte.
+#define SSE_MOVEMASK(v) ((uint32_t) _mm_movemask_epi8(v))
+#define AVX_MOVEMASK(v) ((uint32_t) _mm256_movemask_epi8(v))
+
+SIMD_KERNELS(sse42, "sse4.2", __m128i, 16, _mm_loadu_si128, _mm_set1_epi8,
+             _mm_cmpeq_epi8, SSE_MOVEMASK, 0xffffu)
+SIMD_KERNELS(avx2, "avx2", __m256i, 32, _mm256_loadu_si256,
+             _mm256_set1_epi8, _mm256_cmpeq_epi8, AVX_MOVEMASK,
+             0xffffffffu)
+
+/// CRC-32C with the instruction of SSE4.2, 8 bytes at a time.
+__attribute__((target("sse4.2")))
+uint32_t hash_sse42(const char *data, size_t n) {
+    uint64_t crc = (uint32_t) -1;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t crc32 = (uint32_t) crc;
+    for (; i < n; i++) {
+        crc32 = _mm_crc32_u8(crc32, (unsigned char) data[i]);
+    }
+    return ~crc32;
+}
+
+const Kernels sse42_kernels = {
+        mismatch_sse42, find_byte_sse42, find_sse42, hash_sse42
+};
+// The CRC instruction works on 8 bytes at most, AVX2 has nothing better.
+const Kernels avx2_kernels = {
+        mismatch_avx2, find_byte_avx2, find_avx2, hash_sse42
+};
+#endif
+
+// The kernels in use, NULL until the first call picks them.
+const Kernels *kernels = NULL;
+int kernels_level = STR_SIMD_SCALAR;
+
+/// Returns the best level of kernels the processor supports.
+/// \return A level of enum StrSimd.
+int best_simd_level(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("sse4.2")) {
+        return STR_SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return STR_SIMD_SSE42;
+    }
+#endif
+    return STR_SIMD_SCALAR;
+}
+
+/// Uses the kernels of a level, or the best one the processor supports if
+/// it is lower.
+/// \param level A level of enum StrSimd.
+/// \return The level in use.
+int str_simd_set(int level) {
+    int best = best_simd_level();
+    if (level > best) {
+        level = best;
+    }
+    if (crc32c_table[1] == 0) {
+        crc32c_init();
+    }
+    const Kernels *chosen = &scalar_kernels;
+#if defined(__x86_64__)
+    if (level == STR_SIMD_AVX2) {
+        chosen = &avx2_kernels;
+    } else if (level == STR_SIMD_SSE42) {
+        chosen = &sse42_kernels;
+    }
+#endif
+    kernels_level = level;
+    __atomic_store_n(&kernels, chosen, __ATOMIC_RELEASE);
+    return level;
+}
+
+/// Returns the kernels in use, picking the best ones at the first call.
+/// Threads that race here all pick the same ones.
+/// \return The kernels.
+const Kernels *current_kernels(void) {
+    const Kernels *current = __atomic_load_n(&kernels, __ATOMIC_ACQUIRE);
+    if (current == NULL) {
+        str_simd_set(STR_SIMD_AVX2);
+        current = kernels;
+    }
+    return current;
+}
+
+/// Tells if two strings have the same content.
+/// \param a The first string.
+/// \param b The second string.
+/// \return true if they have the same size and bytes, false also if a
+/// rope had no room to be flattened.
+bool str_equal(String *a, String *b) {
+    if (a->size != b->size) {
+        return false;
+    }
+    if (a == b) {
+        return true;
+    }
+    size_t n = a->size;
+    // The strings stay where they are until the comparison is over.
+    Arena *arena = enter_arena();
+    const char *x = str_cdata(a);
+    const char *y = str_cdata(b);
+    bool equal = x != NULL && y != NULL &&
+                 current_kernels()->mismatch(x, y, n) == n;
+    leave_arena(arena);
+    return equal;
+}
+
+/// Compares two strings in the order of their bytes, as unsigned, then of
+/// their sizes.
+/// \param a The first string.
+/// \param b The second string.
+/// \return Negative, zero or positive as a is before, equal to or after b,
+/// zero also if a rope had no room to be flattened.
+int str_compare(String *a, String *b) {
+    size_t n = a->size < b->size ? a->size : b->size;
+    Arena *arena = enter_arena();
+    const unsigned char *x = (const unsigned char *) str_cdata(a);
+    const unsigned char *y = (const unsigned char *) str_cdata(b);
+    if (x == NULL || y == NULL) {
+        leave_arena(arena);
+        return 0;
+    }
+    size_t i = current_kernels()->mismatch((const char *) x,
+                                           (const char *) y, n);
+    int order = i < n ? (x[i] < y[i] ? -1 : 1) :
+                a->size < b->size ? -1 : a->size > b->size;
+    leave_arena(arena);
+    return order;
+}
+
+/// Finds the first occurrence of a byte in a string.
+/// \param str The string.
+/// \param c The byte.
+/// \return Its index, STR_NOT_FOUND if it isn't there or if a rope had no
+/// room to be flattened.
+size_t str_find_byte(String *str, int c) {
+    Arena *arena = enter_arena();
+    const char *data = str_cdata(str);
+    size_t index = data == NULL ? STR_NOT_FOUND :
+                   current_kernels()->find_byte(data, str->size,
+                                                (unsigned char) c);
+    leave_arena(arena);
+    return index;
+}
 
-    return used_size;
+/// Finds the first occurrence of the content of a string in another.
+/// \param haystack The string searched.
+/// \param needle The string searched for.
+/// \return The index where it starts, STR_NOT_FOUND if it isn't there or
+/// if a rope had no room to be flattened.
+size_t str_find(String *haystack, String *needle) {
+    Arena *arena = enter_arena();
+    const char *needle_data = str_cdata(needle);
+    const char *haystack_data = str_cdata(haystack);
+    size_t index = needle_data == NULL || haystack_data == NULL ?
+                   STR_NOT_FOUND :
+                   current_kernels()->find(haystack_data, haystack->size,
+                                           needle_data, needle->size);
+    leave_arena(arena);
+    return index;
 }
 
+/// Hashes the content of a string with CRC-32C, the same on every level
+/// of kernels.
+/// \param str The string.
+/// \return The hash, 0 if a rope had no room to be flattened.
+uint32_t str_hash(String *str) {
+    Arena *arena = enter_arena();
+    const char *data = str_cdata(str);
+    uint32_t hash = data == NULL ? 0 :
+                    current_kernels()->hash(data, str->size);
+    leave_arena(arena);
+    return hash;
+}
@@ -1,36 +1,466 @@
 /* stralloc.h --- Bibliothèque d'allocation de chaînes de caractères.  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 /* `String' et le type des chaînes de caractères.  */
 typedef struct String String;
 
-/* Allocation d'une chaîne de `size` bytes.  */
+/* Allocation d'une chaîne de `size` bytes.  Renvoie NULL quand il n'y a
+   plus de place pour la chaîne, ce qui n'arrive qu'avec des pages bornées
+   par `str_config` ou un fichier plein en mode persistant.  Les autres
+   fonctions qui créent une chaîne font de même.  */
 String *str_alloc (size_t size);
 
 /* Taille en bytes de la chaîne `str`.  */
 size_t str_size (String *str);
 
-/* Pointeur sur le tableau de bytes de la chaîne `str`.  */
+/* Pointeur sur le tableau de bytes de la chaîne `str`.  Renvoie NULL
+   quand il n'y a pas de place pour la copie qu'il faut parfois lui
+   donner (voir `str_dup` et `str_concat`), la chaîne reste alors telle
+   qu'elle était.  */
 char *str_data (String *str);
 
+/* Pointeur sur le tableau de bytes de la chaîne `str`, pour le lire
+   seulement: contrairement à `str_data`, une chaîne qui partage son
+   contenu n'en reçoit pas de copie.  Renvoie NULL de même quand il faut
+   aplatir une concaténation et qu'il n'y a pas de place.  */
+const char *str_cdata (String *str);
+
+/* Renvoie une copie de `str` en temps constant: les deux chaînes
+   partagent leur contenu jusqu'au premier `str_data` de l'une d'elles,
+   qui lui en donne sa propre copie.  Attention, `str` elle-même devient
+   une vue de ce contenu partagé, comme avec `str_substr`: un pointeur
+   obtenu par `str_data (str)` avant l'appel pointe dans ce contenu, et
+   écrire par lui changerait aussi la copie.  Contrairement au reste de
+   la bibliothèque, où les pointeurs de `str_data` restent valables
+   jusqu'à la prochaine compaction, il faut donc rappeler `str_data`
+   après `str_dup` ou `str_substr` avant d'écrire dans `str`.  */
+String *str_dup (String *str);
+
+/* Renvoie la chaîne des `size` bytes de `str` à partir de `offset`, qui
+   partage le contenu de `str` comme celle de `str_dup`.  Les chaînes
+   partagées ne comptent qu'une fois dans `str_livesize`, et le bloc
+   qu'elles partagent compte pour une chaîne de plus dans `str_stats`.
+   En mode multi-thread, `str_dup` et `str_substr` copient le contenu.  */
+String *str_substr (String *str, size_t offset, size_t size);
+
+/* Renvoie la chaîne dont le contenu est les `n` bytes de `p`, toujours la
+   même tant qu'elle n'a pas été libérée autant de fois qu'elle a été
+   renvoyée: un contenu répété n'occupe de la place qu'une fois.  Son
+   contenu et sa taille ne doivent pas être modifiés.  En mode
+   multi-thread, chaque appel renvoie une nouvelle chaîne.  */
+String *str_intern (const char *p, size_t n);
+
+/* Opérations sur le contenu des chaînes, vectorisées avec SSE4.2 ou
+   AVX2 selon ce que le processeur permet, et sinon écrites en C.
+   `str_compare` compare les bytes comme non signés, puis les tailles.
+   Les recherches renvoient l'index de la première occurrence, ou
+   STR_NOT_FOUND.  `str_hash` est un CRC-32C, le même quel que soit le
+   niveau.  Les données d'une chaîne de plus de 24 bytes qui ne partage
+   pas celles d'une autre commencent sur une frontière de 16 bytes.
+   Quand `str_cdata` renvoie NULL pour une des chaînes, `str_equal`
+   renvoie false, `str_compare` 0, les recherches STR_NOT_FOUND et
+   `str_hash` 0.  */
+#define STR_NOT_FOUND ((size_t) -1)
+bool str_equal (String *a, String *b);
+int str_compare (String *a, String *b);
+size_t str_find_byte (String *str, int c);
+size_t str_find (String *haystack, String *needle);
+uint32_t str_hash (String *str);
+
+/* Limite les opérations ci-dessus à un niveau d'instructions (par défaut
+   le meilleur), par exemple pour les comparer.  Renvoie le niveau
+   utilisé, qui peut être plus bas si le processeur ne le permet pas.  */
+enum StrSimd
+{
+  STR_SIMD_SCALAR,
+  STR_SIMD_SSE42,
+  STR_SIMD_AVX2
+};
+int str_simd_set (int level);
+
 /* Libère l'espace occupé par la chaîne `str`.  */
 void str_free (String *str);
 
+/* Alloue `n` chaînes d'un coup, de tailles `sizes[0]` à `sizes[n-1]`,
+   et met leurs pointeurs dans `out`.  Les cases sont prises un mot de
+   drapeaux à la fois et les données de chaînes voisines sont découpées
+   dans une même zone, si bien que chaque chaîne coûte bien moins qu'un
+   appel à `str_alloc`.  Les chaînes qui n'ont plus de place, à la fin de
+   `out`, y sont NULL.  */
+void str_alloc_batch (const size_t *sizes, size_t n, String **out);
+
+/* Libère les `n` chaînes de `strs`, comme autant d'appels à `str_free`
+   mais en regroupant les mises à jour des drapeaux.  Les pointeurs NULL
+   sont ignorés.  */
+void str_free_batch (String **strs, size_t n);
+
+/* Change la taille de `str` à `size` bytes, en gardant son contenu
+   jusqu'à la plus petite des deux tailles.  La chaîne grandit sur place
+   quand elle a de la place après elle, sinon elle est déplacée avec de la
+   marge, si bien que des agrandissements successifs coûtent O(1) en
+   moyenne.  Les `str_data` obtenus auparavant ne sont plus valides, et
+   `str` ne doit pas être l'opérande d'une "rope" pas encore copiée.  En
+   mode multi-thread, seul le thread qui a alloué `str` peut la
+   redimensionner.  Renvoie faux, sans rien changer, quand il n'y a plus
+   de place pour la chaîne.  */
+bool str_resize (String *str, size_t size);
+
+/* Ajoute les `n` bytes de `src` à la fin de `dst`, comme `str_resize`.
+   `src` peut faire partie de `dst`.  */
+bool str_append (String *dst, const char *src, size_t n);
+
+/* Fixe la taille (1 Mo par défaut) au-delà de laquelle une chaîne a sa
+   propre projection mmap, arrondie à des pages entières, au lieu d'une
+   zone dans les pages de données.  Elle est rendue au système par
+   `str_free`, et `str_resize` l'agrandit avec `mremap`, sans copier son
+   contenu.  Ne concerne que les chaînes allouées ou déplacées ensuite.  */
+void str_large_threshold (size_t size);
+
 /* Renvoie la concaténation des deux chaînes `s1` et `s2`.  */
 String *str_concat (String *s1, String *s2);
 
+/* Active ou désactive le mode "rope", où `str_concat` ne copie rien: la
+   nouvelle chaîne garde une référence à `s1` et `s2`, et son contenu
+   n'est copié qu'une fois, au premier `str_data` ou au prochain
+   `str_compact`.  `s1` et `s2` peuvent être libérées entre-temps.  Sans
+   effet en mode multi-thread.  */
+void str_ropes_enable (bool enable);
+
 /* Compacte l'espace occupé par toutes les chaînes de caractères, de manière
    à éliminer la framgmentation.  Vous pouvez présumer que le client
    ne va pas utiliser `str_data' pendant la compaction ni utiliser après
-   la compaction un str_data obtenu auparavant.  */
+   la compaction un str_data obtenu auparavant.  Quand il n'y a pas de
+   place pour les copies, rien n'est déplacé.  */
 void str_compact (void);
 
-/* Renvoie la somme des `str_size` des chaînes actuellement utilisées.  */
+/* Comme `str_compact`, mais les copies sont réparties entre `threads`
+   threads (un par processeur si 0), chacun copiant une suite de chaînes
+   qui fait à peu près le même nombre de bytes.  Le contenu des chaînes
+   et la mémoire occupée sont les mêmes qu'avec `str_compact`; seules les
+   "ropes" sont mises après les autres chaînes.  */
+void str_compact_parallel (size_t threads);
+
+/* Comme `str_compact`, mais sans demander de mémoire au système: les
+   chaînes sont glissées vers le début des pages de données existantes,
+   puis les pages restées vides sont rendues au système.  */
+void str_compact_in_place (void);
+
+/* Compacte seulement les pages de données peu occupées, les plus vides
+   d'abord, en déplaçant au plus `max_bytes_moved` bytes de chaînes:
+   une page n'est vidée que si toutes ses chaînes tiennent dans ce qui
+   reste du budget.  Les mêmes précautions que pour `str_compact`
+   s'appliquent.  Renvoie le nombre de bytes déplacés.  */
+size_t str_compact_partial (size_t max_bytes_moved);
+
+/* Fixe le taux d'occupation (entre 0 et 1, 0.5 par défaut) sous lequel
+   `str_compact_partial` vide une page de données.  */
+void str_compact_threshold (double occupancy);
+
+/* Compaction en arrière-plan: un thread vide, toutes les `interval_ms`
+   millisecondes, les pages de données occupées à moins du seuil de
+   `str_compact_threshold`, pendant que les autres threads continuent
+   d'allouer.  Il ne déplace que quelques dizaines de Ko à la fois, entre
+   lesquels les opérations du thread propriétaire des chaînes reprennent.
+   Il s'occupe des chaînes des threads (ou de toutes sans le mode
+   multi-thread), mais pas de celles des arènes de `str_arena_create`.
+   Pendant qu'il tourne, une chaîne peut changer de place entre deux
+   appels: un pointeur obtenu par `str_data` ou `str_cdata` ne reste
+   valable que si la chaîne a été épinglée avant par `str_pin`, et
+   jusqu'au `str_unpin` correspondant.  Une chaîne épinglée n'est jamais
+   déplacée, sa page attend le passage suivant.  `str_pin` et `str_unpin`
+   peuvent être appelées de n'importe quel thread et s'emboîtent; une
+   chaîne doit être désépinglée avant d'être libérée.  Un thread qui
+   utilise la chaîne d'un autre doit l'épingler.
+   `str_compact_background_start` renvoie false si le thread tourne déjà
+   ou n'a pas pu être créé, et `str_compact_background_stop` attend qu'il
+   ait fini.  `str_pin` renvoie false, sans épingler la chaîne, quand il
+   n'y a pas de place pour la noter ou pour copier son contenu.  */
+bool str_compact_background_start (unsigned interval_ms);
+void str_compact_background_stop (void);
+bool str_pin (String *str);
+void str_unpin (String *str);
+
+/* Rend au système la mémoire physique inutilisée sans rien déplacer: les
+   pages entières au milieu des zones libres des pages de données, par
+   `madvise` (MADV_DONTNEED, ou MADV_REMOVE en mode persistant), qui
+   redeviennent des pages de zéros au prochain accès, et les pages de
+   `String` dont aucune case n'est utilisée, qui sont démappées.  Les
+   pages de données restent réservées, donc `str_usedsize` ne baisse que
+   des pages de `String`, mais la mémoire résidente baisse de tout.  Une
+   zone libre déjà rendue n'est plus examinée tant qu'elle n'a pas
+   changé.  Renvoie le nombre de bytes rendus, qui comptent aussi les
+   pages libres qui n'avaient jamais été touchées.  */
+size_t str_release_free_memory (void);
+
+/* Avec un seuil non nul, `str_free` et `str_free_batch` appellent
+   `str_release_free_memory` dès que l'arène a libéré au moins `bytes`
+   bytes de zones de données depuis la dernière fois.  0 par défaut, pour
+   ne le faire que sur demande.  */
+void str_release_threshold (size_t bytes);
+
+/* Renvoie la somme des `str_size` des chaînes actuellement utilisées.
+   En mode "rope", une chaîne libérée dont une "rope" pas encore copiée
+   garde une référence compte encore, jusqu'à ce que cette "rope" soit
+   copiée ou libérée.  */
 size_t str_livesize (void);
 
 /* Renvoie le nombre de bytes disponibles dans la "free list".  */
 size_t str_freesize (void);
 
+/* Renvoie la taille du plus grand bloc de la "free list".  */
+size_t str_largestfree (void);
+
 /* Renvoie le nombre de bytes alloués par la librairie (via mmap).  */
 size_t str_usedsize (void);
+
+/* Les mesures ci-dessus, prises d'un seul coup, avec en plus le nombre de
+   chaînes utilisées et le nombre de pages obtenues par mmap.  Sauf
+   `largestfree`, elles sont tenues à jour par chaque allocation et
+   libération, et ne coûtent donc rien à consulter.  */
+typedef struct StrStats
+{
+  size_t livesize;
+  size_t freesize;
+  size_t usedsize;
+  size_t largestfree;
+  size_t strings;
+  size_t pages;
+} StrStats;
+StrStats str_stats (void);
+
+/* Instrumentation des opérations, compilée seulement avec
+   -DSTR_INSTRUMENT (`make instrumented`): sans elle, aucun compteur n'est
+   tenu et aucune opération n'est chronométrée.  Les latences sont
+   comptées par puissance de 2: la case `i` compte les appels qui ont pris
+   entre 2^i et 2^(i+1) nanosecondes.  */
+enum StrOp
+{
+  STR_OP_ALLOC,
+  STR_OP_FREE,
+  STR_OP_CONCAT,
+  STR_OP_RESIZE,
+  STR_OP_COMPACT,
+  STR_OPS
+};
+#define STR_LATENCY_BUCKETS 40
+typedef struct StrInstrument
+{
+  size_t calls[STR_OPS];
+  size_t latency[STR_OPS][STR_LATENCY_BUCKETS];
+  /* Zones des listes libres examinées et pages de données essayées pour
+     trouver une zone.  */
+  size_t freelist_nodes;
+  size_t data_pages_probed;
+  /* Pages de `String` et mots de drapeaux examinés pour trouver une
+     case.  */
+  size_t string_pages_probed;
+  size_t flag_words_scanned;
+  /* Appels système sur les pages, et pages prises dans la réserve.  */
+  size_t mmaps;
+  size_t munmaps;
+  size_t mremaps;
+  size_t madvises;
+  size_t reserved;
+  /* Bytes copiés par les compactions, et par `str_concat` ou la copie
+     différée d'une "rope".  */
+  size_t compact_bytes;
+  size_t concat_bytes;
+  /* Bytes rendus au système par `str_release_free_memory`.  */
+  size_t released_bytes;
+} StrInstrument;
+
+/* Copie les compteurs dans `out`.  Renvoie faux, avec `out` à zéro, si
+   l'instrumentation n'est pas compilée.  */
+bool str_instrument (StrInstrument *out);
+
+/* Remet les compteurs à zéro.  */
+void str_instrument_reset (void);
+
+/* Écrit dans `f` les mesures de `str_stats` puis, si elle est compilée,
+   l'instrumentation: une ligne `clé=valeur` par sorte de mesure, et une
+   par case non vide des histogrammes.  */
+void str_stats_dump (FILE *f);
+
+/* Arènes indépendantes: les chaînes d'une arène créée par
+   `str_arena_create` ont leurs propres pages, et sont libérées toutes
+   ensemble par `str_arena_reset`, qui garde les pages pour les prochaines
+   allocations, ou par `str_arena_destroy`, qui les rend au système avec
+   l'arène.  Les deux coûtent un temps proportionnel au nombre de pages et
+   non de chaînes, qui ne doivent plus être utilisées ensuite.  `str_free`
+   et les autres fonctions sur une chaîne s'appliquent aussi à celles
+   d'une arène, et les fonctions `str_arena_*` font comme leurs
+   homologues sur l'arène donnée au lieu de l'arène par défaut.  Une
+   "rope" ou une chaîne partagée ne doit pas survivre à l'arène de ses
+   opérandes.  En mode persistant, seules les chaînes de l'arène par
+   défaut sont retrouvées à la réouverture du fichier.  */
+typedef struct Arena StrArena;
+StrArena *str_arena_create (void);
+void str_arena_reset (StrArena *arena);
+void str_arena_destroy (StrArena *arena);
+String *str_arena_alloc (StrArena *arena, size_t size);
+String *str_arena_concat (StrArena *arena, String *s1, String *s2);
+void str_arena_compact (StrArena *arena);
+void str_arena_compact_parallel (StrArena *arena, size_t threads);
+size_t str_arena_release_free_memory (StrArena *arena);
+size_t str_arena_livesize (StrArena *arena);
+size_t str_arena_freesize (StrArena *arena);
+size_t str_arena_largestfree (StrArena *arena);
+size_t str_arena_usedsize (StrArena *arena);
+StrStats str_arena_stats (StrArena *arena);
+
+/* Parcours du tas: `walker` est appelé pour chaque case de `String`,
+   chaque zone des pages de données, libre ou non, et chaque grosse chaîne
+   de l'arène, dans l'ordre des pages puis des adresses.  Les chaînes ne
+   doivent pas être allouées ni libérées pendant le parcours.  */
+enum StrBlockKind
+{
+  STR_BLOCK_CELL,       /* une case de `String` */
+  STR_BLOCK_AREA,       /* une zone d'une page de données */
+  STR_BLOCK_LARGE       /* la zone d'une grosse chaîne */
+};
+typedef struct StrBlock
+{
+  int kind;
+  bool used;
+  const void *address;
+  /* Taille du bloc, en-têtes compris pour une zone.  */
+  size_t size;
+  /* La page du bloc, son index parmi les pages de sa sorte, et sa
+     taille.  Une grosse chaîne est seule dans sa projection, d'index
+     448.  */
+  const void *page;
+  size_t page_index;
+  size_t page_size;
+  /* La chaîne du bloc, NULL s'il est libre.  */
+  String *owner;
+} StrBlock;
+typedef void (*StrHeapWalker) (const StrBlock *block, void *ctx);
+void str_heap_walk (StrHeapWalker walker, void *ctx);
+void str_arena_heap_walk (StrArena *arena, StrHeapWalker walker, void *ctx);
+
+/* Écrit dans `f` la carte du tas, en CSV (une ligne d'en-tête, puis une
+   ligne par rangée) ou en JSON (un tableau d'objets).  Il y a une rangée
+   par page (`string` ou `data`), une pour toutes les grosses chaînes
+   (`large`) et une par classe de taille des zones libres (`bin`, dont la
+   taille est la plus petite de la classe).  Chacune donne le nombre et
+   la taille des blocs utilisés et libres, le plus grand bloc libre,
+   l'occupation et la fragmentation: 1 moins le plus grand bloc libre sur
+   l'espace libre, 0 quand il est d'un seul tenant.  Pas pendant qu'un
+   autre thread l'appelle.  */
+enum StrMapFormat
+{
+  STR_MAP_CSV,
+  STR_MAP_JSON
+};
+void str_heap_map (FILE *f, int format);
+
+/* Politique d'obtention des pages, à fixer avec `str_config` avant la
+   première allocation.  Un champ à 0 garde le comportement par défaut.  */
+typedef struct StrConfig
+{
+  /* Taille de la première page de chaque sorte, arrondie à une puissance
+     de 2 d'au moins une page du système (par défaut une page).  */
+  size_t base_page_size;
+  /* Les pages doublent de taille d'une à l'autre jusqu'à cette taille,
+     puis la gardent (par défaut sans limite).  Il y a au plus 448 pages de
+     chaque sorte, ce qui limite le nombre de chaînes (`str_alloc` renvoie
+     alors NULL); les données qui n'y trouvent plus de place ont leur
+     propre projection.  */
+  size_t max_page_size;
+  /* Les pages d'au moins cette taille demandent des "huge pages", avec
+     MADV_HUGEPAGE ou, si `hugetlb`, MAP_HUGETLB quand le système en a de
+     réservées (par défaut jamais).  */
+  size_t huge_page_size;
+  bool hugetlb;
+  /* Les pages sont remplies dès leur création (MAP_POPULATE) plutôt
+     qu'au premier accès.  */
+  bool populate;
+  /* Réserve d'un coup cette quantité d'espace d'adresses, d'où les pages
+     sont ensuite prises sans appel système, et où celles libérées
+     resservent.  MAP_HUGETLB ne s'y applique pas.  */
+  size_t reserve;
+} StrConfig;
+void str_config (const StrConfig *config);
+
+/* Mode persistant: les pages sont prises dans le fichier `path`, projeté
+   avec MAP_SHARED, de `size` bytes s'il est créé.  Un fichier existant est
+   projeté à la même adresse qu'à sa création, et toutes les chaînes qu'il
+   avait à son dernier `str_checkpoint` sont de nouveau utilisables, sans
+   copie, avec les mêmes pointeurs.  À appeler avant la première
+   allocation, et sans le mode multi-thread.  La taille du fichier borne
+   la mémoire disponible, et les grosses chaînes y restent dans les pages
+   de données.  Quand il est plein, `str_alloc` et les autres fonctions qui
+   créent une chaîne renvoient NULL, et `str_resize` faux.  Pour que ce
+   soient les seules à en demander, `str_concat`, `str_dup` et
+   `str_substr` y copient toujours le contenu, et `str_compact` et
+   `str_compact_parallel` compactent sur place, comme
+   `str_compact_in_place`.  Renvoie faux si le fichier n'a pas pu être
+   projeté.  */
+bool str_persist_open (const char *path, size_t size);
+
+/* Écrit dans le fichier l'état de la bibliothèque et toutes les pages
+   (msync).  Le fichier n'est cohérent qu'à un checkpoint: après un arrêt
+   brutal, il ne l'est que si rien n'a changé depuis le dernier.  */
+void str_checkpoint (void);
+
+/* Racines, les chaînes par lesquelles le client retrouve les siennes
+   après avoir rouvert le fichier, par exemple une chaîne qui contient un
+   tableau de `String *`.  */
+#define STR_ROOTS 64
+void str_root_set (size_t index, String *str);
+String *str_root (size_t index);
+
+/* Enregistre dans le fichier `path` chaque appel à `str_alloc`,
+   `str_alloc_batch`, `str_free`, `str_free_batch`, `str_concat`,
+   `str_resize` (et donc `str_append`), `str_dup`, `str_substr`,
+   `str_intern` et aux compactions de l'arène par défaut, jusqu'à
+   `str_trace_stop`, qui écrit les derniers enregistrements.  Les appels
+   sur les chaînes des arènes de `str_arena_create` ne sont pas
+   enregistrés, et une chaîne faite de l'une d'elles par `str_concat`,
+   `str_dup` ou `str_substr` l'est comme une allocation.  Les
+   enregistrements passent par un tampon, écrit dans le fichier quand il
+   est plein.  L'outil
+   `replay` rejoue une trace et mesure le comportement de la bibliothèque.
+   Renvoie faux si le fichier n'a pas pu être créé.  */
+bool str_trace_start (const char *path);
+void str_trace_stop (void);
+
+/* Format d'une trace: les 8 bytes de STR_TRACE_MAGIC, puis un
+   enregistrement par appel: un byte d'opération, l'écart en
+   nanosecondes avec l'enregistrement précédent, puis les champs de
+   l'opération.  Les nombres sont en LEB128 (7 bits par byte, le bit de
+   poids fort à 1 sauf sur le dernier).  L'identifiant d'une chaîne est
+   son adresse divisée par 8, écrite comme l'écart avec l'identifiant
+   précédent de la trace, en "zigzag" (le signe dans le bit de poids
+   faible).  */
+#define STR_TRACE_MAGIC "STRTRC01"
+enum StrTraceOp
+{
+  STR_TRACE_ALLOC,      /* chaîne, taille */
+  STR_TRACE_FREE,       /* chaîne */
+  STR_TRACE_CONCAT,     /* résultat, s1, s2 */
+  STR_TRACE_COMPACT,    /* sorte, puis le budget pour la partielle */
+  STR_TRACE_RESIZE,     /* chaîne, taille */
+  STR_TRACE_DUP,        /* résultat, chaîne */
+  STR_TRACE_SUBSTR,     /* résultat, chaîne, début, taille */
+  STR_TRACE_INTERN      /* chaîne, taille, hachage du contenu */
+};
+enum StrTraceCompact
+{
+  STR_TRACE_COMPACT_FULL,
+  STR_TRACE_COMPACT_IN_PLACE,
+  STR_TRACE_COMPACT_PARTIAL
+};
+
+/* Active le mode multi-thread, à appeler avant de créer les threads.
+   Chaque thread alloue alors dans ses propres pages, sans verrou, et une
+   chaîne libérée par un autre thread que celui qui l'a allouée lui est
+   rendue par une file sans verrou.  `str_compact` et les fonctions de
+   taille ne concernent plus que les chaînes allouées par le thread
+   appelant, et la compaction ne doit pas avoir lieu pendant qu'un autre
+   thread utilise l'une de ces chaînes.  */
+void str_threads_enable (void);
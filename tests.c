@@ -5,8 +5,14 @@
  */
 #include "stralloc.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 static void writestr (String *s)
 {
@@ -22,15 +28,1216 @@ static String *mkstr (const char *s)
 }
 
 #define ASSERT(exp) test (__LINE__, exp)
+static int errors = 0;
 static void test (int line, bool res)
 {
   if (!res)
-    printf ("Erreur de test à la ligne %d\n", line);
+    {
+      printf ("Erreur de test à la ligne %d\n", line);
+      errors++;
+    }
 }
 
+static void fill (String *s, char c)
+{
+  memset (str_data (s), c, str_size (s));
+}
+
+static bool filled_with (String *s, char c)
+{
+  for (size_t i = 0; i < str_size (s); i++)
+    if (str_data (s)[i] != c)
+      return false;
+  return true;
+}
+
+/* Alloue et libère des chaînes de tailles variées, pour que les zones
+   libres se retrouvent dans plusieurs classes de taille.  */
+static void test_churn (void)
+{
+  enum { N = 300 };
+  String *strs[N];
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc ((i * 37) % 700);
+      fill (strs[i], 'a' + i % 26);
+    }
+  size_t free_before = str_freesize ();
+  size_t freed = 0;
+  for (int i = 0; i < N; i += 2)
+    {
+      freed += str_size (strs[i]);
+      str_free (strs[i]);
+    }
+  ASSERT (str_freesize () >= free_before + freed);
+  for (int i = 0; i < N; i += 2)
+    {
+      strs[i] = str_alloc ((i * 53) % 500);
+      fill (strs[i], 'A' + i % 26);
+    }
+  for (int i = 0; i < N; i++)
+    ASSERT (filled_with (strs[i], (i % 2 ? 'a' : 'A') + i % 26));
+  for (int i = 0; i < N; i++)
+    str_free (strs[i]);
+}
+
+/* Des blocs voisins libérés dans le désordre doivent se fusionner pour
+   redonner un seul grand bloc libre.  */
+static void test_coalesce (void)
+{
+  enum { N = 64, SIZE = 200 };
+  String *strs[N];
+  for (int i = 0; i < N; i++)
+    strs[i] = str_alloc (SIZE);
+  for (int i = 0; i < N; i += 2)
+    str_free (strs[i]);
+  for (int i = 1; i < N; i += 2)
+    str_free (strs[i]);
+  ASSERT (str_largestfree () >= N * SIZE);
+}
+/* Les cases libérées au milieu de pages pleines doivent être réutilisées
+   avant d'en demander de nouvelles au système.  */
+static void test_slots (void)
+{
+  enum { N = 20000 };
+  static String *strs[N];
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc (1);
+      *str_data (strs[i]) = i % 128;
+    }
+  size_t used = str_usedsize ();
+  for (int i = 0; i < N; i += 7)
+    str_free (strs[i]);
+  for (int i = 0; i < N; i += 7)
+    {
+      strs[i] = str_alloc (1);
+      *str_data (strs[i]) = i % 128;
+    }
+  ASSERT (str_usedsize () == used);
+  for (int i = 0; i < N; i++)
+    ASSERT (*str_data (strs[i]) == i % 128);
+  for (int i = 0; i < N; i++)
+    str_free (strs[i]);
+}
+
+/* Après avoir libéré la plupart des chaînes, les pages peu occupées sont
+   vidées dans les autres sans dépasser le budget.  */
+static void test_compact_partial (void)
+{
+  enum { N = 4000 };
+  static String *strs[N];
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc (100);
+      fill (strs[i], 'a' + i % 26);
+    }
+  for (int i = 0; i < N; i++)
+    if (i % 10 != 0)
+      str_free (strs[i]);
+  ASSERT (str_compact_partial (1000) <= 1000);
+  size_t used = str_usedsize ();
+  size_t live = str_livesize ();
+  ASSERT (str_compact_partial ((size_t) -1) > 0);
+  ASSERT (str_usedsize () < used);
+  ASSERT (str_livesize () == live);
+  for (int i = 0; i < N; i += 10)
+    {
+      ASSERT (filled_with (strs[i], 'a' + i % 26));
+      str_free (strs[i]);
+    }
+}
+
+/* La compaction en arrière-plan vide les pages peu occupées pendant que
+   ce thread continue, sans déplacer les chaînes épinglées.  */
+static void test_compact_background (void)
+{
+  enum { N = 4000 };
+  static String *strs[N];
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc (100);
+      fill (strs[i], 'a' + i % 26);
+    }
+  for (int i = 0; i < N; i++)
+    if (i % 10 != 0)
+      str_free (strs[i]);
+  str_pin (strs[0]);
+  str_pin (strs[10]);
+  str_pin (strs[10]);
+  str_unpin (strs[10]);
+  const char *pinned[2] = { str_cdata (strs[0]), str_cdata (strs[10]) };
+  size_t used = str_usedsize ();
+  size_t live = str_livesize ();
+  ASSERT (str_compact_background_start (1));
+  ASSERT (!str_compact_background_start (1));
+  /* Chaque appel laisse le thread prendre le verrou de l'arène.  */
+  for (int i = 0; i < 2000 && str_usedsize () >= used; i++)
+    {
+      String *s = str_alloc (50);
+      fill (s, 'z');
+      ASSERT (filled_with (s, 'z'));
+      str_free (s);
+      nanosleep (&(struct timespec) { 0, 1000000 }, NULL);
+    }
+  str_compact_background_stop ();
+  ASSERT (str_usedsize () < used);
+  ASSERT (str_livesize () == live);
+  ASSERT (str_cdata (strs[0]) == pinned[0]);
+  ASSERT (str_cdata (strs[10]) == pinned[1]);
+  str_unpin (strs[0]);
+  str_unpin (strs[10]);
+  for (int i = 0; i < N; i += 10)
+    {
+      ASSERT (filled_with (strs[i], 'a' + i % 26));
+      str_free (strs[i]);
+    }
+}
+
+/* La compaction avec plusieurs threads donne les mêmes pages que celle
+   avec un seul, pour les mêmes allocations dans deux arènes, et une
+   "rope" y est aussi aplatie.  */
+static void test_compact_parallel (void)
+{
+  enum { N = 6000 };
+  static String *strs[2][N];
+  StrArena *arenas[2] = { str_arena_create (), str_arena_create () };
+  for (int a = 0; a < 2; a++)
+    {
+      for (int i = 0; i < N; i++)
+        {
+          strs[a][i] = str_arena_alloc (arenas[a], (i * 131) % 5000);
+          fill (strs[a][i], 'a' + i % 26);
+        }
+      for (int i = 0; i < N; i++)
+        if (i % 4 != 0)
+          str_free (strs[a][i]);
+    }
+  size_t used = str_arena_usedsize (arenas[0]);
+  str_arena_compact (arenas[0]);
+  str_arena_compact_parallel (arenas[1], 4);
+  ASSERT (str_arena_usedsize (arenas[0]) < used);
+  StrStats serial = str_arena_stats (arenas[0]);
+  StrStats parallel = str_arena_stats (arenas[1]);
+  ASSERT (memcmp (&serial, &parallel, sizeof serial) == 0);
+  for (int i = 0; i < N; i += 4)
+    ASSERT (filled_with (strs[1][i], 'a' + i % 26));
+
+  str_ropes_enable (true);
+  String *rope = str_arena_concat (arenas[1], strs[1][4], strs[1][8]);
+  str_ropes_enable (false);
+  size_t size = str_size (strs[1][4]);
+  str_arena_compact_parallel (arenas[1], 0);
+  ASSERT (filled_with (strs[1][0], 'a'));
+  ASSERT (str_cdata (rope)[size - 1] == 'e' && str_cdata (rope)[size] == 'i');
+  str_arena_destroy (arenas[0]);
+  str_arena_destroy (arenas[1]);
+}
+
+/* La compaction sur place glisse les chaînes vers le début des pages
+   existantes: le contenu ne change pas et les pages vidées sont rendues.  */
+static void test_compact_in_place (void)
+{
+  enum { N = 3000 };
+  static String *strs[N];
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc ((i * 97) % 3000);
+      fill (strs[i], 'a' + i % 26);
+    }
+  for (int i = 0; i < N; i++)
+    if (i % 3 != 0)
+      str_free (strs[i]);
+  size_t used = str_usedsize ();
+  size_t live = str_livesize ();
+  str_compact_in_place ();
+  ASSERT (str_usedsize () < used);
+  ASSERT (str_livesize () == live);
+  for (int i = 0; i < N; i += 3)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+
+  /* Les zones libres reconstruites doivent resservir.  */
+  for (int i = 1; i < N; i += 3)
+    {
+      strs[i] = str_alloc (i % 500);
+      fill (strs[i], 'A' + i % 26);
+    }
+  for (int i = 0; i < N; i += 3)
+    {
+      ASSERT (filled_with (strs[i], 'a' + i % 26));
+      ASSERT (filled_with (strs[i + 1], 'A' + (i + 1) % 26));
+      str_free (strs[i]);
+      str_free (strs[i + 1]);
+    }
+}
+
+/* Les petites chaînes sont gardées dans leur `String`, sans prendre de
+   place dans les pages de données, et survivent à la compaction.  */
+static void test_inline (void)
+{
+  enum { N = 40 };
+  String *strs[N];
+  size_t live = str_livesize ();
+  size_t free = str_freesize ();
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc (i);
+      fill (strs[i], 'a' + i % 26);
+      if (i == 24)
+        ASSERT (str_freesize () == free);
+    }
+  String *s = str_concat (strs[10], strs[12]);
+  ASSERT (str_size (s) == 22 && str_data (s)[21] == 'm');
+  str_compact ();
+  str_compact_in_place ();
+  for (int i = 0; i < N; i++)
+    {
+      ASSERT (filled_with (strs[i], 'a' + i % 26));
+      str_free (strs[i]);
+    }
+  str_free (s);
+  ASSERT (str_livesize () == live);
+}
+
+/* En mode "rope", la boucle de `main` ne copie rien avant le premier
+   `str_data`, même si les opérandes sont libérées entre-temps.  */
+static void test_ropes (void)
+{
+  str_ropes_enable (true);
+  size_t live = str_livesize ();
+  String *s1 = mkstr ("hello ");
+  String *s2 = mkstr ("world ");
+  String *s3 = str_concat (s1, s2);
+  size_t used = str_usedsize ();
+  for (int i = 0; i < 20; i++)
+    {
+      String *s4 = str_concat (s3, s3);
+      str_free (s3);
+      s3 = s4;
+    }
+  str_free (s1);
+  ASSERT (str_usedsize () == used);
+  ASSERT (str_size (s3) == 12 << 20);
+
+  String *s5 = str_concat (s2, s3);
+  char *data = str_data (s3);
+  ASSERT (memcmp (data, "hello world hello ", 18) == 0);
+  ASSERT (memcmp (data + (12 << 20) - 6, "world ", 6) == 0);
+  /* Les étapes intermédiaires ont été libérées.  */
+  ASSERT (str_livesize () == live + 6 + (12 << 20) + 6 + (12 << 20));
+
+  /* La compaction aussi donne son contenu à une "rope".  */
+  str_compact ();
+  size_t free = str_freesize ();
+  ASSERT (memcmp (str_data (s5), "world hello world ", 18) == 0);
+  ASSERT (str_freesize () == free);
+  ASSERT (memcmp (str_data (s5) + (12 << 20), "world ", 6) == 0);
+  str_free (s2);
+  str_free (s3);
+  str_free (s5);
+  ASSERT (str_livesize () == live);
+  str_ropes_enable (false);
+}
+
+/* Des ajouts successifs ne déplacent la chaîne que rarement, et une
+   chaîne suivie d'un bloc libre grandit sur place.  */
+static void test_append (void)
+{
+  enum { N = 10000 };
+  size_t live = str_livesize ();
+  String *s = str_alloc (0);
+  char *data = str_data (s);
+  int moves = 0;
+  for (int i = 0; i < N; i++)
+    {
+      str_append (s, i % 2 ? "b" : "a", 1);
+      if (str_data (s) != data)
+        moves++;
+      data = str_data (s);
+    }
+  ASSERT (str_size (s) == N);
+  ASSERT (moves < 30);
+  for (int i = 0; i < N; i++)
+    ASSERT (str_data (s)[i] == (i % 2 ? 'b' : 'a'));
+  str_append (s, str_data (s), 4);
+  ASSERT (memcmp (str_data (s) + N, "abab", 4) == 0);
+
+  /* Retour en place dans la `String`, puis de nouveau dans une page.  */
+  str_resize (s, 5);
+  ASSERT (memcmp (str_data (s), "ababa", 5) == 0);
+  str_resize (s, 100);
+  ASSERT (memcmp (str_data (s), "ababa", 5) == 0);
+  ASSERT (str_livesize () == live + 100);
+  str_free (s);
+
+  /* Seule dans sa page de données, la chaîne a toute la place après
+     elle.  */
+  str_large_threshold ((size_t) -1);
+  String *big = str_alloc (3 << 20);
+  data = str_data (big);
+  str_resize (big, (3 << 20) + 100000);
+  ASSERT (str_data (big) == data);
+  str_free (big);
+  str_large_threshold (1 << 20);
+  ASSERT (str_livesize () == live);
+}
+
+/* Une grosse chaîne a sa propre projection, rendue dès sa libération,
+   et grandit sans perdre son contenu.  */
+static void test_large (void)
+{
+  enum { SIZE = (3 << 20) + 1 };
+  StrStats before = str_stats ();
+  String *big = str_alloc (SIZE);
+  fill (big, 'x');
+  StrStats stats = str_stats ();
+  ASSERT (stats.pages == before.pages + 1);
+  ASSERT (stats.usedsize - before.usedsize < SIZE + 4096 + 16);
+  ASSERT (stats.freesize == before.freesize);
+
+  for (int i = 0; i < 4; i++)
+    str_append (big, str_data (big), str_size (big));
+  ASSERT (str_size (big) == (size_t) SIZE * 16);
+  ASSERT (filled_with (big, 'x'));
+  ASSERT (str_usedsize () - before.usedsize < (size_t) SIZE * 16 + 4096 + 16);
+
+  /* La compaction ne la déplace pas.  */
+  char *data = str_data (big);
+  str_compact ();
+  ASSERT (str_data (big) == data);
+  str_resize (big, 100);
+  ASSERT (filled_with (big, 'x'));
+  str_free (big);
+  stats = str_stats ();
+  ASSERT (stats.livesize == before.livesize);
+  ASSERT (stats.pages <= before.pages);
+}
+
+/* Les chaînes allouées en lot sont utilisables comme les autres, et
+   leurs zones se libèrent et fusionnent comme si elles avaient été
+   allouées une à une.  */
+static void test_batch (void)
+{
+  enum { N = 5000 };
+  static size_t sizes[N];
+  static String *strs[N];
+  StrStats before = str_stats ();
+  size_t total = 0;
+  for (int i = 0; i < N; i++)
+    {
+      sizes[i] = i % 500 == 0 ? 100000 : (i * 31) % 300;
+      total += sizes[i];
+    }
+  str_alloc_batch (sizes, N, strs);
+  ASSERT (str_livesize () == before.livesize + total);
+  ASSERT (str_stats ().strings == before.strings + N);
+  for (int i = 0; i < N; i++)
+    {
+      ASSERT (str_size (strs[i]) == sizes[i]);
+      fill (strs[i], 'a' + i % 26);
+    }
+  for (int i = 0; i < N; i++)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+
+  /* Une chaîne libérée seule au milieu d'un lot redonne sa place.  */
+  str_free (strs[1]);
+  strs[1] = str_alloc (sizes[1]);
+  fill (strs[1], 'b');
+  str_compact_in_place ();
+  for (int i = 0; i < N; i++)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+
+  size_t free = str_freesize ();
+  str_free_batch (strs, N);
+  StrStats stats = str_stats ();
+  ASSERT (stats.livesize == before.livesize);
+  ASSERT (stats.strings == before.strings);
+  ASSERT (stats.freesize >= free + total);
+  ASSERT (stats.largestfree >= 100000);
+  /* Les cases libérées resservent.  */
+  size_t used = str_usedsize ();
+  for (int i = 0; i < N; i++)
+    sizes[i] = 8;
+  str_alloc_batch (sizes, N, strs);
+  ASSERT (str_usedsize () == used);
+  str_free_batch (strs, N);
+}
+
+/* Les copies et sous-chaînes partagent le contenu de leur source, même
+   après sa libération et après une compaction, et n'en reçoivent une
+   copie qu'au premier `str_data`.  */
+static void test_share (void)
+{
+  enum { SIZE = 10000 };
+  size_t live = str_livesize ();
+  String *s = str_alloc (SIZE);
+  for (int i = 0; i < SIZE; i++)
+    str_data (s)[i] = 'a' + i % 26;
+  size_t free = str_freesize ();
+
+  /* La source a sa propre copie au `str_data` qui suit la copie.  */
+  String *before = str_dup (s);
+  char *rewritten = str_data (s);
+  rewritten[0] = 'X';
+  ASSERT (str_cdata (before)[0] == 'a');
+  rewritten[0] = 'a';
+  str_free (before);
+  free = str_freesize ();
+
+  String *dup = str_dup (s);
+  String *sub = str_substr (s, 26, 1000);
+  String *subsub = str_substr (sub, 26, 100);
+  String *small = str_substr (s, 1, 3);
+  ASSERT (str_freesize () == free);
+  ASSERT (str_livesize () == live + SIZE + 3);
+  ASSERT (str_cdata (dup) == str_cdata (s));
+  ASSERT (str_cdata (sub) == str_cdata (s) + 26);
+  ASSERT (str_cdata (subsub) == str_cdata (s) + 52);
+  ASSERT (memcmp (str_cdata (small), "bcd", 3) == 0);
+  str_free (s);
+  str_free (small);
+  str_compact ();
+  ASSERT (str_size (sub) == 1000 && str_size (subsub) == 100);
+  ASSERT (memcmp (str_cdata (subsub), "abcdef", 6) == 0);
+  ASSERT (str_cdata (dup) + 52 == str_cdata (subsub));
+
+  /* Écrire dans une copie ne change pas les autres.  */
+  str_data (dup)[0] = 'X';
+  ASSERT (str_cdata (sub) != str_cdata (dup) + 26);
+  ASSERT (str_cdata (sub)[0] == 'a');
+  ASSERT (str_livesize () == live + 2 * SIZE);
+  str_free (dup);
+  /* La dernière vue reprend la zone de son bloc.  */
+  str_free (subsub);
+  free = str_freesize ();
+  str_data (sub)[1] = 'Y';
+  ASSERT (str_freesize () == free);
+  ASSERT (memcmp (str_data (sub), "aYcdef", 6) == 0);
+  ASSERT (str_livesize () == live + 1000);
+  str_append (sub, str_data (sub), 10);
+  ASSERT (memcmp (str_data (sub) + 1000, "aYcdef", 6) == 0);
+  str_free (sub);
+  ASSERT (str_livesize () == live);
+}
+
+/* Un même contenu interné donne toujours la même chaîne, jusqu'à ce
+   qu'elle soit libérée autant de fois qu'elle a été donnée.  */
+static void test_intern (void)
+{
+  enum { N = 2800, KEYS = 700 };
+  static String *strs[N];
+  char key[64];
+  size_t live = str_livesize ();
+  size_t keys_size = 0;
+  for (int i = 0; i < N; i++)
+    {
+      int len = sprintf (key, "host-%d.example.com", i % KEYS);
+      strs[i] = str_intern (key, len);
+      if (i < KEYS)
+        keys_size += len;
+      ASSERT (str_size (strs[i]) == (size_t) len);
+      ASSERT (memcmp (str_cdata (strs[i]), key, len) == 0);
+      ASSERT (strs[i] == strs[i % KEYS]);
+    }
+  ASSERT (str_livesize () == live + keys_size);
+  str_compact ();
+  ASSERT (str_intern ("host-1.example.com", 18) == strs[1]);
+  str_free (strs[1]);
+
+  /* Libérer la moitié des références ne retire aucune chaîne.  */
+  for (int i = 0; i < N / 2; i++)
+    str_free (strs[i]);
+  ASSERT (str_livesize () == live + keys_size);
+  for (int i = 0; i < KEYS; i++)
+    {
+      int len = sprintf (key, "host-%d.example.com", i);
+      ASSERT (str_intern (key, len) == strs[N - KEYS + i]);
+    }
+  for (int i = N / 2; i < N; i++)
+    str_free (strs[i]);
+  /* Il reste les références prises par la boucle précédente.  */
+  for (int i = 0; i < KEYS; i++)
+    str_free (strs[N - KEYS + i]);
+  ASSERT (str_livesize () == live);
+
+  /* Les chaînes retirées de la table ne sont plus trouvées.  */
+  String *s = str_intern ("host-1.example.com", 18);
+  String *t = mkstr ("host-1.example.com");
+  ASSERT (s != t && str_intern ("host-1.example.com", 18) == s);
+  str_free (s);
+  str_free (s);
+  str_free (t);
+  ASSERT (str_livesize () == live);
+}
+
+/* Les compteurs de `str_stats` suivent les allocations et libérations,
+   et concordent avec les autres fonctions de taille.  */
+static void test_stats (void)
+{
+  StrStats before = str_stats ();
+  String *a = str_alloc (100);
+  String *b = str_alloc (50000);
+  StrStats stats = str_stats ();
+  ASSERT (stats.strings == before.strings + 2);
+  ASSERT (stats.livesize == before.livesize + 50100);
+  ASSERT (stats.livesize == str_livesize ());
+  ASSERT (stats.freesize == str_freesize ());
+  ASSERT (stats.usedsize == str_usedsize ());
+  ASSERT (stats.largestfree == str_largestfree ());
+  ASSERT (stats.pages >= 3);
+  ASSERT (stats.usedsize > stats.livesize + stats.freesize);
+  str_free (b);
+  str_free (a);
+  stats = str_stats ();
+  ASSERT (stats.strings == before.strings);
+  ASSERT (stats.livesize == before.livesize);
+  /* Tout ce qui a été libéré est redevenu libre, en plus des nouvelles
+     pages.  */
+  ASSERT (stats.freesize >= before.freesize);
+  ASSERT (stats.freesize - before.freesize
+          <= stats.usedsize - before.usedsize);
+}
+
+/* Les opérations vectorisées donnent les mêmes résultats à chaque
+   niveau, pour toutes les tailles et tous les décalages, y compris sur
+   des vues qui commencent n'importe où.  */
+static int sign (int x)
+{
+  return (x > 0) - (x < 0);
+}
+
+static size_t naive_find (const char *h, size_t n, const char *s, size_t m)
+{
+  for (size_t i = 0; i + m <= n; i++)
+    if (memcmp (h + i, s, m) == 0)
+      return i;
+  return STR_NOT_FOUND;
+}
+
+static void test_simd (void)
+{
+  enum { N = 300 };
+  String *base = str_alloc (N + 64);
+  char *data = str_data (base);
+  for (int i = 0; i < N + 64; i++)
+    data[i] = 'a' + i % 7;
+  /* Des données allouées sont alignées sur 16 bytes.  */
+  for (size_t size = 25; size < 5000; size += 37)
+    {
+      String *s = str_alloc (size);
+      ASSERT ((size_t) str_cdata (s) % 16 == 0);
+      str_free (s);
+    }
+
+  uint32_t hashes[3][N];
+  for (int level = STR_SIMD_SCALAR; level <= STR_SIMD_AVX2; level++)
+    {
+      int used = str_simd_set (level);
+      ASSERT (used <= level);
+      for (int n = 0; n < N; n += n < 70 ? 1 : 13)
+        {
+          int offset = n % 19;
+          String *a = str_substr (base, offset, n);
+          String *b = mkstr ("");
+          str_resize (b, n);
+          memcpy (str_data (b), data + offset, n);
+          const char *x = str_cdata (a);
+          ASSERT (str_equal (a, b) && str_compare (a, b) == 0);
+          hashes[level][n] = str_hash (a);
+          ASSERT (str_hash (b) == hashes[level][n]);
+          ASSERT (hashes[level][n] == hashes[STR_SIMD_SCALAR][n]);
+          ASSERT (str_find_byte (a, 'z') == STR_NOT_FOUND);
+          if (n > 0)
+            {
+              /* Une différence à chaque position possible.  */
+              for (int d = 0; d < n; d += 1 + d / 8)
+                {
+                  str_data (b)[d] = 'z';
+                  ASSERT (!str_equal (a, b));
+                  ASSERT (str_compare (a, b) < 0 && str_compare (b, a) > 0);
+                  ASSERT (str_find_byte (b, 'z') == (size_t) d);
+                  str_data (b)[d] = x[d];
+                }
+              ASSERT (str_find_byte (a, x[n - 1])
+                      == (size_t) ((char *) memchr (x, x[n - 1], n) - x));
+              String *shorter = str_substr (a, 0, n - 1);
+              ASSERT (str_compare (shorter, a) < 0);
+              ASSERT (sign (str_compare (a, shorter)) == 1);
+              str_free (shorter);
+            }
+          for (int m = 0; m <= 12 && m <= n; m += 3)
+            {
+              String *needle = str_substr (a, n - m, m);
+              ASSERT (str_find (a, needle)
+                      == naive_find (x, n, str_cdata (needle), m));
+              str_free (needle);
+            }
+          String *absent = mkstr ("abcdefgabx");
+          ASSERT (str_find (a, absent) == STR_NOT_FOUND);
+          str_free (absent);
+          str_free (a);
+          str_free (b);
+        }
+    }
+  str_simd_set (STR_SIMD_AVX2);
+  str_free (base);
+}
+
+/* Le parcours du tas voit chaque chaîne une fois, et ses zones libres
+   font l'espace libre de l'arène.  */
+typedef struct HeapTotals
+{
+  size_t cells, used_areas, free_bytes, large;
+  bool owners_right;
+} HeapTotals;
+
+static void add_block (const StrBlock *block, void *ctx)
+{
+  HeapTotals *totals = ctx;
+  switch (block->kind)
+    {
+    case STR_BLOCK_CELL:
+      totals->cells += block->used;
+      break;
+    case STR_BLOCK_AREA:
+      if (!block->used)
+        totals->free_bytes += block->size;
+      else if (str_cdata (block->owner)
+               != (const char *) block->address + 2 * sizeof (size_t))
+        totals->owners_right = false;
+      else
+        totals->used_areas++;
+      break;
+    default:
+      totals->large++;
+      break;
+    }
+}
+
+static void test_heap_walk (void)
+{
+  enum { N = 2000 };
+  static String *strs[N];
+  StrArena *arena = str_arena_create ();
+  for (int i = 0; i < N; i++)
+    strs[i] = str_arena_alloc (arena, i % 3 == 0 ? 10 : 50 + i % 500);
+  str_arena_alloc (arena, 3 << 20);
+  for (int i = 0; i < N; i += 2)
+    str_free (strs[i]);
+
+  HeapTotals totals = { 0, 0, 0, 0, true };
+  str_arena_heap_walk (arena, add_block, &totals);
+  StrStats stats = str_arena_stats (arena);
+  ASSERT (totals.cells == stats.strings);
+  ASSERT (totals.owners_right);
+  /* Les chaînes de 10 bytes sont dans leur case.  */
+  size_t with_area = 0;
+  for (int i = 1; i < N; i += 2)
+    with_area += i % 3 != 0;
+  ASSERT (totals.used_areas == with_area);
+  ASSERT (totals.free_bytes == stats.freesize);
+  ASSERT (totals.large == 1);
+  str_arena_destroy (arena);
+
+  char *text;
+  size_t size;
+  FILE *f = open_memstream (&text, &size);
+  str_heap_map (f, STR_MAP_CSV);
+  fclose (f);
+  ASSERT (strncmp (text, "kind,index,address,size,", 24) == 0);
+  ASSERT (strstr (text, "\nstring,0,") != NULL);
+  ASSERT (strstr (text, "\ndata,") != NULL);
+  free (text);
+  f = open_memstream (&text, &size);
+  str_heap_map (f, STR_MAP_JSON);
+  fclose (f);
+  ASSERT (text[0] == '[' && strstr (text, "\"kind\": \"string\"") != NULL);
+  ASSERT (strcmp (text + size - 3, "\n]\n") == 0);
+  free (text);
+}
+
+/* Les compteurs de l'instrumentation suivent les appels quand elle est
+   compilée, et restent à zéro sinon.  */
+static void test_instrument (void)
+{
+  StrInstrument before, after;
+  bool enabled = str_instrument (&before);
+  String *a = str_alloc (1000);
+  String *b = str_alloc (3000);
+  String *c = str_concat (a, b);
+  str_free (a);
+  str_free (b);
+  str_compact ();
+  str_instrument (&after);
+  if (enabled)
+    {
+      ASSERT (after.calls[STR_OP_ALLOC] == before.calls[STR_OP_ALLOC] + 2);
+      ASSERT (after.calls[STR_OP_FREE] == before.calls[STR_OP_FREE] + 2);
+      ASSERT (after.calls[STR_OP_CONCAT] == before.calls[STR_OP_CONCAT] + 1);
+      ASSERT (after.calls[STR_OP_COMPACT] == before.calls[STR_OP_COMPACT] + 1);
+      ASSERT (after.freelist_nodes > before.freelist_nodes);
+      ASSERT (after.concat_bytes >= before.concat_bytes + 4000);
+      ASSERT (after.compact_bytes >= before.compact_bytes + 4000);
+      ASSERT (after.mmaps > before.mmaps);
+      size_t timed = 0;
+      for (int i = 0; i < STR_LATENCY_BUCKETS; i++)
+        timed += after.latency[STR_OP_ALLOC][i];
+      ASSERT (timed == after.calls[STR_OP_ALLOC]);
+    }
+  else
+    ASSERT (after.calls[STR_OP_ALLOC] == 0 && after.mmaps == 0);
+  str_free (c);
+
+  char *text;
+  size_t size;
+  FILE *f = open_memstream (&text, &size);
+  str_stats_dump (f);
+  fclose (f);
+  ASSERT (strncmp (text, "stats live=", 11) == 0);
+  ASSERT (strstr (text, enabled ? "instrument enabled=1"
+                                : "instrument enabled=0") != NULL);
+  free (text);
+}
+
+/* Une arène a ses propres pages et ses propres compteurs.  Sa remise à
+   zéro libère toutes ses chaînes et garde ses pages, sa destruction les
+   rend au système, sans que l'arène par défaut ne change.  */
+static void test_arena (void)
+{
+  enum { N = 3000 };
+  static String *strs[N];
+  StrStats main_before = str_stats ();
+  StrArena *arena = str_arena_create ();
+  ASSERT (str_arena_usedsize (arena) == 0);
+  size_t first_used = 0;
+
+  for (int round = 0; round < 3; round++)
+    {
+      for (int i = 0; i < N; i++)
+        {
+          strs[i] = str_arena_alloc (arena, 10 + i % 200);
+          fill (strs[i], 'a' + i % 26);
+        }
+      String *big = str_arena_alloc (arena, 2 << 20);
+      fill (big, 'z');
+      String *both = str_arena_concat (arena, strs[0], strs[1]);
+      ASSERT (str_size (both) == str_size (strs[0]) + str_size (strs[1]));
+      for (int i = 0; i < N; i += 2)
+        str_free (strs[i]);
+      str_arena_compact (arena);
+      for (int i = 1; i < N; i += 2)
+        ASSERT (filled_with (strs[i], 'a' + i % 26));
+      ASSERT (filled_with (big, 'z'));
+
+      StrStats stats = str_arena_stats (arena);
+      ASSERT (stats.strings == N / 2 + 2);
+      ASSERT (stats.livesize == str_arena_livesize (arena));
+      ASSERT (stats.freesize == str_arena_freesize (arena));
+      ASSERT (stats.largestfree == str_arena_largestfree (arena));
+      ASSERT (stats.usedsize == str_arena_usedsize (arena));
+      size_t used = stats.usedsize;
+
+      str_arena_reset (arena);
+      stats = str_arena_stats (arena);
+      ASSERT (stats.strings == 0);
+      ASSERT (stats.livesize == 0);
+      /* Les pages restent, sauf celle de la grosse chaîne.  */
+      ASSERT (stats.usedsize < used);
+      ASSERT (stats.usedsize >= used - (2 << 20) - 4096 * 2);
+      ASSERT (stats.freesize > 0);
+      /* Les tours suivants réutilisent les mêmes pages.  */
+      if (round == 0)
+        first_used = used;
+      ASSERT (used == first_used);
+    }
+
+  /* La copie et les parties d'une chaîne de l'arène y restent.  */
+  String *s = str_arena_alloc (arena, 1000);
+  fill (s, 'k');
+  String *copy = str_dup (s);
+  String *part = str_substr (s, 100, 500);
+  ASSERT (str_arena_livesize (arena) == 1000);
+  ASSERT (filled_with (copy, 'k') && filled_with (part, 'k'));
+  str_free (s);
+  str_free (copy);
+  str_free (part);
+  ASSERT (str_arena_livesize (arena) == 0);
+
+  StrStats main_after = str_stats ();
+  ASSERT (main_after.strings == main_before.strings);
+  ASSERT (main_after.usedsize == main_before.usedsize);
+  ASSERT (main_after.livesize == main_before.livesize);
+  ASSERT (main_after.freesize == main_before.freesize);
+  str_arena_destroy (arena);
+}
+
+/* Les pages entières des zones libres, et les pages de `String` qui n'ont
+   plus de chaîne, sont rendues au système sans toucher aux chaînes
+   restantes, et les zones rendues servent encore.  */
+static void test_release (void)
+{
+  enum { N = 64, BIG = 64 * 1024, SMALL = 20000 };
+  static String *big[N], *small[SMALL];
+  size_t page = sysconf (_SC_PAGESIZE);
+  StrArena *arena = str_arena_create ();
+  for (int i = 0; i < N; i++)
+    {
+      big[i] = str_arena_alloc (arena, BIG);
+      fill (big[i], 'a' + i % 26);
+    }
+  char *hole = (char *) (((size_t) str_cdata (big[1]) + 2 * page)
+                         & ~(page - 1));
+  for (int i = 1; i < N; i += 2)
+    str_free (big[i]);
+  ASSERT (str_arena_release_free_memory (arena) >= N / 2 * (BIG - 2 * page));
+  unsigned char resident = 1;
+  ASSERT (mincore (hole, page, &resident) == 0 && !(resident & 1));
+  /* Une zone déjà rendue n'est plus comptée.  */
+  ASSERT (str_arena_release_free_memory (arena) == 0);
+  for (int i = 1; i < N; i += 2)
+    {
+      big[i] = str_arena_alloc (arena, BIG);
+      fill (big[i], 'a' + i % 26);
+    }
+  for (int i = 0; i < N; i++)
+    {
+      ASSERT (filled_with (big[i], 'a' + i % 26));
+      str_free (big[i]);
+    }
+
+  for (int i = 0; i < SMALL; i++)
+    small[i] = str_arena_alloc (arena, 8);
+  size_t used = str_arena_usedsize (arena);
+  for (int i = 0; i < SMALL; i++)
+    str_free (small[i]);
+  ASSERT (str_arena_release_free_memory (arena) > 0);
+  ASSERT (str_arena_usedsize (arena) < used);
+  small[0] = str_arena_alloc (arena, 40);
+  fill (small[0], 'q');
+  ASSERT (filled_with (small[0], 'q'));
+  str_free (small[0]);
+
+  /* Avec un seuil, les libérations s'en chargent.  */
+  str_release_threshold (BIG);
+  for (int i = 0; i < N; i++)
+    big[i] = str_arena_alloc (arena, BIG);
+  for (int i = 0; i < N; i++)
+    str_free (big[i]);
+  ASSERT (str_arena_release_free_memory (arena) == 0);
+  /* Les libérations d'avant `str_arena_reset` ne comptent plus.  */
+  str_release_threshold (4 * BIG);
+  for (int i = 0; i < 3; i++)
+    str_free (str_arena_alloc (arena, BIG));
+  str_arena_reset (arena);
+  str_free (str_arena_alloc (arena, BIG));
+  ASSERT (str_arena_release_free_memory (arena) > 0);
+  str_release_threshold (0);
+  str_arena_destroy (arena);
+}
+
+/* Chaque thread alloue ses chaînes, puis libère celles du thread suivant.
+   Ces libérations à distance doivent revenir au bon thread.  */
+enum { THREADS = 4, PER_THREAD = 2000 };
+static String *thread_strs[THREADS][PER_THREAD];
+static pthread_barrier_t barrier;
+
+static void *thread_main (void *arg)
+{
+  long id = (long) arg;
+  /* Le thread qui reprend l'arène du thread principal en hérite les
+     chaînes.  */
+  size_t inherited = str_livesize ();
+  for (int i = 0; i < PER_THREAD; i++)
+    {
+      thread_strs[id][i] = str_alloc (1 + i % 100);
+      fill (thread_strs[id][i], 'a' + id);
+    }
+  size_t live = str_livesize ();
+  pthread_barrier_wait (&barrier);
+
+  long next = (id + 1) % THREADS;
+  for (int i = 0; i < PER_THREAD; i++)
+    {
+      ASSERT (filled_with (thread_strs[next][i], 'a' + next));
+      str_free (thread_strs[next][i]);
+    }
+  pthread_barrier_wait (&barrier);
+
+  /* Les chaînes libérées par l'autre thread ne sont plus comptées.  */
+  ASSERT (str_livesize () < live);
+  String *s = str_alloc (10);
+  ASSERT (str_livesize () == inherited + 10);
+  str_free (s);
+  return NULL;
+}
+
+static void test_threads (void)
+{
+  pthread_t threads[THREADS];
+  str_threads_enable ();
+  pthread_barrier_init (&barrier, NULL, THREADS);
+  for (long i = 0; i < THREADS; i++)
+    pthread_create (&threads[i], NULL, thread_main, (void *) i);
+  for (int i = 0; i < THREADS; i++)
+    pthread_join (threads[i], NULL);
+  pthread_barrier_destroy (&barrier);
+}
+
+/* Avec des pages de 16 Ko au départ qui ne dépassent pas 64 Ko, prises
+   dans un espace réservé.  Appelé dans un processus à part, avant toute
+   allocation.  */
+static void test_config (void)
+{
+  enum { N = 2000 };
+  static String *strs[N];
+  StrConfig config = { .base_page_size = 10000, .max_page_size = 100000,
+                       .reserve = (size_t) 1 << 30, .populate = true };
+  str_config (&config);
+  String *s = str_alloc (100);
+  StrStats stats = str_stats ();
+  /* Les deux en-têtes, une page de `String` et une de données.  */
+  ASSERT (stats.pages == 4);
+  ASSERT (stats.usedsize == 2 * (size_t) getpagesize () + 2 * 16384);
+  str_free (s);
+
+  for (int i = 0; i < N; i++)
+    {
+      strs[i] = str_alloc (i * 10);
+      fill (strs[i], 'a' + i % 26);
+    }
+  /* Trop grande pour une page de 64 Ko, elle a sa propre projection.  */
+  String *big = str_alloc (70000);
+  fill (big, 'z');
+  str_compact ();
+  size_t used = str_usedsize ();
+  for (int i = 0; i < N; i++)
+    {
+      ASSERT (filled_with (strs[i], 'a' + i % 26));
+      str_free (strs[i]);
+    }
+  ASSERT (filled_with (big, 'z'));
+  str_free (big);
+  ASSERT (str_livesize () == 0);
+  str_compact ();
+  ASSERT (str_usedsize () < used);
+}
+
+/* Avec des pages qui ne dépassent pas une page du système, les pages de
+   `String` finissent par manquer: `str_alloc` renvoie alors NULL, et de
+   nouveau des chaînes une fois d'autres libérées.  Appelé dans un
+   processus à part, avant toute allocation.  */
+static void test_config_cap (void)
+{
+  enum { N = 1000000 };
+  static String *strs[N];
+  StrConfig config = { .max_page_size = 4096 };
+  str_config (&config);
+  size_t n = 0;
+  while (n < N && (strs[n] = str_alloc (100)) != NULL)
+    {
+      fill (strs[n], 'a' + n % 26);
+      n++;
+    }
+  ASSERT (n > 20000 && n < N);
+  ASSERT (str_concat (strs[0], strs[1]) == NULL);
+  for (size_t i = 0; i < n; i++)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+  str_free (strs[0]);
+  strs[0] = str_alloc (100);
+  ASSERT (strs[0] != NULL);
+  for (size_t i = 0; i < n; i++)
+    str_free (strs[i]);
+  ASSERT (str_livesize () == 0);
+}
+
+/* Un premier processus remplit le fichier, un second le rouvre et y
+   retrouve les chaînes par la racine 0, qui contient leurs pointeurs.  */
+enum { PERSIST_N = 1000 };
+static char persist_path[] = "/tmp/stralloc-testXXXXXX";
+
+static void test_persist_write (void)
+{
+  ASSERT (str_persist_open (persist_path, 64 << 20));
+  String *table = str_alloc (PERSIST_N * sizeof (String *));
+  String **strs = (String **) str_data (table);
+  for (int i = 1; i < PERSIST_N; i++)
+    {
+      strs[i] = str_alloc (i * 7);
+      fill (strs[i], 'a' + i % 26);
+    }
+  /* Assez grande pour avoir sa propre projection sans le mode persistant.  */
+  strs[0] = str_alloc (3 << 20);
+  fill (strs[0], 'z');
+  str_free (str_alloc (5000));
+  /* Les épinglages ne sont pas gardés dans le fichier.  */
+  str_pin (strs[1]);
+  str_root_set (0, table);
+  str_checkpoint ();
+}
+
+static void test_persist_read (void)
+{
+  ASSERT (str_persist_open (persist_path, 0));
+  String *table = str_root (0);
+  ASSERT (table != NULL && str_size (table) == PERSIST_N * sizeof (String *));
+  String **strs = (String **) str_data (table);
+  ASSERT (filled_with (strs[0], 'z'));
+  for (int i = 1; i < PERSIST_N; i++)
+    ASSERT (str_size (strs[i]) == (size_t) i * 7
+            && filled_with (strs[i], 'a' + i % 26));
+  ASSERT (str_stats ().strings == PERSIST_N + 1);
+  str_pin (strs[2]);
+  str_unpin (strs[2]);
+  /* On continue d'allouer et de libérer comme avant.  */
+  for (int i = 1; i < PERSIST_N; i += 2)
+    str_free (strs[i]);
+  str_compact ();
+  String *s = str_alloc (100);
+  fill (s, 'q');
+  strs = (String **) str_data (table);
+  for (int i = 2; i < PERSIST_N; i += 2)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+  ASSERT (filled_with (s, 'q'));
+}
+
+/* Un fichier plein fait échouer les allocations, sans rien perdre, et
+   la compaction y refait de la place.  */
+static void test_persist_full (void)
+{
+  enum { N = 100000 };
+  static String *strs[N];
+  ASSERT (str_persist_open (persist_path, 1 << 20));
+  /* Une chaîne assez courte pour tenir dans sa cellule, qui ne doit pas
+     perdre son contenu si elle ne peut pas grandir.  */
+  String *w = str_alloc (10);
+  fill (w, 'w');
+  size_t n = 0;
+  while (n < N && (strs[n] = str_alloc (100)) != NULL)
+    {
+      fill (strs[n], 'a' + n % 26);
+      n++;
+    }
+  ASSERT (n > 1000 && n < N);
+  ASSERT (str_dup (strs[0]) == NULL);
+  ASSERT (!str_resize (strs[0], 1 << 20));
+  ASSERT (str_size (strs[0]) == 100);
+  ASSERT (!str_resize (w, 1 << 20));
+  ASSERT (str_size (w) == 10 && filled_with (w, 'w'));
+  for (size_t i = 0; i < n; i++)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+  for (size_t i = 0; i < n; i += 2)
+    str_free (strs[i]);
+  str_compact ();
+  String *s = str_alloc (100);
+  ASSERT (s != NULL);
+  fill (s, 'q');
+  for (size_t i = 1; i < n; i += 2)
+    ASSERT (filled_with (strs[i], 'a' + i % 26));
+  ASSERT (filled_with (s, 'q'));
+}
+
+/* Une trace garde chaque appel, dans l'ordre, avec ses champs.  */
+static char trace_path[] = "/tmp/stralloc-traceXXXXXX";
+
+static size_t trace_get (const unsigned char **p)
+{
+  size_t value = 0;
+  for (int shift = 0;; shift += 7)
+    {
+      unsigned char byte = *(*p)++;
+      value |= (size_t) (byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+}
+
+static void test_trace (void)
+{
+  ASSERT (str_trace_start (trace_path));
+  String *a = str_alloc (100);
+  String *b = str_alloc (5);
+  String *c = str_concat (a, b);
+  str_free (a);
+  str_compact ();
+  str_free (b);
+  str_free (c);
+  /* Les chaînes d'une arène à part ne sont pas enregistrées, et une
+     chaîne faite de l'une d'elles l'est comme une allocation.  */
+  StrArena *arena = str_arena_create ();
+  String *x = str_arena_alloc (arena, 50);
+  String *d = str_concat (x, x);
+  str_free (x);
+  str_free (d);
+  str_arena_destroy (arena);
+  str_trace_stop ();
+  /* Plus rien n'est enregistré.  */
+  str_free (str_alloc (10));
+
+  static unsigned char buffer[256];
+  FILE *f = fopen (trace_path, "rb");
+  size_t size = fread (buffer, 1, sizeof buffer, f);
+  fclose (f);
+  ASSERT (size > 8 && memcmp (buffer, STR_TRACE_MAGIC, 8) == 0);
+  static const int ops[] = { STR_TRACE_ALLOC, STR_TRACE_ALLOC,
+                             STR_TRACE_CONCAT, STR_TRACE_FREE,
+                             STR_TRACE_COMPACT, STR_TRACE_FREE,
+                             STR_TRACE_FREE, STR_TRACE_ALLOC,
+                             STR_TRACE_FREE };
+  static const int fields[] = { 2, 2, 3, 1, 1, 1, 1, 2, 1 };
+  size_t ids[9][3];
+  const unsigned char *p = buffer + 8;
+  size_t id = 0;
+  for (int i = 0; i < 9; i++)
+    {
+      ASSERT (*p++ == ops[i]);
+      trace_get (&p);
+      for (int k = 0; k < fields[i]; k++)
+        {
+          size_t field = trace_get (&p);
+          if (ops[i] != STR_TRACE_COMPACT && (ops[i] != STR_TRACE_ALLOC
+                                              || k == 0))
+            field = id += (field >> 1) ^ -(field & 1);
+          ids[i][k] = field;
+        }
+    }
+  ASSERT (p == buffer + size);
+  ASSERT (ids[0][1] == 100 && ids[1][1] == 5);
+  ASSERT (ids[2][1] == ids[0][0] && ids[2][2] == ids[1][0]);
+  ASSERT (ids[3][0] == ids[0][0] && ids[5][0] == ids[1][0]);
+  ASSERT (ids[6][0] == ids[2][0]);
+  ASSERT (ids[4][0] == STR_TRACE_COMPACT_FULL);
+  ASSERT (ids[7][1] == 100 && ids[8][0] == ids[7][0]);
+}
+
+/* Lance un test dans un processus à part, qui commence sans aucune
+   chaîne.  */
+static void isolated (void (*run) (void))
+{
+  if (fork () == 0)
+    {
+      run ();
+      exit (errors != 0);
+    }
+  int status;
+  wait (&status);
+  ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+}
 
 int main (int argc, char **argv)
 {
+  isolated (test_config);
+  isolated (test_config_cap);
+  close (mkstemp (persist_path));
+  isolated (test_persist_write);
+  isolated (test_persist_read);
+  /* Vide, le fichier est créé de nouveau.  */
+  truncate (persist_path, 0);
+  isolated (test_persist_full);
+  unlink (persist_path);
+  close (mkstemp (trace_path));
+  isolated (test_trace);
+  unlink (trace_path);
+
   String *s1 = mkstr ("hello ");
   String *s2 = mkstr ("world ");
   String *s3 = str_concat (s1, s2);
@@ -55,6 +1262,26 @@ int main (int argc, char **argv)
   writestr (s1); writestr (s2); printf ("\n");
 
   /* ¡¡¡ COMPLÉTER ICI !!!    Ajoutez vos tests ici.  */
+  test_churn ();
+  test_coalesce ();
+  test_slots ();
+  test_compact_partial ();
+  test_compact_parallel ();
+  test_compact_background ();
+  test_compact_in_place ();
+  test_inline ();
+  test_ropes ();
+  test_append ();
+  test_batch ();
+  test_large ();
+  test_share ();
+  test_intern ();
+  test_stats ();
+  test_arena ();
+  test_release ();
+  test_instrument ();
+  test_heap_walk ();
+  test_simd ();
 
   size_t live = str_livesize ();
   size_t free = str_freesize ();
@@ -64,5 +1291,9 @@ int main (int argc, char **argv)
   printf ("Live = %uld, free = %uld, used = %uld\n", live, free, used);
   printf ("Overhead = %uld, i.e. %.1f%%\n",
           overhead, 100 * (double) overhead / used);
-  return 0;
+
+  /* En dernier, puisque les fonctions de taille ne concernent ensuite
+     plus que le thread appelant.  */
+  test_threads ();
+  return errors != 0;
 }